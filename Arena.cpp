@@ -0,0 +1,134 @@
+#include "Arena.h"
+
+#include <algorithm>
+
+namespace memorypool
+{
+
+Arena::Arena(std::size_t blockSize, bool keepBlocks) : blockSize_(blockSize), keepBlocks_(keepBlocks)
+{
+}
+
+Arena::~Arena()
+{
+    release();
+}
+
+void Arena::reset()
+{
+    if (!keepBlocks_)
+    {
+        release();
+        return;
+    }
+    runDestructors();
+    if (first_ != nullptr)
+    {
+        current_ = first_;
+        cursor_ = bodyOf(first_);
+        end_ = endOf(first_);
+    }
+    usedBefore_ = 0;
+}
+
+void Arena::release()
+{
+    runDestructors();
+    BlockHeader* block = first_;
+    while (block != nullptr)
+    {
+        BlockHeader* next = block->next;
+        PageHeap::instance().deallocate(block);
+        block = next;
+    }
+    first_ = nullptr;
+    current_ = nullptr;
+    cursor_ = 1;
+    end_ = 0;
+    usedBefore_ = 0;
+    reservedBytes_ = 0;
+    blockCount_ = 0;
+}
+
+std::size_t Arena::bytesAllocated() const
+{
+    return current_ == nullptr ? 0 : usedBefore_ + (cursor_ - bodyOf(current_));
+}
+
+void* Arena::allocateSlow(std::size_t size, std::size_t alignment)
+{
+    // a block retained by reset() comes first, unless the request does not fit it
+    BlockHeader* next = current_ != nullptr ? current_->next : nullptr;
+    if (next == nullptr || size > endOf(next) - bodyOf(next) || alignment > endOf(next) - bodyOf(next) - size)
+    {
+        BlockHeader* block = newBlock(size, alignment);
+        if (current_ == nullptr)
+        {
+            block->next = first_;
+            first_ = block;
+        }
+        else
+        {
+            block->next = current_->next;
+            current_->next = block;
+        }
+        next = block;
+    }
+    enterBlock(next);
+
+    std::uintptr_t aligned = (cursor_ + alignment - 1) & ~(std::uintptr_t(alignment) - 1);
+    cursor_ = aligned + size;
+    return reinterpret_cast<void*>(aligned);
+}
+
+void Arena::runDestructors() noexcept
+{
+    while (destructors_ != nullptr)
+    {
+        Destructor* record = destructors_;
+        destructors_ = record->next;
+        record->destroy(record->object);
+    }
+}
+
+void Arena::enterBlock(BlockHeader* block)
+{
+    if (current_ != nullptr)
+    {
+        usedBefore_ += cursor_ - bodyOf(current_);
+    }
+    current_ = block;
+    cursor_ = bodyOf(block);
+    end_ = endOf(block);
+}
+
+Arena::BlockHeader* Arena::newBlock(std::size_t size, std::size_t alignment)
+{
+    // room for the header, the padding an aligned start may need and the request itself
+    const std::size_t overhead = sizeof(BlockHeader) + alignment;
+    if (size > SIZE_MAX - overhead - PAGE_HEAP_PAGE_SIZE)
+    {
+        throw std::bad_alloc();
+    }
+    std::size_t bytes = std::max(blockSize_, size + overhead);
+    bytes = (bytes + PAGE_HEAP_PAGE_SIZE - 1) & ~static_cast<std::size_t>(PAGE_HEAP_PAGE_SIZE - 1);
+
+    auto* block = static_cast<BlockHeader*>(PageHeap::instance().allocateLarge(bytes));
+    block->next = nullptr;
+    block->size = bytes;
+    reservedBytes_ += bytes;
+    ++blockCount_;
+    return block;
+}
+
+std::uintptr_t Arena::bodyOf(BlockHeader* block)
+{
+    return reinterpret_cast<std::uintptr_t>(block) + sizeof(BlockHeader);
+}
+
+std::uintptr_t Arena::endOf(BlockHeader* block)
+{
+    return reinterpret_cast<std::uintptr_t>(block) + block->size;
+}
+
+}  // namespace memorypool
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "PageHeap.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#define ARENA_DEFAULT_BLOCK_SIZE (64 * 1024)
+
+namespace memorypool
+{
+
+// Arena is a monotonic allocator for objects that all die together, e.g. everything built while
+// serving one request. Allocation bumps a cursor through a chain of page heap blocks; individual
+// frees are ignored and reset() or the destructor drops everything in O(blocks). Objects made
+// with create() whose type is not trivially destructible have their destructors registered and
+// run, newest first, on reset().
+//
+// With keepBlocks the blocks survive reset() and the next round bumps through them again, so a
+// steady workload stops touching the page heap at all. Not thread-safe: one arena per request.
+class Arena
+{
+public:
+    explicit Arena(std::size_t blockSize = ARENA_DEFAULT_BLOCK_SIZE, bool keepBlocks = false);
+    ~Arena();
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // alignment is a power of two
+    void* allocate(std::size_t size, std::size_t alignment = alignof(std::max_align_t))
+    {
+        std::uintptr_t aligned = (cursor_ + alignment - 1) & ~(std::uintptr_t(alignment) - 1);
+        if (aligned >= cursor_ && aligned <= end_ && size <= end_ - aligned)
+        {
+            cursor_ = aligned + size;
+            return reinterpret_cast<void*>(aligned);
+        }
+        return allocateSlow(size, alignment);
+    }
+
+    // individual frees are no-ops, memory comes back on reset()
+    void deallocate(void*, std::size_t = 0) noexcept {}
+
+    template<typename T, typename... Args>
+    T* create(Args&&... args)
+    {
+        if constexpr (std::is_trivially_destructible<T>::value)
+        {
+            return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        }
+        else
+        {
+            // the record goes in first so the object never lives without its destructor registered
+            auto* record = static_cast<Destructor*>(allocate(sizeof(Destructor), alignof(Destructor)));
+            T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            record->destroy = [](void* p) { static_cast<T*>(p)->~T(); };
+            record->object = object;
+            record->next = destructors_;
+            destructors_ = record;
+            return object;
+        }
+    }
+
+    // uninitialized storage for n objects, their destructors are not registered
+    template<typename T>
+    T* allocateArray(std::size_t n)
+    {
+        if (n > SIZE_MAX / sizeof(T))
+        {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T*>(allocate(n * sizeof(T), alignof(T)));
+    }
+
+    // run registered destructors, then rewind into the retained blocks or give them all back
+    void reset();
+
+    // run registered destructors and give every block back, whatever keepBlocks says
+    void release();
+
+    std::size_t bytesAllocated() const;  // handed out since the last reset, including padding
+    std::size_t bytesReserved() const { return reservedBytes_; }  // held in blocks
+    std::size_t blockCount() const { return blockCount_; }
+
+private:
+    // the link is the first word of the block like a MemoryPool block, each allocation is padded
+    // to its own alignment from there
+    struct BlockHeader
+    {
+        BlockHeader* next;
+        std::size_t size;  // whole span, header included
+    };
+
+    struct Destructor
+    {
+        void (*destroy)(void*);
+        void* object;
+        Destructor* next;
+    };
+
+    void* allocateSlow(std::size_t size, std::size_t alignment);
+    void runDestructors() noexcept;
+    void enterBlock(BlockHeader* block);
+    BlockHeader* newBlock(std::size_t size, std::size_t alignment);
+    static std::uintptr_t bodyOf(BlockHeader* block);
+    static std::uintptr_t endOf(BlockHeader* block);
+
+    std::size_t blockSize_;
+    bool keepBlocks_;
+    BlockHeader* first_ = nullptr;
+    BlockHeader* current_ = nullptr;  // block the cursor is in
+    std::uintptr_t cursor_ = 1;  // past end_ while there is no block, so the first call goes slow
+    std::uintptr_t end_ = 0;
+    std::size_t usedBefore_ = 0;  // bytes handed out in blocks before current_
+    Destructor* destructors_ = nullptr;
+    std::size_t reservedBytes_ = 0;
+    std::size_t blockCount_ = 0;
+};
+
+}  // namespace memorypool
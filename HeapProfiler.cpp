@@ -0,0 +1,302 @@
+#include "HeapProfiler.h"
+#include "MemoryPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <execinfo.h>
+
+namespace memorypool
+{
+
+namespace
+{
+
+struct Sample
+{
+    std::size_t size;
+    double weight;  // estimated bytes this sample stands for
+    int sizeClass;
+    int depth;
+    void* stack[HEAP_PROFILER_MAX_DEPTH];
+};
+
+// frees test a counting filter over the sampled addresses before taking the lock, so while a
+// profile is live an unsampled free costs a hash and a load
+constexpr int kFilterBits = 14;
+std::atomic<std::uint32_t> g_filter[std::size_t(1) << kFilterBits];
+
+std::size_t filterIndex(const void* p)
+{
+    return static_cast<std::size_t>((reinterpret_cast<std::uintptr_t>(p) >> 3) * 0x9E3779B97F4A7C15ull >>
+                                    (64 - kFilterBits));
+}
+
+std::mutex g_mutex;
+std::atomic<std::size_t> g_interval{HEAP_PROFILER_DEFAULT_INTERVAL};
+
+// never destroyed, sampled slots may still be freed during exit
+std::unordered_map<void*, Sample>& samples()
+{
+    static auto* table = new std::unordered_map<void*, Sample>();
+    return *table;
+}
+
+// set while this thread runs profiler code: its own allocations are not sampled and its frees
+// skip the table, so a bucket behind operator new never re-enters the lock
+thread_local bool t_inProfiler = false;
+thread_local std::uint64_t t_random = 0;
+
+struct InProfiler
+{
+    InProfiler() { t_inProfiler = true; }
+    ~InProfiler() { t_inProfiler = false; }
+};
+
+std::int64_t nextCountdown()
+{
+    if (t_random == 0)
+    {
+        t_random = reinterpret_cast<std::uintptr_t>(&t_random) ^
+                   static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count()) ^
+                   0x2545F4914F6CDD1Dull;
+    }
+    // xorshift64*, top 53 bits as a uniform in (0, 1]
+    t_random ^= t_random >> 12;
+    t_random ^= t_random << 25;
+    t_random ^= t_random >> 27;
+    std::uint64_t r = t_random * 0x2545F4914F6CDD1Dull;
+    double u = static_cast<double>((r >> 11) + 1) * 0x1.0p-53;
+    double interval = static_cast<double>(g_interval.load(std::memory_order_relaxed));
+    double bytes = -std::log(u) * interval;
+    return bytes < 1.0 ? 1 : static_cast<std::int64_t>(std::min(bytes, interval * 64));
+}
+
+double sampleWeight(std::size_t size, std::size_t interval)
+{
+    double s = static_cast<double>(size);
+    return s / (1.0 - std::exp(-s / static_cast<double>(interval)));
+}
+
+// live samples grouped by call site and size class
+struct Site
+{
+    std::size_t samples = 0;
+    std::size_t sampledBytes = 0;
+    double bytes = 0;
+    double objects = 0;
+};
+
+using SiteKey = std::pair<std::vector<void*>, int>;
+
+std::vector<std::pair<SiteKey, Site>> collectSites()
+{
+    std::map<SiteKey, Site> sites;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        for (const auto& entry : samples())
+        {
+            const Sample& sample = entry.second;
+            Site& site = sites[SiteKey(std::vector<void*>(sample.stack, sample.stack + sample.depth), sample.sizeClass)];
+            ++site.samples;
+            site.sampledBytes += sample.size;
+            site.bytes += sample.weight;
+            site.objects += sample.weight / static_cast<double>(sample.size);
+        }
+    }
+    std::vector<std::pair<SiteKey, Site>> sorted(sites.begin(), sites.end());
+    std::sort(sorted.begin(), sorted.end(),
+              [](const auto& a, const auto& b) { return a.second.bytes > b.second.bytes; });
+    return sorted;
+}
+
+}  // namespace
+
+void HeapProfiler::start(std::size_t intervalBytes)
+{
+    g_interval.store(intervalBytes == 0 ? 1 : intervalBytes, std::memory_order_relaxed);
+    running_.store(true, std::memory_order_relaxed);
+}
+
+void HeapProfiler::stop()
+{
+    running_.store(false, std::memory_order_relaxed);
+}
+
+void HeapProfiler::reset()
+{
+    InProfiler guard;
+    std::lock_guard<std::mutex> lock(g_mutex);
+    samples().clear();
+    for (auto& counter : g_filter)
+    {
+        counter.store(0, std::memory_order_relaxed);
+    }
+    liveSamples_.store(0, std::memory_order_relaxed);
+}
+
+std::size_t HeapProfiler::estimatedLiveBytes()
+{
+    std::lock_guard<std::mutex> lock(g_mutex);
+    double bytes = 0;
+    for (const auto& entry : samples())
+    {
+        bytes += entry.second.weight;
+    }
+    return static_cast<std::size_t>(bytes);
+}
+
+void HeapProfiler::sampleAllocation(void* p, std::size_t size, int sizeClass, std::int64_t& countdown)
+{
+    if (!running_.load(std::memory_order_relaxed))
+    {
+        countdown = HEAP_PROFILER_RECHECK_BYTES;
+        return;
+    }
+    if (t_inProfiler)
+    {
+        countdown = nextCountdown();
+        return;
+    }
+    InProfiler guard;
+    countdown = nextCountdown();
+    if (p == nullptr)
+    {
+        return;
+    }
+
+    Sample sample;
+    sample.size = size;
+    sample.weight = sampleWeight(size, g_interval.load(std::memory_order_relaxed));
+    sample.sizeClass = sizeClass;
+    void* frames[HEAP_PROFILER_MAX_DEPTH + 1];
+    int depth = backtrace(frames, HEAP_PROFILER_MAX_DEPTH + 1);
+    // frame 0 is this function
+    sample.depth = depth > 1 ? depth - 1 : 0;
+    std::copy(frames + 1, frames + 1 + sample.depth, sample.stack);
+
+    try
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        if (samples().insert_or_assign(p, sample).second)
+        {
+            g_filter[filterIndex(p)].fetch_add(1, std::memory_order_relaxed);
+            liveSamples_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    catch (...)
+    {
+        // out of memory for the table: the allocation just goes unsampled
+    }
+}
+
+void HeapProfiler::recordFree(void* p)
+{
+    std::atomic<std::uint32_t>& counter = g_filter[filterIndex(p)];
+    if (t_inProfiler || counter.load(std::memory_order_relaxed) == 0)
+    {
+        return;
+    }
+    InProfiler guard;
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (samples().erase(p) != 0)
+    {
+        counter.fetch_sub(1, std::memory_order_relaxed);
+        liveSamples_.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+void HeapProfiler::lockForFork()
+{
+    g_mutex.lock();
+}
+
+void HeapProfiler::unlockAfterFork()
+{
+    g_mutex.unlock();
+}
+
+void HeapProfiler::dump(std::ostream& os)
+{
+    InProfiler guard;
+    std::vector<std::pair<SiteKey, Site>> sites = collectSites();
+    std::size_t samples = 0;
+    double bytes = 0;
+    for (const auto& site : sites)
+    {
+        samples += site.second.samples;
+        bytes += site.second.bytes;
+    }
+    os << "heap profile: " << samples << " samples, " << static_cast<std::size_t>(bytes)
+       << " estimated live bytes, interval " << g_interval.load(std::memory_order_relaxed) << "\n";
+    os << "live_bytes  live_objects  samples  class_size\n";
+    for (const auto& site : sites)
+    {
+        const std::vector<void*>& stack = site.first.first;
+        int sizeClass = site.first.second;
+        os << static_cast<std::size_t>(site.second.bytes) << "  " << static_cast<std::size_t>(site.second.objects + 0.5)
+           << "  " << site.second.samples << "  ";
+        if (sizeClass < 0)
+        {
+            os << "large\n";
+        }
+        else
+        {
+            os << SizeClass::size(sizeClass) << "\n";
+        }
+        char** symbols = backtrace_symbols(stack.data(), static_cast<int>(stack.size()));
+        for (std::size_t i = 0; i < stack.size(); ++i)
+        {
+            os << "    #" << i << " " << stack[i];
+            if (symbols != nullptr)
+            {
+                os << " " << symbols[i];
+            }
+            os << "\n";
+        }
+        std::free(symbols);
+    }
+}
+
+void HeapProfiler::dumpPprof(std::ostream& os)
+{
+    InProfiler guard;
+    std::vector<std::pair<SiteKey, Site>> sites = collectSites();
+    std::size_t samples = 0;
+    std::size_t bytes = 0;
+    for (const auto& site : sites)
+    {
+        samples += site.second.samples;
+        bytes += site.second.sampledBytes;
+    }
+    // only live samples are kept, so the cumulative columns repeat the in-use ones
+    os << "heap profile: " << samples << ": " << bytes << " [" << samples << ": " << bytes << "] @ heap_v2/"
+       << g_interval.load(std::memory_order_relaxed) << "\n";
+    for (const auto& site : sites)
+    {
+        os << site.second.samples << ": " << site.second.sampledBytes << " [" << site.second.samples << ": "
+           << site.second.sampledBytes << "] @";
+        for (void* frame : site.first.first)
+        {
+            os << " " << frame;
+        }
+        os << "\n";
+    }
+    os << "\nMAPPED_LIBRARIES:\n";
+    std::ifstream maps("/proc/self/maps");
+    if (maps)
+    {
+        os << maps.rdbuf();
+    }
+}
+
+}  // namespace memorypool
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+
+namespace memorypool
+{
+
+#define HEAP_PROFILER_DEFAULT_INTERVAL (512 * 1024)  // mean bytes allocated between two samples
+#define HEAP_PROFILER_MAX_DEPTH 32  // frames kept per sampled stack
+#define HEAP_PROFILER_RECHECK_BYTES (1 << 20)  // while stopped, a thread looks at the switch this often
+
+// HeapProfiler samples HashBucket allocations for a live-heap profile: about one allocation per
+// interval bytes gets its stack recorded in a side table, and leaves it again when freed. Every
+// thread counts down the bytes it allocates (a field of its ThreadCache), so an unsampled call
+// pays one subtraction and a branch; the countdown that runs out draws the next one from an
+// exponential distribution, so the chance of sampling an allocation grows with its size and each
+// sample stands for size / (1 - exp(-size / interval)) bytes.
+//
+// Sampled: HashBucket::useMemory in all its forms (so newElement and the malloc replacement too).
+// allocateBatch is not sampled; frees of sampled slots are noticed on every free path.
+// While the profiler is stopped a thread only looks at the switch every
+// HEAP_PROFILER_RECHECK_BYTES, so start() takes effect after that much allocation per thread.
+class HeapProfiler
+{
+public:
+    // begin sampling about one allocation per intervalBytes; samples already live are kept
+    static void start(std::size_t intervalBytes = HEAP_PROFILER_DEFAULT_INTERVAL);
+    // stop taking new samples, live ones still leave the table when freed
+    static void stop();
+    static bool running() { return running_.load(std::memory_order_relaxed); }
+    // forget every live sample
+    static void reset();
+
+    static std::size_t liveSamples() { return liveSamples_.load(std::memory_order_relaxed); }
+    // estimated live bytes over every sample
+    static std::size_t estimatedLiveBytes();
+
+    // text report: estimated live bytes and objects per call site and size class, largest first,
+    // with symbolized frames
+    static void dump(std::ostream& os);
+    // gperftools legacy heap profile (heap_v2) with the mapped libraries appended, which
+    // `pprof <binary> <file>` reads; it carries the raw sampled counts and pprof scales them
+    static void dumpPprof(std::ostream& os);
+
+    // hooks for the bucket: the countdown ran out on an allocation of size bytes at p, class
+    // index sizeClass (-1 for a page heap span). Records it when running and resets countdown
+    static void sampleAllocation(void* p, std::size_t size, int sizeClass, std::int64_t& countdown);
+
+    // held across fork() by the malloc replacement, before the bucket locks: a sampled
+    // allocation grows the table, which can reach the bucket, under the profiler lock
+    static void lockForFork();
+    static void unlockAfterFork();
+
+    static void noteFree(void* p)
+    {
+        if (liveSamples_.load(std::memory_order_relaxed) != 0)
+        {
+            recordFree(p);
+        }
+    }
+
+private:
+    static void recordFree(void* p);
+
+    static inline std::atomic<bool> running_{false};
+    static inline std::atomic<std::size_t> liveSamples_{0};
+};
+
+}  // namespace memorypool
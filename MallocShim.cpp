@@ -0,0 +1,479 @@
+// Drop-in malloc/free and global operator new/delete backed by HashBucket.
+// Built as libmemorypool_malloc.so, either linked into a program or injected with LD_PRELOAD.
+
+#include "HeapProfiler.h"
+#include "MemoryPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+#include <pthread.h>
+#include <unistd.h>
+
+namespace memorypool
+{
+namespace
+{
+#define MALLOC_SHIM_MIN_ALIGN 16  // malloc results suit any fundamental type
+#define MALLOC_SHIM_BOOTSTRAP_SIZE (64 * 1024)
+#define MALLOC_SHIM_MAX_REQUEST (SIZE_MAX - PAGE_HEAP_PAGE_SIZE)  // largest size the page heap can count in pages
+
+// Allocations made while the pools are being set up (e.g. __cxa_atexit registering the pools'
+// destructors) cannot recurse into the pools, they are bumped out of this arena and never freed.
+alignas(MALLOC_SHIM_MIN_ALIGN) char g_bootstrap[MALLOC_SHIM_BOOTSTRAP_SIZE];
+std::atomic<std::size_t> g_bootstrapUsed{0};
+
+// set once the first allocation went through HashBucket, from then on nested calls can use the pools
+std::atomic<bool> g_ready{false};
+
+// nesting depth of the allocator on this thread; initial-exec so reading it never allocates
+__attribute__((tls_model("initial-exec"))) thread_local int t_depth = 0;
+
+struct ReentryGuard
+{
+    ReentryGuard() { ++t_depth; }
+    ~ReentryGuard() { --t_depth; }
+};
+
+// every bootstrap block is preceded by its size so realloc/malloc_usable_size work on it
+struct BootstrapHeader
+{
+    std::size_t size;
+    std::size_t pad;
+};
+
+bool fromBootstrap(const void* p)
+{
+    auto* c = static_cast<const char*>(p);
+    return c >= g_bootstrap && c < g_bootstrap + MALLOC_SHIM_BOOTSTRAP_SIZE;
+}
+
+void* bootstrapAllocate(std::size_t size)
+{
+    std::size_t bytes = sizeof(BootstrapHeader) + size;
+    std::size_t offset = g_bootstrapUsed.fetch_add(bytes, std::memory_order_relaxed);
+    if (offset + bytes > MALLOC_SHIM_BOOTSTRAP_SIZE)
+    {
+        return nullptr;
+    }
+    auto* header = reinterpret_cast<BootstrapHeader*>(g_bootstrap + offset);
+    header->size = size;
+    return header + 1;
+}
+
+std::size_t roundUp(std::size_t size, std::size_t align)
+{
+    return (size + align - 1) & ~(align - 1);
+}
+
+// a call that re-entered the allocator on this thread: skip the thread cache, whose slow path
+// may be the caller (it registers a thread exit hook, which allocates)
+void* nestedAllocate(std::size_t size)
+{
+    if (!g_ready.load(std::memory_order_acquire))
+    {
+        return bootstrapAllocate(size);
+    }
+    if (size > MAX_SLOT_SIZE)
+    {
+        return PageHeap::instance().allocateLarge(size);
+    }
+    return HashBucket::getMemoryPool(SizeClass::index(size)).allocate();
+}
+
+void nestedFree(void* p, const Span* span)
+{
+    if (span->kind == Span::Kind::Large)
+    {
+        PageHeap::instance().deallocate(p);
+        return;
+    }
+    HashBucket::getMemoryPool(SizeClass::index(span->slotSize)).deallocate(p);
+}
+
+void* allocateBytes(std::size_t size) noexcept
+{
+    if (size > MALLOC_SHIM_MAX_REQUEST)
+    {
+        return nullptr;
+    }
+    // rounding to 16 picks a class whose slots, aligned to the lowest set bit of their size, are 16-aligned
+    size = roundUp(size == 0 ? 1 : size, MALLOC_SHIM_MIN_ALIGN);
+    try
+    {
+        if (t_depth > 0)
+        {
+            return nestedAllocate(size);
+        }
+        ReentryGuard guard;
+        void* p = HashBucket::useMemory(size);
+        if (!g_ready.load(std::memory_order_relaxed))
+        {
+            g_ready.store(true, std::memory_order_release);
+        }
+        return p;
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+// alignment is a power of two
+void* allocateAligned(std::size_t size, std::size_t alignment) noexcept
+{
+    if (alignment <= MALLOC_SHIM_MIN_ALIGN)
+    {
+        return allocateBytes(size);
+    }
+    if (size > MALLOC_SHIM_MAX_REQUEST - alignment)
+    {
+        return nullptr;
+    }
+
+    int index = SizeClass::alignedIndex(size, alignment);
+    if (index >= 0)
+    {
+        return allocateBytes(SizeClass::size(index));
+    }
+
+    if (t_depth > 0 && !g_ready.load(std::memory_order_acquire))
+    {
+        return nullptr;  // the bootstrap arena does not serve over-aligned requests
+    }
+    try
+    {
+        return PageHeap::instance().allocateLarge(size, alignment);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void freeBytes(void* p) noexcept
+{
+    if (p == nullptr || fromBootstrap(p))
+    {
+        return;
+    }
+    const Span* span = PageHeap::instance().spanOf(p);
+    if (span == nullptr)
+    {
+        return;  // not ours, e.g. handed out by the loader before this library took over
+    }
+    if (t_depth > 0)
+    {
+        nestedFree(p, span);
+        return;
+    }
+    ReentryGuard guard;
+    HashBucket::freeMemory(p);
+}
+
+// sized delete: the size maps to the same class the allocation was served from
+void freeSized(void* p, std::size_t size) noexcept
+{
+    if (p == nullptr || fromBootstrap(p) || t_depth > 0 || size > SIZE_MAX - MALLOC_SHIM_MIN_ALIGN)
+    {
+        freeBytes(p);
+        return;
+    }
+    ReentryGuard guard;
+    HashBucket::freeMemory(p, roundUp(size == 0 ? 1 : size, MALLOC_SHIM_MIN_ALIGN));
+}
+
+std::size_t usableBytes(const void* p) noexcept
+{
+    if (p == nullptr)
+    {
+        return 0;
+    }
+    if (fromBootstrap(p))
+    {
+        return (static_cast<const BootstrapHeader*>(p) - 1)->size;
+    }
+    return PageHeap::instance().usableSize(p);
+}
+
+bool validAlignment(std::size_t alignment)
+{
+    return alignment != 0 && (alignment & (alignment - 1)) == 0;
+}
+
+void* operatorNew(std::size_t size, std::size_t alignment)
+{
+    for (;;)
+    {
+        void* p = allocateAligned(size, alignment);
+        if (p != nullptr)
+        {
+            return p;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+void prepareFork()
+{
+    HeapProfiler::lockForFork();
+    HashBucket::lockForFork();
+}
+
+void afterFork()
+{
+    HashBucket::unlockAfterFork();
+    HeapProfiler::unlockAfterFork();
+}
+
+// register the fork handlers as soon as the library is loaded
+__attribute__((constructor)) void installForkHandlers()
+{
+    pthread_atfork(prepareFork, afterFork, afterFork);
+}
+}  // namespace
+}  // namespace memorypool
+
+using namespace memorypool;
+
+extern "C"
+{
+
+void* malloc(std::size_t size)
+{
+    void* p = allocateBytes(size);
+    if (p == nullptr)
+    {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void free(void* p)
+{
+    freeBytes(p);
+}
+
+void* calloc(std::size_t count, std::size_t size)
+{
+    if (size != 0 && count > SIZE_MAX / size)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    std::size_t bytes = count * size;
+    void* p = allocateBytes(bytes);
+    if (p == nullptr)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    std::memset(p, 0, bytes);
+    return p;
+}
+
+void* realloc(void* p, std::size_t size)
+{
+    if (p == nullptr)
+    {
+        return malloc(size);
+    }
+    if (size == 0)
+    {
+        freeBytes(p);
+        return nullptr;
+    }
+
+    // foreign pointers report 0 and lose their contents, the loader never reallocs its own blocks
+    std::size_t old = usableBytes(p);
+    if (size <= old && size >= old / 2)
+    {
+        return p;  // still fits without wasting more than half the block
+    }
+    void* q = allocateBytes(size);
+    if (q == nullptr)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    std::memcpy(q, p, std::min(old, size));
+    freeBytes(p);
+    return q;
+}
+
+int posix_memalign(void** out, std::size_t alignment, std::size_t size)
+{
+    if (!validAlignment(alignment) || alignment % sizeof(void*) != 0)
+    {
+        return EINVAL;
+    }
+    void* p = allocateAligned(size, alignment);
+    if (p == nullptr)
+    {
+        return ENOMEM;
+    }
+    *out = p;
+    return 0;
+}
+
+void* aligned_alloc(std::size_t alignment, std::size_t size)
+{
+    if (!validAlignment(alignment))
+    {
+        errno = EINVAL;
+        return nullptr;
+    }
+    void* p = allocateAligned(size, alignment);
+    if (p == nullptr)
+    {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void* memalign(std::size_t alignment, std::size_t size)
+{
+    return aligned_alloc(alignment, size);
+}
+
+void* valloc(std::size_t size)
+{
+    return aligned_alloc(PAGE_HEAP_PAGE_SIZE, size);
+}
+
+void* pvalloc(std::size_t size)
+{
+    return aligned_alloc(PAGE_HEAP_PAGE_SIZE, roundUp(size == 0 ? 1 : size, PAGE_HEAP_PAGE_SIZE));
+}
+
+std::size_t malloc_usable_size(void* p)
+{
+    return usableBytes(p);
+}
+
+}  // extern "C"
+
+void* operator new(std::size_t size)
+{
+    return operatorNew(size, MALLOC_SHIM_MIN_ALIGN);
+}
+
+void* operator new[](std::size_t size)
+{
+    return operatorNew(size, MALLOC_SHIM_MIN_ALIGN);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    try
+    {
+        return operatorNew(size, MALLOC_SHIM_MIN_ALIGN);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return operator new(size, std::nothrow);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    return operatorNew(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return operatorNew(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    try
+    {
+        return operatorNew(size, static_cast<std::size_t>(alignment));
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return operator new(size, alignment, std::nothrow);
+}
+
+void operator delete(void* p) noexcept
+{
+    freeBytes(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    freeBytes(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    freeBytes(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    freeBytes(p);
+}
+
+void operator delete(void* p, std::size_t size) noexcept
+{
+    freeSized(p, size);
+}
+
+void operator delete[](void* p, std::size_t size) noexcept
+{
+    freeSized(p, size);
+}
+
+// aligned allocations may come from a larger class or an aligned span, free them by address
+void operator delete(void* p, std::align_val_t) noexcept
+{
+    freeBytes(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept
+{
+    freeBytes(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    freeBytes(p);
+}
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    freeBytes(p);
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept
+{
+    freeBytes(p);
+}
+
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept
+{
+    freeBytes(p);
+}
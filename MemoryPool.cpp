@@ -1,6 +1,36 @@
 #include "MemoryPool.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
 #include <mutex>
+#include <ostream>
+#include <system_error>
+#include <thread>
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// per-CPU lists commit with hand-written rseq sequences on x86-64 when glibc exports its rseq area
+#if defined(__x86_64__) && defined(__linux__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define MEMORY_POOL_RSEQ 1
+#else
+#define MEMORY_POOL_RSEQ 0
+#endif
+
+// the pools must be built at compile time: getMemoryPool() has no init guard to fall back on
+#if defined(__cpp_constinit)
+#define MEMORY_POOL_CONSTINIT constinit
+#elif defined(__clang__)
+#define MEMORY_POOL_CONSTINIT [[clang::require_constant_initialization]]
+#elif defined(__GNUC__) && __GNUC__ >= 10
+#define MEMORY_POOL_CONSTINIT __constinit
+#else
+#define MEMORY_POOL_CONSTINIT
+#endif
 
 namespace memorypool 
 {
@@ -8,12 +38,145 @@ namespace
 {
 std::once_flag g_memoryPoolInitFlag;
 std::once_flag g_lockFreePoolInitFlag;
+std::once_flag g_perCpuPoolInitFlag;
+
+static_assert(sizeof(void*) == sizeof(std::uint64_t), "tagged free list needs 64-bit pointers");
+
+// grow a block until MIN_SLOTS_PER_BLOCK slots fit behind its header and the worst-case padding,
+// blocks are whole page heap pages
+std::size_t fitBlockSize(std::size_t blockSize, std::size_t slotSize, std::size_t headerSize)
+{
+    std::size_t needed = headerSize + (slotSize - 1) + MIN_SLOTS_PER_BLOCK * slotSize;
+    if (blockSize < needed)
+    {
+        blockSize = needed;
+    }
+    return (blockSize + PAGE_HEAP_PAGE_SIZE - 1) / PAGE_HEAP_PAGE_SIZE * PAGE_HEAP_PAGE_SIZE;
+}
+
+// slots are aligned to the largest power of two dividing their size, at most a page
+std::size_t slotAlignment(std::size_t slotSize)
+{
+    return std::min<std::size_t>(slotSize & (~slotSize + 1), PAGE_HEAP_PAGE_SIZE);
+}
+
+// coloring steps by a cache line, or by the slot alignment when that is coarser, so slots keep it
+std::size_t colorStepFor(std::size_t slotSize)
+{
+    return std::max<std::size_t>(BLOCK_COLOR_STEP, slotAlignment(slotSize));
+}
+
+constexpr int kTagShift = 48;
+constexpr std::uint64_t kPointerMask = (std::uint64_t(1) << kTagShift) - 1;
+constexpr std::uint64_t kTagMask = (std::uint64_t(1) << (64 - kTagShift)) - 1;
+
+inline Slot* headSlot(std::uint64_t head)
+{
+    return reinterpret_cast<Slot*>(static_cast<std::uintptr_t>(head & kPointerMask));
+}
+
+inline std::uint64_t tagOf(std::uint64_t tagged)
+{
+    return tagged >> kTagShift;
+}
+
+inline std::uint64_t taggedPointer(std::uint64_t tag, const void* p)
+{
+    return (tag << kTagShift) | (static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(p)) & kPointerMask);
+}
+
+// build the next head value: new pointer, previous tag + 1
+inline std::uint64_t nextHead(std::uint64_t oldHead, Slot* slot)
+{
+    return taggedPointer((tagOf(oldHead) + 1) & kTagMask, slot);
+}
+
+// slots moved between a cache and its pool at a time, about THREAD_CACHE_BATCH_BYTES worth
+std::size_t cacheBatchSize(std::size_t slotSize)
+{
+    std::size_t batch = THREAD_CACHE_BATCH_BYTES / (slotSize == 0 ? 1 : slotSize);
+    if (batch < 2)
+    {
+        batch = 2;
+    }
+    if (batch > THREAD_CACHE_MAX_BATCH)
+    {
+        batch = THREAD_CACHE_MAX_BATCH;
+    }
+    return batch;
+}
+
+// pool counters with the caller-level counts of the bucket's thread caches in place of the pool's
+template<typename Bucket>
+BucketStats collectStats(const std::atomic<std::uint64_t>& largeAllocations,
+                         const std::atomic<std::uint64_t>& largeFrees)
+{
+    std::uint64_t allocations[MEMORY_POOL_NUM];
+    std::uint64_t frees[MEMORY_POOL_NUM];
+    ThreadCache<Bucket>::collectCounts(allocations, frees);
+
+    BucketStats stats{};
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        PoolStats& pool = stats.classes[i];
+        pool = Bucket::getMemoryPool(i).stats();
+        pool.allocations = allocations[i];
+        pool.frees = frees[i];
+        // counts of different threads are read at different moments, never report a negative
+        pool.bytesInUse = allocations[i] > frees[i] ? (allocations[i] - frees[i]) * pool.slotSize : 0;
+    }
+    stats.largeAllocations = largeAllocations.load(std::memory_order_relaxed);
+    stats.largeFrees = largeFrees.load(std::memory_order_relaxed);
+    PageHeap& heap = PageHeap::instance();
+    stats.pageHeapReservedBytes = heap.reservedBytes();
+    stats.pageHeapFreeBytes = heap.freeBytes();
+    stats.pageHeapReleasedBytes = heap.releasedBytes();
+    return stats;
 }
 
-MemoryPool::MemoryPool(size_t BlockSize)
-        : BlockSize_(BlockSize), SlotSize_(0), slotAdvance_(0), firstBlock_(nullptr),
-            curSlot_(nullptr), freeList_(nullptr), endSlot_(nullptr)
+// LockFreeMemoryPool::cursor_ layout
+constexpr int kGenerationShift = 32;
+constexpr std::uint64_t kIndexMask = (std::uint64_t(1) << kGenerationShift) - 1;
+
+// exponential backoff after a failed CAS on a contended free list head: 1, 2, 4, ... pauses,
+// up to LOCK_FREE_MAX_BACKOFF, so losers stop hammering the line the winner just wrote
+class Backoff
+{
+public:
+    void pause()
+    {
+        for (unsigned i = 0; i < spins_; ++i)
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#elif defined(__aarch64__)
+            asm volatile("yield");
+#endif
+        }
+        if (spins_ < LOCK_FREE_MAX_BACKOFF)
+        {
+            spins_ <<= 1;
+        }
+    }
+
+private:
+    unsigned spins_ = 1;
+};
+
+// LockFreeMemoryPool stripe and counter shard hint: threads are numbered round-robin on their
+// first call that needs it
+std::atomic<std::uint32_t> g_nextThread{0};
+thread_local std::uint32_t t_thread = 0;  // number + 1, 0 until assigned
+static_assert(LOCK_FREE_COUNTER_SHARDS % LOCK_FREE_MAX_STRIPES == 0, "numbers must spread evenly over stripes");
+
+std::size_t threadNumber()
 {
+    if (t_thread == 0)
+    {
+        t_thread = g_nextThread.fetch_add(1, std::memory_order_relaxed) % LOCK_FREE_COUNTER_SHARDS + 1;
+    }
+    return t_thread - 1;
+}
 }
 
 MemoryPool::~MemoryPool()
@@ -22,13 +185,18 @@ MemoryPool::~MemoryPool()
     while (currentBlock != nullptr)
     {
         Slot* nextBlock = currentBlock->next;
-        ::operator delete(static_cast<void*>(currentBlock));
+        releaseBlock(currentBlock);
         currentBlock = nextBlock;
     }
 }
 
-void MemoryPool::init(size_t slotSize)
+void MemoryPool::init(size_t slotSize, size_t blockSize, bool colorBlocks, bool blockLocal)
 {
+    if (blockSize != 0)
+    {
+        BlockSize_ = blockSize;
+    }
+
     SlotSize_ = slotSize;
     if (SlotSize_ == 0)
     {
@@ -46,17 +214,36 @@ void MemoryPool::init(size_t slotSize)
         slotAdvance_ = 1;
         SlotSize_ = sizeof(Slot);
     }
+    blockLocal_ = blockLocal;
+    BlockSize_ = fitBlockSize(BlockSize_, SlotSize_, headerSize());
+    colorStep_ = colorBlocks ? colorStepFor(SlotSize_) : 0;
+    nextColor_ = 0;
 
     firstBlock_ = nullptr;
     curSlot_ = nullptr;
     freeList_ = nullptr;
     endSlot_ = nullptr;
+    current_ = nullptr;
+    for (LocalBlock*& list : localLists_)
+    {
+        list = nullptr;
+    }
+    partialMask_ = 0;
+    reservedBlocks_ = 0;
+    lockedBlocks_ = false;
+    allocations_ = frees_ = peakOutstanding_ = blockRefills_ = blocksReleased_ = 0;
 }
 
 void* MemoryPool::allocate()
 {
     std::lock_guard<std::mutex> lock(mutexForFreeList_);
 
+    countAllocations(1);
+    if (blockLocal_)
+    {
+        return allocateLocal();
+    }
+
     // First check the free list
     if (freeList_ != nullptr)
     {
@@ -81,6 +268,80 @@ void* MemoryPool::allocate()
     return temp;
 }
 
+std::size_t MemoryPool::allocateBatch(std::size_t n, void** out)
+{
+    std::lock_guard<std::mutex> lock(mutexForFreeList_);
+
+    std::size_t count = 0;
+    if (blockLocal_)
+    {
+        while (count < n)
+        {
+            out[count++] = allocateLocal();
+        }
+        countAllocations(count);
+        return count;
+    }
+
+    while (count < n && freeList_ != nullptr)
+    {
+        out[count++] = freeList_;
+        freeList_ = freeList_->next;
+    }
+
+    if (count < n)
+    {
+        std::lock_guard<std::mutex> lockBlock(mutexForBlock_);
+        while (count < n)
+        {
+            if (curSlot_ == nullptr || endSlot_ == nullptr || curSlot_ == endSlot_)
+            {
+                allocateNewBlock();
+            }
+            // carve as many slots as the current block still has in one go
+            std::size_t available = static_cast<std::size_t>(endSlot_ - curSlot_) / slotAdvance_;
+            std::size_t take = std::min(available, n - count);
+            for (std::size_t i = 0; i < take; ++i)
+            {
+                out[count++] = curSlot_;
+                curSlot_ += slotAdvance_;
+            }
+        }
+    }
+    countAllocations(count);
+    return count;
+}
+
+void MemoryPool::deallocateBatch(std::size_t n, void* const* ptrs)
+{
+    if (n == 0)
+    {
+        return;
+    }
+    if (blockLocal_)
+    {
+        std::lock_guard<std::mutex> lock(mutexForFreeList_);
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            deallocateLocal(static_cast<Slot*>(ptrs[i]));
+        }
+        frees_ += n;
+        return;
+    }
+
+    // link the batch into a chain first so the lock only covers the splice
+    for (std::size_t i = 0; i + 1 < n; ++i)
+    {
+        static_cast<Slot*>(ptrs[i])->next = static_cast<Slot*>(ptrs[i + 1]);
+    }
+    Slot* tail = static_cast<Slot*>(ptrs[n - 1]);
+
+    std::lock_guard<std::mutex> lock(mutexForFreeList_);
+    tail->next = freeList_;
+    freeList_ = static_cast<Slot*>(ptrs[0]);
+    frees_ += n;
+}
+
 void MemoryPool::deallocate(void* p)
 {
     if (p == nullptr)
@@ -88,231 +349,2284 @@ void MemoryPool::deallocate(void* p)
         return;
     }
 
-    // add the slot back to the free list's head
+    // add the slot back to the free list's head, or its block's in block-local mode
     std::lock_guard<std::mutex> lock(mutexForFreeList_);
     Slot* slot = static_cast<Slot*>(p);
-    slot->next = freeList_;
-    freeList_ = slot;
+    if (blockLocal_)
+    {
+        deallocateLocal(slot);
+    }
+    else
+    {
+        slot->next = freeList_;
+        freeList_ = slot;
+    }
+    ++frees_;
+}
+
+void MemoryPool::lockForFork()
+{
+    // same order as trim() and allocate(): trim lock, free list lock, then block lock, so the
+    // child never inherits a free list a trim had detached
+    mutexForTrim_.lock();
+    mutexForFreeList_.lock();
+    mutexForBlock_.lock();
+}
+
+void MemoryPool::unlockAfterFork()
+{
+    mutexForBlock_.unlock();
+    mutexForFreeList_.unlock();
+    mutexForTrim_.unlock();
 }
 
 void MemoryPool::allocateNewBlock()
 {
     // add a new block to the pool's managed blocks list head
-    void* newBlock = ::operator new(BlockSize_);
+    void* newBlock = PageHeap::instance().allocatePages(BlockSize_ / PAGE_HEAP_PAGE_SIZE, SlotSize_);
     Slot* newBlockSlot = static_cast<Slot*>(newBlock);
     newBlockSlot->next = firstBlock_;
     firstBlock_ = newBlockSlot;
 
     // handle current slot and last slot
-    char* blockBody = reinterpret_cast<char*>(newBlock) + sizeof(Slot*);
-    size_t bodyPadding = padPointer(blockBody, SlotSize_);
+    char* blockBody = reinterpret_cast<char*>(newBlock) + headerSize();
+    size_t bodyPadding = padPointer(blockBody, slotAlignment(SlotSize_));
     char* alignedBody = blockBody + bodyPadding;
     std::size_t usableBytes = BlockSize_ - static_cast<std::size_t>(alignedBody - reinterpret_cast<char*>(newBlock));
     if (usableBytes < SlotSize_)
     {
-        ::operator delete(newBlock);
+        PageHeap::instance().deallocate(newBlock);
         throw std::bad_alloc();
     }
 
     std::size_t slotCount = usableBytes / SlotSize_;
     if (slotCount == 0)
     {
-        ::operator delete(newBlock);
+        PageHeap::instance().deallocate(newBlock);
         throw std::bad_alloc();
     }
 
+    // shift the slots through the slack at the end of the block, the slot count stays the same
+    if (colorStep_ != 0)
+    {
+        std::size_t colors = (usableBytes - slotCount * SlotSize_) / colorStep_ + 1;
+        alignedBody += (nextColor_++ % colors) * colorStep_;
+    }
+
+    ++blockRefills_;
+    if (blockLocal_)
+    {
+        // the new block becomes the one allocations come from, it carves lazily like curSlot_
+        Slot* link = newBlockSlot->next;
+        current_ = new (newBlock) LocalBlock{link, nullptr, alignedBody,
+                                             alignedBody + slotCount * SlotSize_, static_cast<std::uint32_t>(slotCount),
+                                             static_cast<std::uint32_t>(slotCount), -1, nullptr, nullptr};
+        return;
+    }
+
     curSlot_ = reinterpret_cast<Slot*>(alignedBody);
     endSlot_ = curSlot_ + slotCount * slotAdvance_;
-    freeList_ = nullptr;  // reset free list for the new block
-}
-
-size_t MemoryPool::padPointer(char* p, size_t align)
-{
-    // （8 - 4099 ） % 8 = 5
-    return (align - reinterpret_cast<size_t>(p) % align) % align;
 }
 
-void HashBucket::initMemoryPool()
+void MemoryPool::countAllocations(std::size_t n)
 {
-    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    allocations_ += n;
+    if (allocations_ - frees_ > peakOutstanding_)
     {
-        getMemoryPool(i).init(static_cast<std::size_t>((i + 1) * SLOT_BASE_SIZE));
+        peakOutstanding_ = allocations_ - frees_;
     }
 }
 
-void HashBucket::ensureInitialized()
+PoolStats MemoryPool::stats()
 {
-    std::call_once(g_memoryPoolInitFlag, []() {
-        initMemoryPool();
-    });
+    std::lock_guard<std::mutex> lock(mutexForFreeList_);
+    PoolStats stats{};
+    stats.slotSize = SlotSize_;
+    stats.blockSize = BlockSize_;
+    stats.allocations = allocations_;
+    stats.frees = frees_;
+    stats.blockRefills = blockRefills_;
+    stats.blocksOwned = blockRefills_ - blocksReleased_;
+    stats.bytesReserved = stats.blocksOwned * BlockSize_;
+    stats.bytesInUse = (allocations_ - frees_) * SlotSize_;
+    stats.bytesOutstanding = stats.bytesInUse;
+    stats.peakBytesOutstanding = peakOutstanding_ * SlotSize_;
+    return stats;
 }
 
-// single instance of memory pools
-MemoryPool& HashBucket::getMemoryPool(int index)
+size_t MemoryPool::padPointer(char* p, size_t align)
 {
-    static MemoryPool memoryPools[MEMORY_POOL_NUM];  // static here means this array is created only once
-    return memoryPools[index];
+    // （8 - 4099 ） % 8 = 5
+    return (align - reinterpret_cast<size_t>(p) % align) % align;
 }
 
-LockFreeMemoryPool::LockFreeMemoryPool(size_t BlockSize)
-    : BlockSize_(BlockSize), SlotSize_(0), slotAdvance_(0), firstBlock_(nullptr),
-      curSlot_(nullptr), freeList_(nullptr), endSlot_(nullptr)
+std::size_t MemoryPool::slotsInBlock(Slot* block)
 {
+    char* blockBody = reinterpret_cast<char*>(block) + headerSize();
+    char* alignedBody = blockBody + padPointer(blockBody, slotAlignment(SlotSize_));
+    return (BlockSize_ - static_cast<std::size_t>(alignedBody - reinterpret_cast<char*>(block))) / SlotSize_;
 }
 
-LockFreeMemoryPool::~LockFreeMemoryPool()
+std::size_t MemoryPool::trim()
 {
-    Slot* currentBlock = firstBlock_;
-    while (currentBlock != nullptr)
+    std::lock_guard<std::mutex> trimLock(mutexForTrim_);
+
+    // take the free list private and snapshot the blocks it can belong to; the walk below runs
+    // without the pool locks, allocations meanwhile carve fresh slots as with an empty free list
+    Slot* detached;
+    Slot* head;
+    std::size_t owned;
+    std::size_t reserved;
     {
-        Slot* nextBlock = currentBlock->next;
-        ::operator delete(static_cast<void*>(currentBlock));
-        currentBlock = nextBlock;
+        std::lock_guard<std::mutex> lock(mutexForFreeList_);
+        std::lock_guard<std::mutex> lockBlock(mutexForBlock_);
+        if (blockLocal_)
+        {
+            return trimLocal();  // walks the empty list only, no per-slot work
+        }
+        if (firstBlock_ == nullptr || freeList_ == nullptr)
+        {
+            return 0;
+        }
+        detached = freeList_;
+        freeList_ = nullptr;
+        head = firstBlock_;
+        owned = blockRefills_ - blocksReleased_;
+        reserved = reservedBlocks_;
     }
-}
 
-void LockFreeMemoryPool::init(size_t slotSize)
-{
-    SlotSize_ = slotSize;
-    if (SlotSize_ == 0)
+    // count the free slots of every block, the block's span record is the scratch space; blocks
+    // behind head are only unlinked by trim, which this thread holds
+    PageHeap& pageHeap = PageHeap::instance();
+    for (Slot* block = head; block != nullptr; block = block->next)
     {
-        SlotSize_ = sizeof(Slot);
+        pageHeap.spanOf(block)->freeSlots = 0;
     }
-
-    if (SlotSize_ % sizeof(Slot) != 0)
+    for (Slot* slot = detached; slot != nullptr; slot = slot->next)
     {
-        SlotSize_ = ((SlotSize_ + sizeof(Slot) - 1) / sizeof(Slot)) * sizeof(Slot);
+        ++pageHeap.spanOf(slot)->freeSlots;
     }
 
-    slotAdvance_ = SlotSize_ / sizeof(Slot);
-    if (slotAdvance_ == 0)
+    // mark fully free blocks, skipping head, the one curSlot_ may still carve from
+    constexpr std::size_t kReleasing = ~std::size_t(0);
+    bool anyEmpty = false;
+    for (Slot* block = head->next; block != nullptr && owned > reserved; block = block->next)
     {
-        slotAdvance_ = 1;
-        SlotSize_ = sizeof(Slot);
+        Span* span = pageHeap.spanOf(block);
+        if (span->freeSlots == slotsInBlock(block))
+        {
+            span->freeSlots = kReleasing;
+            anyEmpty = true;
+            --owned;
+        }
     }
 
-    firstBlock_ = nullptr;
-    curSlot_ = nullptr;
-    freeList_.store(nullptr, std::memory_order_relaxed);
-    endSlot_ = nullptr;
-}
+    // survivors keep their order and go back with one splice
+    Slot* keptHead = detached;
+    Slot* keptTail = nullptr;
+    if (anyEmpty)
+    {
+        Slot** link = &keptHead;
+        while (*link != nullptr)
+        {
+            if (pageHeap.spanOf(*link)->freeSlots == kReleasing)
+            {
+                *link = (*link)->next;
+            }
+            else
+            {
+                link = &(*link)->next;
+            }
+        }
+    }
+    for (Slot* slot = keptHead; slot != nullptr; slot = slot->next)
+    {
+        keptTail = slot;
+    }
 
-void* LockFreeMemoryPool::allocate()
-{
-    if (Slot* slot = popFreeList())
+    // only the head is ever prepended to, so unlinking behind it needs no lock
+    Slot* releasing = nullptr;
+    if (anyEmpty)
     {
-        return static_cast<void*>(slot);
+        Slot* prev = head;
+        while (Slot* block = prev->next)
+        {
+            if (pageHeap.spanOf(block)->freeSlots == kReleasing)
+            {
+                prev->next = block->next;
+                block->next = releasing;
+                releasing = block;
+            }
+            else
+            {
+                prev = block;
+            }
+        }
     }
 
-    void* temp;
+    std::size_t released = 0;
     {
-        std::lock_guard<std::mutex> lock(mutexForBlock_);
-        if (curSlot_ == nullptr || endSlot_ == nullptr || curSlot_ == endSlot_)
+        std::lock_guard<std::mutex> lock(mutexForFreeList_);
+        if (keptHead != nullptr)
         {
-            allocateNewBlock();
+            keptTail->next = freeList_;
+            freeList_ = keptHead;
+        }
+        for (Slot* block = releasing; block != nullptr; block = block->next)
+        {
+            ++blocksReleased_;
         }
+    }
+    while (releasing != nullptr)
+    {
+        Slot* next = releasing->next;
+        releaseBlock(releasing);
+        released += BlockSize_;
+        releasing = next;
+    }
+    return released;
+}
 
-        temp = curSlot_;
-        curSlot_ += slotAdvance_;
+void* MemoryPool::allocateLocal()
+{
+    if (current_ == nullptr || current_->freeSlots == 0)
+    {
+        switchLocalBlock();
     }
-    return temp;
+    LocalBlock* block = current_;
+    --block->freeSlots;
+    if (Slot* slot = block->freeList)
+    {
+        block->freeList = slot->next;
+        return slot;
+    }
+    void* slot = block->carve;
+    block->carve += SlotSize_;
+    return slot;
 }
 
-void LockFreeMemoryPool::deallocate(void* p)
+void MemoryPool::deallocateLocal(Slot* slot)
 {
-    if (p == nullptr)
+    auto* block = static_cast<LocalBlock*>(PageHeap::instance().spanOf(slot)->start());
+    slot->next = block->freeList;
+    block->freeList = slot;
+    ++block->freeSlots;
+    if (block == current_)
     {
         return;
     }
 
-    Slot* slot = static_cast<Slot*>(p);
-    while (!pushFreeList(slot))
+    int list = listFor(block);
+    if (list != block->list)
     {
-        // retry until CAS succeeds
+        if (block->list >= 0)
+        {
+            unlinkLocal(block);
+        }
+        linkLocal(block, list);
     }
 }
 
-void LockFreeMemoryPool::allocateNewBlock()
+// current_ is full (or there is none): move to the fullest partial block, then an empty one,
+// and carve a new block only when neither exists
+void MemoryPool::switchLocalBlock()
 {
-    void* newBlock = ::operator new(BlockSize_);
-    Slot* newBlockSlot = static_cast<Slot*>(newBlock);
-    newBlockSlot->next = firstBlock_;
-    firstBlock_ = newBlockSlot;
-
-    char* blockBody = reinterpret_cast<char*>(newBlock) + sizeof(Slot*);
-    size_t bodyPadding = padPointer(blockBody, SlotSize_);
-    char* alignedBody = blockBody + bodyPadding;
-    std::size_t usableBytes = BlockSize_ - static_cast<std::size_t>(alignedBody - reinterpret_cast<char*>(newBlock));
-    if (usableBytes < SlotSize_)
+    LocalBlock* block = nullptr;
+    if (partialMask_ != 0)
     {
-        ::operator delete(newBlock);
-        throw std::bad_alloc();
+        block = localLists_[__builtin_ctz(partialMask_)];
     }
-
-    std::size_t slotCount = usableBytes / SlotSize_;
-    if (slotCount == 0)
+    else if (localLists_[kEmptyList] != nullptr)
     {
-        ::operator delete(newBlock);
-        throw std::bad_alloc();
+        block = localLists_[kEmptyList];
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lockBlock(mutexForBlock_);
+        allocateNewBlock();
+        return;
     }
+    unlinkLocal(block);
+    current_ = block;
+}
 
-    curSlot_ = reinterpret_cast<Slot*>(alignedBody);
-    endSlot_ = curSlot_ + slotCount * slotAdvance_;
+int MemoryPool::listFor(const LocalBlock* block)
+{
+    return block->freeSlots == block->capacity ? kEmptyList : 31 - __builtin_clz(block->freeSlots);
 }
 
-size_t LockFreeMemoryPool::padPointer(char* p, size_t align)
+void MemoryPool::linkLocal(LocalBlock* block, int list)
 {
-    return (align - reinterpret_cast<size_t>(p) % align) % align;
+    block->list = list;
+    block->prevInList = nullptr;
+    block->nextInList = localLists_[list];
+    if (block->nextInList != nullptr)
+    {
+        block->nextInList->prevInList = block;
+    }
+    localLists_[list] = block;
+    if (list < kLocalBins)
+    {
+        partialMask_ |= std::uint32_t(1) << list;
+    }
 }
 
-bool LockFreeMemoryPool::pushFreeList(Slot* slot)
+void MemoryPool::unlinkLocal(LocalBlock* block)
 {
-    Slot* oldHead = freeList_.load(std::memory_order_acquire);
-    do
+    int list = block->list;
+    if (block->prevInList != nullptr)
     {
-        slot->next = oldHead;
+        block->prevInList->nextInList = block->nextInList;
     }
-    while (!freeList_.compare_exchange_weak(oldHead, slot,
-                                            std::memory_order_release,
-                                            std::memory_order_relaxed));
-    return true;
+    else
+    {
+        localLists_[list] = block->nextInList;
+    }
+    if (block->nextInList != nullptr)
+    {
+        block->nextInList->prevInList = block->prevInList;
+    }
+    if (list < kLocalBins && localLists_[list] == nullptr)
+    {
+        partialMask_ &= ~(std::uint32_t(1) << list);
+    }
+    block->list = -1;
 }
 
-Slot* LockFreeMemoryPool::popFreeList()
+// blocks on the empty list go back to the page heap, no free list walk needed
+std::size_t MemoryPool::trimLocal()
 {
-    Slot* oldHead = freeList_.load(std::memory_order_acquire);
-    while (oldHead != nullptr)
+    if (localLists_[kEmptyList] == nullptr)
+    {
+        return 0;
+    }
+
+    // empty blocks beyond the reserve are unlinked from their list first, then from the block list
+    std::size_t owned = blockRefills_ - blocksReleased_;
+    std::size_t releasing = 0;
+    for (LocalBlock* block = localLists_[kEmptyList]; block != nullptr && owned > reservedBlocks_; --owned)
+    {
+        LocalBlock* next = block->nextInList;
+        unlinkLocal(block);
+        block->list = kReleasing;
+        ++releasing;
+        block = next;
+    }
+    if (releasing == 0)
     {
-        Slot* newHead = oldHead->next;
-        if (freeList_.compare_exchange_weak(oldHead, newHead,
-                                            std::memory_order_acquire,
-                                            std::memory_order_relaxed))
+        return 0;
+    }
+
+    std::size_t released = 0;
+    Slot** link = &firstBlock_;
+    while (Slot* block = *link)
+    {
+        if (reinterpret_cast<LocalBlock*>(block)->list == kReleasing)
+        {
+            *link = block->next;
+            releaseBlock(block);
+            released += BlockSize_;
+        }
+        else
         {
-            return oldHead;
+            link = &block->next;
         }
     }
-    return nullptr;
+    blocksReleased_ += released / BlockSize_;
+    return released;
 }
 
-void LockFreeHashBucket::initMemoryPool()
+std::size_t MemoryPool::reserve(std::size_t slots, bool lockPages)
 {
-    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    std::lock_guard<std::mutex> lock(mutexForFreeList_);
+    std::lock_guard<std::mutex> lockBlock(mutexForBlock_);
+
+    std::size_t added = 0;
+    while (added < slots)
     {
-        getMemoryPool(i).init(static_cast<std::size_t>((i + 1) * SLOT_BASE_SIZE));
+        // the block being carved stays usable: its rest joins the free list, or it goes on a list
+        if (blockLocal_)
+        {
+            if (current_ != nullptr && current_->freeSlots != 0)
+            {
+                linkLocal(current_, listFor(current_));
+            }
+        }
+        else
+        {
+            carveRestToFreeList();
+        }
+
+        allocateNewBlock();
+        char* block = reinterpret_cast<char*>(firstBlock_);
+        for (std::size_t offset = PAGE_HEAP_PAGE_SIZE; offset < BlockSize_; offset += PAGE_HEAP_PAGE_SIZE)
+        {
+            static_cast<volatile char*>(block)[offset] = 0;  // uncarved memory, fault the page in
+        }
+        if (lockPages)
+        {
+            lockedBlocks_ = true;
+            if (mlock(block, BlockSize_) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "mlock of a reserved block");
+            }
+        }
+        ++reservedBlocks_;
+        added += blockLocal_ ? current_->capacity : static_cast<std::size_t>(endSlot_ - curSlot_) / slotAdvance_;
     }
+    return added;
 }
 
-void LockFreeHashBucket::ensureInitialized()
+void MemoryPool::carveRestToFreeList()
 {
-    std::call_once(g_lockFreePoolInitFlag, []() {
-        initMemoryPool();
-    });
+    while (curSlot_ != nullptr && curSlot_ != endSlot_)
+    {
+        curSlot_->next = freeList_;
+        freeList_ = curSlot_;
+        curSlot_ += slotAdvance_;
+    }
 }
 
-LockFreeMemoryPool& LockFreeHashBucket::getMemoryPool(int index)
+void MemoryPool::releaseBlock(Slot* block)
 {
-    static LockFreeMemoryPool memoryPools[MEMORY_POOL_NUM];
-    return memoryPools[index];
+    if (lockedBlocks_)
+    {
+        munlock(block, BlockSize_);  // madvise cannot drop locked pages
+    }
+    PageHeap::instance().deallocate(block);
+}
+
+bool HashBucket::initMemoryPool(const PoolConfig& config)
+{
+    bool applied = false;
+    std::call_once(g_memoryPoolInitFlag, [&]() {
+        applyConfig(config);
+        applied = true;
+    });
+    return applied;
+}
+
+bool HashBucket::initMemoryPool()
+{
+    return initMemoryPool(PoolConfig());
+}
+
+void HashBucket::ensureInitialized()
+{
+    // the default config is only built on the first call
+    std::call_once(g_memoryPoolInitFlag, []() {
+        applyConfig(PoolConfig());
+    });
+}
+
+void HashBucket::applyConfig(const PoolConfig& config)
+{
+    if (config.hugePages != HugePageMode::None)
+    {
+        PageHeap::instance().setHugePageMode(config.hugePages);
+    }
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        std::size_t blockSize = config.blockSize[i] != 0 ? config.blockSize[i] : PoolConfig::defaultBlockSize(i);
+        getMemoryPool(i).init(SizeClass::size(i), blockSize, config.colorBlocks, config.blockLocalFreeLists);
+    }
+}
+
+std::size_t HashBucket::allocateBatch(size_t size, std::size_t n, void** out)
+{
+    ensureInitialized();
+
+    if (size <= 0 || n == 0)
+    {
+        return 0;
+    }
+
+    if (size > MAX_SLOT_SIZE)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            out[i] = PageHeap::instance().allocateLarge(size);
+        }
+        largeAllocations_.fetch_add(n, std::memory_order_relaxed);
+        return n;
+    }
+
+    return ThreadCache<HashBucket>::local().allocateBatch(SizeClass::index(size), n, out);
+}
+
+void HashBucket::deallocateBatch(size_t size, std::size_t n, void* const* ptrs)
+{
+    ensureInitialized();
+
+    if (size <= 0 || n == 0)
+    {
+        return;
+    }
+    if (HeapProfiler::liveSamples() != 0)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            HeapProfiler::noteFree(ptrs[i]);
+        }
+    }
+
+    if (size > MAX_SLOT_SIZE)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            PageHeap::instance().deallocate(ptrs[i]);
+        }
+        largeFrees_.fetch_add(n, std::memory_order_relaxed);
+        return;
+    }
+
+    ThreadCache<HashBucket>::local().deallocateBatch(SizeClass::index(size), n, ptrs);
+}
+
+std::size_t HashBucket::reserve(size_t size, std::size_t slots, bool lockPages)
+{
+    ensureInitialized();
+    if (size == 0 || size > MAX_SLOT_SIZE || slots == 0)
+    {
+        return 0;
+    }
+    MemoryPool& pool = getMemoryPool(SizeClass::index(size));
+    return pool.reserve(slots, lockPages) * pool.slotSize();
+}
+
+std::size_t HashBucket::warmUp(const WarmupProfile& profile)
+{
+    std::size_t reserved = 0;
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        reserved += reserve(SizeClass::size(i), profile.slots[i], profile.lockPages);
+    }
+    return reserved;
+}
+
+std::size_t HashBucket::trim()
+{
+    ensureInitialized();
+    ThreadCache<HashBucket>::local().flush();
+    ThreadCache<HashBucket>::drainOrphans();
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        getMemoryPool(i).trim();
+    }
+    return PageHeap::instance().releaseFreeMemory();
+}
+
+BucketStats HashBucket::getStats()
+{
+    ensureInitialized();
+    return collectStats<HashBucket>(largeAllocations_, largeFrees_);
+}
+
+void HashBucket::lockForFork()
+{
+    ensureInitialized();
+    ThreadCache<HashBucket>::lockRegistry();  // activating threads take it before any pool lock
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        getMemoryPool(i).lockForFork();
+    }
+    PageHeap::instance().lockForFork();  // pools call into the page heap with their locks held
+}
+
+void HashBucket::unlockAfterFork()
+{
+    PageHeap::instance().unlockAfterFork();
+    for (int i = MEMORY_POOL_NUM - 1; i >= 0; --i)
+    {
+        getMemoryPool(i).unlockAfterFork();
+    }
+    ThreadCache<HashBucket>::unlockRegistry();
+}
+
+std::atomic<std::uint64_t> HashBucket::largeAllocations_{0};
+std::atomic<std::uint64_t> HashBucket::largeFrees_{0};
+
+// single instance of memory pools, constant-initialized
+MEMORY_POOL_CONSTINIT PoolArray<MemoryPool> HashBucket::pools_;
+
+LockFreeMemoryPool::~LockFreeMemoryPool()
+{
+    BlockHeader* currentBlock = firstBlock_.load(std::memory_order_acquire);
+    while (currentBlock != nullptr)
+    {
+        BlockHeader* nextBlock = currentBlock->next;
+        PageHeap::instance().deallocate(static_cast<void*>(currentBlock));
+        currentBlock = nextBlock;
+    }
+}
+
+void LockFreeMemoryPool::init(size_t slotSize, size_t blockSize, bool colorBlocks, std::size_t stripes)
+{
+    if (blockSize != 0)
+    {
+        BlockSize_ = blockSize;
+    }
+
+    SlotSize_ = slotSize;
+    if (SlotSize_ == 0)
+    {
+        SlotSize_ = sizeof(Slot);
+    }
+
+    if (SlotSize_ % sizeof(Slot) != 0)
+    {
+        SlotSize_ = ((SlotSize_ + sizeof(Slot) - 1) / sizeof(Slot)) * sizeof(Slot);
+    }
+    BlockSize_ = fitBlockSize(BlockSize_, SlotSize_, sizeof(BlockHeader));
+
+    // blocks start on a page so the aligned body offset is the same for every block
+    std::size_t alignment = slotAlignment(SlotSize_);
+    bodyOffset_ = (sizeof(BlockHeader) + alignment - 1) / alignment * alignment;
+    slotsPerBlock_ = (BlockSize_ - bodyOffset_) / SlotSize_;
+    colorStep_ = colorBlocks ? colorStepFor(SlotSize_) : 0;
+    colorCount_ = colorStep_ != 0 ? (BlockSize_ - bodyOffset_ - slotsPerBlock_ * SlotSize_) / colorStep_ + 1 : 1;
+
+    firstBlock_.store(nullptr, std::memory_order_relaxed);
+    cursor_.store(slotsPerBlock_, std::memory_order_relaxed);  // generation 0 is full, so the first call installs
+    for (auto& entry : blockRing_)
+    {
+        entry.store(0, std::memory_order_relaxed);
+    }
+    stripeMask_ = 0;
+    while (stripeMask_ + 1 < LOCK_FREE_MAX_STRIPES && (stripeMask_ + 1) * 2 <= stripes)
+    {
+        stripeMask_ = stripeMask_ * 2 + 1;
+    }
+    for (Stripe& stripe : stripes_)
+    {
+        stripe.head.store(0, std::memory_order_relaxed);
+    }
+    for (CounterShard& shard : shards_)
+    {
+        shard.allocations.store(0, std::memory_order_relaxed);
+        shard.frees.store(0, std::memory_order_relaxed);
+        shard.peakOutstanding.store(0, std::memory_order_relaxed);
+    }
+    counters_.blockRefills.store(0, std::memory_order_relaxed);
+    counters_.blocksReleased.store(0, std::memory_order_relaxed);
+}
+
+void* LockFreeMemoryPool::allocate()
+{
+    countAllocations(1);
+    if (Slot* slot = popFreeList())
+    {
+        return static_cast<void*>(slot);
+    }
+    void* p = nullptr;
+    allocateFromBlock(1, &p);
+    return p;
+}
+
+std::size_t LockFreeMemoryPool::allocateFromBlock(std::size_t n, void** out)
+{
+    for (;;)
+    {
+        // reserve indices [index, index + n) of the current block with a single fetch_add
+        std::uint64_t cursor = cursor_.fetch_add(n, std::memory_order_acquire);
+        std::uint64_t generation = cursor >> kGenerationShift;
+        std::size_t index = static_cast<std::size_t>(cursor & kIndexMask);
+
+        if (index > slotsPerBlock_)
+        {
+            // another thread is installing the next block, wait for it and retry
+            for (;;)
+            {
+                std::uint64_t current = cursor_.load(std::memory_order_acquire);
+                if ((current >> kGenerationShift) != generation || (current & kIndexMask) <= slotsPerBlock_)
+                {
+                    break;
+                }
+                std::this_thread::yield();
+            }
+            continue;
+        }
+
+        std::size_t count = 0;
+        if (index < slotsPerBlock_)
+        {
+            std::uint64_t entry = blockRing_[generation % kBlockRing].load(std::memory_order_acquire);
+            if (tagOf(entry) != (generation & kTagMask))
+            {
+                // descheduled for a whole ring of installs: the reserved slots are lost, take others;
+                // this cannot happen to the installer, the ring only moves on after its install
+                continue;
+            }
+            char* body = blockBody(reinterpret_cast<BlockHeader*>(headSlot(entry)), generation);
+            count = std::min(n, slotsPerBlock_ - index);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                out[i] = body + (index + i) * SlotSize_;
+            }
+            if (index + n <= slotsPerBlock_)
+            {
+                return count;
+            }
+        }
+
+        // exactly one reservation covers index slotsPerBlock_: its thread installs the next block
+        // and keeps the first slots of it for the rest of its request
+        BlockHeader* newBlock;
+        try
+        {
+            newBlock = allocateNewBlock();
+        }
+        catch (...)
+        {
+            // reopen the install for the next caller
+            cursor_.store((generation << kGenerationShift) | slotsPerBlock_, std::memory_order_relaxed);
+            if (count > 0)
+            {
+                return count;
+            }
+            throw;
+        }
+        std::size_t taken = std::min(n - count, slotsPerBlock_);
+        std::uint64_t next = generation + 1;
+        blockRing_[next % kBlockRing].store(taggedPointer(next & kTagMask, newBlock), std::memory_order_release);
+        cursor_.store((next << kGenerationShift) | taken, std::memory_order_release);
+
+        char* body = blockBody(newBlock, next);
+        for (std::size_t i = 0; i < taken; ++i)
+        {
+            out[count + i] = body + i * SlotSize_;
+        }
+        return count + taken;
+    }
+}
+
+void LockFreeMemoryPool::deallocate(void* p)
+{
+    if (p == nullptr)
+    {
+        return;
+    }
+
+    Slot* slot = static_cast<Slot*>(p);
+    while (!pushFreeList(slot))
+    {
+        // retry until CAS succeeds
+    }
+    counterShard().frees.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::size_t LockFreeMemoryPool::allocateBatch(std::size_t n, void** out)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    std::size_t count = 0;
+    if (n == 1)
+    {
+        if (Slot* slot = popFreeList())
+        {
+            out[count++] = slot;
+        }
+    }
+    else
+    {
+        // take a whole free list with one CAS, keep n slots and give the remainder back;
+        // walking a detached chain is safe because nobody else can pop from it any more
+        Slot* slot = detachFreeList();
+        while (count < n && slot != nullptr)
+        {
+            out[count++] = slot;
+            slot = slot->next;
+        }
+        if (slot != nullptr)
+        {
+            spliceFreeList(slot);
+        }
+    }
+
+    while (count < n)
+    {
+        count += allocateFromBlock(n - count, out + count);
+    }
+    countAllocations(count);
+    return count;
+}
+
+void LockFreeMemoryPool::deallocateBatch(std::size_t n, void* const* ptrs)
+{
+    if (n == 0)
+    {
+        return;
+    }
+
+    for (std::size_t i = 0; i + 1 < n; ++i)
+    {
+        static_cast<Slot*>(ptrs[i])->next = static_cast<Slot*>(ptrs[i + 1]);
+    }
+    Slot* first = static_cast<Slot*>(ptrs[0]);
+    Slot* tail = static_cast<Slot*>(ptrs[n - 1]);
+
+    // splice the whole chain with one CAS
+    std::atomic<std::uint64_t>& freeList = homeStripe().head;
+    Backoff backoff;
+    std::uint64_t oldHead = freeList.load(std::memory_order_acquire);
+    for (;;)
+    {
+        tail->next = headSlot(oldHead);
+        if (freeList.compare_exchange_weak(oldHead, nextHead(oldHead, first),
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed))
+        {
+            break;
+        }
+        backoff.pause();
+    }
+    counterShard().frees.fetch_add(n, std::memory_order_relaxed);
+}
+
+void LockFreeMemoryPool::spliceFreeList(Slot* chain)
+{
+    // the tail is only needed when the list is not empty, which is rare right after a detach
+    std::atomic<std::uint64_t>& freeList = homeStripe().head;
+    Backoff backoff;
+    Slot* tail = nullptr;
+    std::uint64_t oldHead = freeList.load(std::memory_order_acquire);
+    for (;;)
+    {
+        if (headSlot(oldHead) != nullptr && tail == nullptr)
+        {
+            tail = chain;
+            while (tail->next != nullptr)
+            {
+                tail = tail->next;
+            }
+        }
+        if (tail != nullptr)
+        {
+            tail->next = headSlot(oldHead);
+        }
+        if (freeList.compare_exchange_weak(oldHead, nextHead(oldHead, chain),
+                                           std::memory_order_release,
+                                           std::memory_order_acquire))
+        {
+            return;
+        }
+        backoff.pause();
+    }
+}
+
+LockFreeMemoryPool::BlockHeader* LockFreeMemoryPool::allocateNewBlock()
+{
+    void* newBlock = PageHeap::instance().allocatePages(BlockSize_ / PAGE_HEAP_PAGE_SIZE, SlotSize_);
+    BlockHeader* header = new (newBlock) BlockHeader{firstBlock_.load(std::memory_order_relaxed)};
+    firstBlock_.store(header, std::memory_order_release);
+    counters_.blockRefills.fetch_add(1, std::memory_order_relaxed);
+    return header;
+}
+
+char* LockFreeMemoryPool::blockBody(BlockHeader* block, std::uint64_t generation) const
+{
+    return reinterpret_cast<char*>(block) + bodyOffset_ + (generation % colorCount_) * colorStep_;
+}
+
+LockFreeMemoryPool::CounterShard& LockFreeMemoryPool::counterShard()
+{
+    return shards_[threadNumber()];
+}
+
+void LockFreeMemoryPool::countAllocations(std::size_t n)
+{
+    // only the shard's own line is touched; the CAS runs when the mark moves and contends only
+    // with threads sharing the shard
+    CounterShard& shard = counterShard();
+    std::uint64_t allocations = shard.allocations.fetch_add(n, std::memory_order_relaxed) + n;
+    std::uint64_t frees = shard.frees.load(std::memory_order_relaxed);
+    if (allocations <= frees)
+    {
+        return;  // the shard frees slots other threads allocated
+    }
+    std::uint64_t outstanding = allocations - frees;
+    std::uint64_t peak = shard.peakOutstanding.load(std::memory_order_relaxed);
+    while (outstanding > peak &&
+           !shard.peakOutstanding.compare_exchange_weak(peak, outstanding, std::memory_order_relaxed))
+    {
+    }
+}
+
+PoolStats LockFreeMemoryPool::stats() const
+{
+    PoolStats stats{};
+    stats.slotSize = SlotSize_;
+    stats.blockSize = BlockSize_;
+    // frees first, so a slot freed while we sum rarely pushes frees past allocations; the loads are
+    // relaxed, so the differences below still clamp at 0
+    for (const CounterShard& shard : shards_)
+    {
+        stats.frees += shard.frees.load(std::memory_order_relaxed);
+    }
+    std::uint64_t peak = 0;
+    for (const CounterShard& shard : shards_)
+    {
+        stats.allocations += shard.allocations.load(std::memory_order_relaxed);
+        peak += shard.peakOutstanding.load(std::memory_order_relaxed);
+    }
+    stats.blockRefills = counters_.blockRefills.load(std::memory_order_relaxed);
+    stats.blocksOwned = stats.blockRefills - counters_.blocksReleased.load(std::memory_order_relaxed);
+    stats.bytesReserved = stats.blocksOwned * BlockSize_;
+    stats.bytesInUse = stats.allocations > stats.frees ? (stats.allocations - stats.frees) * SlotSize_ : 0;
+    stats.bytesOutstanding = stats.bytesInUse;
+    // the outstanding count at any moment is the sum of the shards' counts, each at most its own
+    // mark; max() only covers shards read at different moments
+    stats.peakBytesOutstanding = std::max<std::size_t>(peak * SlotSize_, stats.bytesOutstanding);
+    return stats;
+}
+
+std::size_t LockFreeMemoryPool::trim()
+{
+    std::lock_guard<std::mutex> lock(mutexForTrim_);
+
+    BlockHeader* head = firstBlock_.load(std::memory_order_acquire);
+    if (head == nullptr)
+    {
+        return 0;
+    }
+
+    // take every stripe's list private; concurrent pops that already read a slot's next
+    // fail their CAS because the tag moved, concurrent pushes start a new list
+    Slot* detached = nullptr;
+    for (std::size_t i = 0; i <= stripeMask_; ++i)
+    {
+        std::atomic<std::uint64_t>& freeList = stripes_[i].head;
+        std::uint64_t oldHead = freeList.load(std::memory_order_acquire);
+        while (!freeList.compare_exchange_weak(oldHead, nextHead(oldHead, nullptr),
+                                               std::memory_order_acquire,
+                                               std::memory_order_acquire))
+        {
+        }
+        Slot* chain = headSlot(oldHead);
+        if (chain == nullptr)
+        {
+            continue;
+        }
+        Slot* tail = chain;
+        while (tail->next != nullptr)
+        {
+            tail = tail->next;
+        }
+        tail->next = detached;
+        detached = chain;
+    }
+
+    PageHeap& pageHeap = PageHeap::instance();
+    for (BlockHeader* block = head; block != nullptr; block = block->next)
+    {
+        pageHeap.spanOf(block)->freeSlots = 0;
+    }
+    for (Slot* slot = detached; slot != nullptr; slot = slot->next)
+    {
+        ++pageHeap.spanOf(slot)->freeSlots;
+    }
+
+    // the head block is skipped, it is the one being carved; every older block was carved to the
+    // end, and no thread dereferences a block it has no slot in, so fully free ones can go
+    constexpr std::size_t kReleasing = ~std::size_t(0);
+    for (BlockHeader* block = head->next; block != nullptr; block = block->next)
+    {
+        Span* span = pageHeap.spanOf(block);
+        if (span->freeSlots == slotsPerBlock_)
+        {
+            span->freeSlots = kReleasing;
+        }
+    }
+
+    // survivors go back to the free list with one splice
+    Slot* keptHead = nullptr;
+    Slot* keptTail = nullptr;
+    for (Slot* slot = detached; slot != nullptr; )
+    {
+        Slot* next = slot->next;
+        if (pageHeap.spanOf(slot)->freeSlots != kReleasing)
+        {
+            slot->next = keptHead;
+            keptHead = slot;
+            if (keptTail == nullptr)
+            {
+                keptTail = slot;
+            }
+        }
+        slot = next;
+    }
+    if (keptHead != nullptr)
+    {
+        std::atomic<std::uint64_t>& freeList = homeStripe().head;
+        std::uint64_t current = freeList.load(std::memory_order_acquire);
+        do
+        {
+            keptTail->next = headSlot(current);
+        }
+        while (!freeList.compare_exchange_weak(current, nextHead(current, keptHead),
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+    }
+
+    // only the head is ever prepended to, so unlinking behind it is safe against installers
+    std::size_t released = 0;
+    BlockHeader* prev = head;
+    while (BlockHeader* block = prev->next)
+    {
+        if (pageHeap.spanOf(block)->freeSlots == kReleasing)
+        {
+            prev->next = block->next;
+            pageHeap.deallocate(block);
+            released += BlockSize_;
+        }
+        else
+        {
+            prev = block;
+        }
+    }
+    counters_.blocksReleased.fetch_add(released / BlockSize_, std::memory_order_relaxed);
+    return released;
+}
+
+LockFreeMemoryPool::Stripe& LockFreeMemoryPool::homeStripe()
+{
+    return stripes_[stripeMask_ == 0 ? 0 : threadNumber() & stripeMask_];
+}
+
+bool LockFreeMemoryPool::pushFreeList(Slot* slot)
+{
+    std::atomic<std::uint64_t>& freeList = homeStripe().head;
+    Backoff backoff;
+    std::uint64_t oldHead = freeList.load(std::memory_order_acquire);
+    for (;;)
+    {
+        slot->next = headSlot(oldHead);
+        if (freeList.compare_exchange_weak(oldHead, nextHead(oldHead, slot),
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed))
+        {
+            return true;
+        }
+        backoff.pause();
+    }
+}
+
+Slot* LockFreeMemoryPool::popFreeList()
+{
+    std::atomic<std::uint64_t>& freeList = homeStripe().head;
+    Backoff backoff;
+    std::uint64_t oldHead = freeList.load(std::memory_order_acquire);
+    while (Slot* slot = headSlot(oldHead))
+    {
+        // slot may already be owned by another thread here, so next can be stale;
+        // the tag makes the CAS fail in that case instead of installing it
+        Slot* newHead = slot->next;
+        if (freeList.compare_exchange_weak(oldHead, nextHead(oldHead, newHead),
+                                           std::memory_order_acquire,
+                                           std::memory_order_acquire))
+        {
+            return slot;
+        }
+        backoff.pause();
+    }
+    if (stripeMask_ == 0)
+    {
+        return nullptr;
+    }
+
+    // our stripe is empty: steal another stripe's whole list, keep one slot and move the rest
+    // to ours, so the following pops are local again
+    Slot* chain = detachFreeList();
+    if (chain != nullptr && chain->next != nullptr)
+    {
+        spliceFreeList(chain->next);
+    }
+    return chain;
+}
+
+Slot* LockFreeMemoryPool::detachFreeList()
+{
+    std::size_t home = &homeStripe() - stripes_;
+    for (std::size_t i = 0; i <= stripeMask_; ++i)
+    {
+        std::atomic<std::uint64_t>& freeList = stripes_[(home + i) & stripeMask_].head;
+        Backoff backoff;
+        std::uint64_t oldHead = freeList.load(std::memory_order_acquire);
+        while (headSlot(oldHead) != nullptr)
+        {
+            if (freeList.compare_exchange_weak(oldHead, nextHead(oldHead, nullptr),
+                                               std::memory_order_acquire,
+                                               std::memory_order_acquire))
+            {
+                return headSlot(oldHead);
+            }
+            backoff.pause();
+        }
+    }
+    return nullptr;
+}
+
+bool LockFreeHashBucket::initMemoryPool(const PoolConfig& config)
+{
+    bool applied = false;
+    std::call_once(g_lockFreePoolInitFlag, [&]() {
+        applyConfig(config);
+        applied = true;
+    });
+    return applied;
+}
+
+bool LockFreeHashBucket::initMemoryPool()
+{
+    return initMemoryPool(PoolConfig());
+}
+
+void LockFreeHashBucket::ensureInitialized()
+{
+    // the default config is only built on the first call
+    std::call_once(g_lockFreePoolInitFlag, []() {
+        applyConfig(PoolConfig());
+    });
+}
+
+void LockFreeHashBucket::applyConfig(const PoolConfig& config)
+{
+    if (config.hugePages != HugePageMode::None)
+    {
+        PageHeap::instance().setHugePageMode(config.hugePages);
+    }
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        std::size_t blockSize = config.blockSize[i] != 0 ? config.blockSize[i] : PoolConfig::defaultBlockSize(i);
+        getMemoryPool(i).init(SizeClass::size(i), blockSize, config.colorBlocks, config.freeListStripes);
+    }
+}
+
+std::size_t LockFreeHashBucket::allocateBatch(size_t size, std::size_t n, void** out)
+{
+    ensureInitialized();
+
+    if (size <= 0 || n == 0)
+    {
+        return 0;
+    }
+
+    if (size > MAX_SLOT_SIZE)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            out[i] = PageHeap::instance().allocateLarge(size);
+        }
+        largeAllocations_.fetch_add(n, std::memory_order_relaxed);
+        return n;
+    }
+
+    return ThreadCache<LockFreeHashBucket>::local().allocateBatch(SizeClass::index(size), n, out);
+}
+
+void LockFreeHashBucket::deallocateBatch(size_t size, std::size_t n, void* const* ptrs)
+{
+    ensureInitialized();
+
+    if (size <= 0 || n == 0)
+    {
+        return;
+    }
+
+    if (size > MAX_SLOT_SIZE)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            PageHeap::instance().deallocate(ptrs[i]);
+        }
+        largeFrees_.fetch_add(n, std::memory_order_relaxed);
+        return;
+    }
+
+    ThreadCache<LockFreeHashBucket>::local().deallocateBatch(SizeClass::index(size), n, ptrs);
+}
+
+std::size_t LockFreeHashBucket::trim()
+{
+    ensureInitialized();
+    ThreadCache<LockFreeHashBucket>::local().flush();
+    ThreadCache<LockFreeHashBucket>::drainOrphans();
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        getMemoryPool(i).trim();
+    }
+    return PageHeap::instance().releaseFreeMemory();
+}
+
+BucketStats LockFreeHashBucket::getStats()
+{
+    ensureInitialized();
+    return collectStats<LockFreeHashBucket>(largeAllocations_, largeFrees_);
+}
+
+std::atomic<std::uint64_t> LockFreeHashBucket::largeAllocations_{0};
+std::atomic<std::uint64_t> LockFreeHashBucket::largeFrees_{0};
+
+MEMORY_POOL_CONSTINIT PoolArray<LockFreeMemoryPool> LockFreeHashBucket::pools_;
+
+namespace
+{
+// ThreadCacheReaper flushes the owning thread's cache when the thread exits.
+// It lives apart from ThreadCache so the cache itself stays trivially destructible.
+template<typename Bucket>
+struct ThreadCacheReaper
+{
+    ~ThreadCacheReaper()
+    {
+        ThreadCache<Bucket>::local().retire();
+    }
+};
+
+// every active cache of one bucket, so getStats() can sum their counts; an exiting thread folds
+// its counts into the retired totals before its cache goes away. Constant-initialized and never
+// destroyed, like the pools.
+template<typename Bucket>
+struct CacheRegistry
+{
+    std::mutex mutex;
+    ThreadCache<Bucket>* head;
+    void* freeQueues;  // RemoteQueues of exited threads, waiting for the next cache to adopt them
+    std::atomic<std::uint64_t> retiredAllocations[MEMORY_POOL_NUM];
+    std::atomic<std::uint64_t> retiredFrees[MEMORY_POOL_NUM];
+};
+
+template<typename Bucket>
+CacheRegistry<Bucket> g_cacheRegistry;
+}  // namespace
+
+template<typename Bucket>
+void* ThreadCache<Bucket>::refill(int index)
+{
+    auto& pool = Bucket::getMemoryPool(index);
+    if (retired_)
+    {
+        countRetired(index, true);
+        return pool.allocate();
+    }
+    if (!active_)
+    {
+        activate();
+    }
+
+    FreeList& list = lists_[index];
+    if (collectRemote(index))
+    {
+        Slot* slot = list.head;
+        list.head = slot->next;
+        --list.length;
+        return static_cast<void*>(slot);
+    }
+
+    void* batch[THREAD_CACHE_MAX_BATCH] = {};  // GCC cannot see allocateBatch fill it (-Wmaybe-uninitialized)
+    std::size_t count = pool.allocateBatch(list.batchSize, batch);
+    claimBlocks(batch, count);
+
+    // hand out the first slot, keep the rest in the magazine
+    for (std::size_t i = count; i > 1; --i)
+    {
+        Slot* slot = static_cast<Slot*>(batch[i - 1]);
+        slot->next = list.head;
+        list.head = slot;
+        ++list.length;
+    }
+    return batch[0];
+}
+
+template<typename Bucket>
+void ThreadCache<Bucket>::overflow(int index, void* p)
+{
+    if (retired_)
+    {
+        countRetired(index, false);
+        Bucket::getMemoryPool(index).deallocate(p);
+        return;
+    }
+    if (!active_)
+    {
+        activate();
+    }
+
+    FreeList& list = lists_[index];
+    if (list.length < list.maxLength)
+    {
+        // first free on this thread, the list only just got its capacity
+        Slot* slot = static_cast<Slot*>(p);
+        slot->next = list.head;
+        list.head = slot;
+        ++list.length;
+        return;
+    }
+    void* batch[THREAD_CACHE_MAX_BATCH];
+    std::size_t count = 0;
+    batch[count++] = p;
+    while (count < list.batchSize && list.head != nullptr)
+    {
+        batch[count++] = list.head;
+        list.head = list.head->next;
+        --list.length;
+    }
+    giveBack(index, batch, count);
+}
+
+template<typename Bucket>
+void ThreadCache<Bucket>::activate()
+{
+    Bucket::ensureInitialized();  // useMemory() leaves that to the first slow-path call of a thread
+    static thread_local ThreadCacheReaper<Bucket> reaper;
+    (void)reaper;
+
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        std::size_t batch = cacheBatchSize(Bucket::getMemoryPool(i).slotSize());
+        lists_[i].batchSize = static_cast<std::uint32_t>(batch);
+        lists_[i].maxLength = static_cast<std::uint32_t>(batch * 2);
+    }
+
+    CacheRegistry<Bucket>& registry = g_cacheRegistry<Bucket>;
+    {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        remote_ = static_cast<RemoteQueues*>(registry.freeQueues);
+        if (remote_ != nullptr)
+        {
+            registry.freeQueues = remote_->nextFree;  // slots still queued there are collected by us
+        }
+    }
+    if (remote_ == nullptr)
+    {
+        remote_ = new RemoteQueues();
+    }
+
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    prevCache_ = nullptr;
+    nextCache_ = registry.head;
+    if (registry.head != nullptr)
+    {
+        registry.head->prevCache_ = this;
+    }
+    registry.head = this;
+    active_ = true;
+}
+
+template<typename Bucket>
+std::size_t ThreadCache<Bucket>::allocateBatch(int index, std::size_t n, void** out)
+{
+    auto& pool = Bucket::getMemoryPool(index);
+    if (retired_)
+    {
+        countRetired(index, true, n);
+        return pool.allocateBatch(n, out);
+    }
+    if (!active_)
+    {
+        activate();
+    }
+
+    FreeList& list = lists_[index];
+    bump(list.allocations, n);
+    std::size_t count = 0;
+    while (count < n && list.head != nullptr)
+    {
+        out[count++] = list.head;
+        list.head = list.head->next;
+        --list.length;
+    }
+    if (count < n)
+    {
+        // claimed like a refill, so frees from other threads come back through our queues
+        std::size_t carved = pool.allocateBatch(n - count, out + count);
+        claimBlocks(out + count, carved);
+        count += carved;
+    }
+    return count;
+}
+
+template<typename Bucket>
+void ThreadCache<Bucket>::deallocateBatch(int index, std::size_t n, void* const* ptrs)
+{
+    if (retired_)
+    {
+        countRetired(index, false, n);
+        Bucket::getMemoryPool(index).deallocateBatch(n, ptrs);
+        return;
+    }
+    if (!active_)
+    {
+        activate();
+    }
+
+    FreeList& list = lists_[index];
+    bump(list.frees, n);
+    std::size_t cached = 0;
+    while (cached < n && list.length < list.maxLength)
+    {
+        Slot* slot = static_cast<Slot*>(ptrs[cached++]);
+        slot->next = list.head;
+        list.head = slot;
+        ++list.length;
+    }
+    if (cached < n)
+    {
+        giveBack(index, ptrs + cached, n - cached);
+    }
+}
+
+template<typename Bucket>
+void ThreadCache<Bucket>::flushList(int index, std::size_t count)
+{
+    FreeList& list = lists_[index];
+    void* batch[THREAD_CACHE_MAX_BATCH];
+    while (count > 0 && list.head != nullptr)
+    {
+        std::size_t n = 0;
+        while (n < THREAD_CACHE_MAX_BATCH && n < count && list.head != nullptr)
+        {
+            batch[n++] = list.head;
+            list.head = list.head->next;
+            --list.length;
+        }
+        Bucket::getMemoryPool(index).deallocateBatch(n, batch);
+        count -= n;
+    }
+}
+
+template<typename Bucket>
+void ThreadCache<Bucket>::flush()
+{
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        flushList(i, lists_[i].length);
+    }
+    if (remote_ != nullptr)
+    {
+        drainQueues(remote_);
+    }
+}
+
+template<typename Bucket>
+void ThreadCache<Bucket>::retire()
+{
+    flush();
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        lists_[i].maxLength = 0;
+    }
+
+    CacheRegistry<Bucket>& registry = g_cacheRegistry<Bucket>;
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    if (active_)
+    {
+        for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+        {
+            registry.retiredAllocations[i].fetch_add(lists_[i].allocations.load(std::memory_order_relaxed),
+                                                     std::memory_order_relaxed);
+            registry.retiredFrees[i].fetch_add(lists_[i].frees.load(std::memory_order_relaxed),
+                                               std::memory_order_relaxed);
+        }
+        (prevCache_ != nullptr ? prevCache_->nextCache_ : registry.head) = nextCache_;
+        if (nextCache_ != nullptr)
+        {
+            nextCache_->prevCache_ = prevCache_;
+        }
+        // blocks we claimed keep pointing at our queues, the next cache to activate inherits them
+        remote_->nextFree = static_cast<RemoteQueues*>(registry.freeQueues);
+        registry.freeQueues = remote_;
+    }
+    retired_ = true;
+}
+
+// take every slot other threads freed to us for this class into the local list
+template<typename Bucket>
+bool ThreadCache<Bucket>::collectRemote(int index)
+{
+    std::atomic<Slot*>& queue = remote_->heads[index];
+    if (queue.load(std::memory_order_relaxed) == nullptr)
+    {
+        return false;
+    }
+    Slot* chain = queue.exchange(nullptr, std::memory_order_acquire);
+    if (chain == nullptr)
+    {
+        return false;
+    }
+
+    FreeList& list = lists_[index];
+    Slot* tail = chain;
+    std::uint32_t count = 1;
+    while (tail->next != nullptr)
+    {
+        tail = tail->next;
+        ++count;
+    }
+    // may take the list past maxLength: we allocated these slots and are about to hand them out
+    // again, and the next overflow() trims the list if not
+    tail->next = list.head;
+    list.head = chain;
+    list.length += count;
+    return true;
+}
+
+// the cache that last refilled from a block owns it, so frees follow the allocating thread;
+// slots are mostly carved in address order, so the lookup is skipped while they stay in one span
+template<typename Bucket>
+void ThreadCache<Bucket>::claimBlocks(void* const* slots, std::size_t count)
+{
+    PageHeap& pageHeap = PageHeap::instance();
+    const char* begin = nullptr;
+    const char* end = nullptr;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        const char* p = static_cast<const char*>(slots[i]);
+        if (p >= begin && p < end)
+        {
+            continue;
+        }
+        Span* span = pageHeap.spanOf(p);
+        begin = static_cast<const char*>(span->start());
+        end = begin + (span->pageCount << PAGE_HEAP_PAGE_SHIFT);
+        if (span->owner.load(std::memory_order_relaxed) != remote_)
+        {
+            span->owner.store(remote_, std::memory_order_release);
+        }
+    }
+}
+
+// hand surplus slots back: slots of blocks another cache claimed go to that cache's queue as one
+// chain per run of equal owners, the rest to the shared pool
+template<typename Bucket>
+void ThreadCache<Bucket>::giveBack(int index, void* const* slots, std::size_t count)
+{
+    PageHeap& pageHeap = PageHeap::instance();
+    void* toPool[THREAD_CACHE_MAX_BATCH];
+    std::size_t poolCount = 0;
+    RemoteQueues* chainOwner = nullptr;
+    Slot* chainHead = nullptr;
+    Slot* chainTail = nullptr;
+    auto pushChain = [&]() {
+        if (chainOwner == nullptr)
+        {
+            return;
+        }
+        std::atomic<Slot*>& queue = chainOwner->heads[index];
+        Slot* old = queue.load(std::memory_order_relaxed);
+        do
+        {
+            chainTail->next = old;
+        }
+        while (!queue.compare_exchange_weak(old, chainHead, std::memory_order_release, std::memory_order_relaxed));
+        chainOwner = nullptr;
+    };
+
+    const char* begin = nullptr;
+    const char* end = nullptr;
+    RemoteQueues* owner = nullptr;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        Slot* slot = static_cast<Slot*>(slots[i]);
+        const char* p = reinterpret_cast<const char*>(slot);
+        if (p < begin || p >= end)
+        {
+            Span* span = pageHeap.spanOf(p);
+            begin = static_cast<const char*>(span->start());
+            end = begin + (span->pageCount << PAGE_HEAP_PAGE_SHIFT);
+            owner = static_cast<RemoteQueues*>(span->owner.load(std::memory_order_acquire));
+        }
+
+        if (owner == nullptr || owner == remote_)
+        {
+            toPool[poolCount++] = slot;
+            if (poolCount == THREAD_CACHE_MAX_BATCH)
+            {
+                Bucket::getMemoryPool(index).deallocateBatch(poolCount, toPool);
+                poolCount = 0;
+            }
+            continue;
+        }
+        if (owner != chainOwner)
+        {
+            pushChain();
+            chainOwner = owner;
+            chainHead = slot;
+        }
+        else
+        {
+            chainTail->next = slot;
+        }
+        chainTail = slot;
+    }
+    pushChain();
+    if (poolCount > 0)
+    {
+        Bucket::getMemoryPool(index).deallocateBatch(poolCount, toPool);
+    }
+}
+
+// empty every queue into the pools; the caller owns the queues or holds the registry lock
+template<typename Bucket>
+void ThreadCache<Bucket>::drainQueues(RemoteQueues* queues)
+{
+    void* batch[THREAD_CACHE_MAX_BATCH];
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        if (queues->heads[i].load(std::memory_order_relaxed) == nullptr)
+        {
+            continue;
+        }
+        Slot* chain = queues->heads[i].exchange(nullptr, std::memory_order_acquire);
+        while (chain != nullptr)
+        {
+            std::size_t n = 0;
+            while (n < THREAD_CACHE_MAX_BATCH && chain != nullptr)
+            {
+                batch[n++] = chain;
+                chain = chain->next;
+            }
+            Bucket::getMemoryPool(i).deallocateBatch(n, batch);
+        }
+    }
+}
+
+template<typename Bucket>
+void ThreadCache<Bucket>::drainOrphans()
+{
+    CacheRegistry<Bucket>& registry = g_cacheRegistry<Bucket>;
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (auto* queues = static_cast<RemoteQueues*>(registry.freeQueues); queues != nullptr;
+         queues = queues->nextFree)
+    {
+        drainQueues(queues);
+    }
+}
+
+// calls the cache no longer sees once its counts were folded into the registry
+template<typename Bucket>
+void ThreadCache<Bucket>::countRetired(int index, bool allocation, std::uint64_t n)
+{
+    CacheRegistry<Bucket>& registry = g_cacheRegistry<Bucket>;
+    (allocation ? registry.retiredAllocations : registry.retiredFrees)[index].fetch_add(
+        n, std::memory_order_relaxed);
+}
+
+template<typename Bucket>
+void ThreadCache<Bucket>::collectCounts(std::uint64_t* allocations, std::uint64_t* frees)
+{
+    CacheRegistry<Bucket>& registry = g_cacheRegistry<Bucket>;
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        allocations[i] = registry.retiredAllocations[i].load(std::memory_order_relaxed);
+        frees[i] = registry.retiredFrees[i].load(std::memory_order_relaxed);
+    }
+    for (ThreadCache* cache = registry.head; cache != nullptr; cache = cache->nextCache_)
+    {
+        for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+        {
+            allocations[i] += cache->lists_[i].allocations.load(std::memory_order_relaxed);
+            frees[i] += cache->lists_[i].frees.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+template<typename Bucket>
+void ThreadCache<Bucket>::lockRegistry()
+{
+    g_cacheRegistry<Bucket>.mutex.lock();
+}
+
+template<typename Bucket>
+void ThreadCache<Bucket>::unlockRegistry()
+{
+    g_cacheRegistry<Bucket>.mutex.unlock();
+}
+
+namespace
+{
+#if MEMORY_POOL_RSEQ
+// glibc (2.35+) registers one struct rseq per thread at __rseq_offset from the thread pointer;
+// __rseq_size stays 0 when registration failed or was disabled with glibc.pthread.rseq=0
+inline volatile struct rseq* rseqArea()
+{
+    return reinterpret_cast<volatile struct rseq*>(static_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+}
+
+bool rseqRegistered()
+{
+    return __rseq_size != 0 && static_cast<std::int32_t>(rseqArea()->cpu_id) >= 0;
+}
+
+inline int rseqCpu()
+{
+    return static_cast<int>(rseqArea()->cpu_id_start);
+}
+
+// Restartable sequence framing, see the kernel's rseq ABI. The struct rseq_cs descriptor (label 3)
+// names the critical section [1, 2) and the abort handler 4, which must be preceded by the
+// registered signature (0x53053053, emitted as a ud1 instruction). Storing the descriptor into
+// rseq->rseq_cs (offset 8) arms the sequence, rseq->cpu_id (offset 4) is then checked against the
+// CPU the caller picked its list for; the sequence ends with exactly one committing store.
+#define MEMORY_POOL_RSEQ_BEGIN                      \
+    ".pushsection __rseq_cs, \"aw\"\n\t"            \
+    ".balign 32\n\t"                                \
+    "3:\n\t"                                        \
+    ".long 0, 0\n\t"                                \
+    ".quad 1f, 2f - 1f, 4f\n\t"                     \
+    ".popsection\n\t"                               \
+    "leaq 3b(%%rip), %%rax\n\t"                     \
+    "movq %%rax, %%fs:8(%[offset])\n\t"             \
+    "1:\n\t"                                        \
+    "cmpl %[cpu], %%fs:4(%[offset])\n\t"            \
+    "jnz 4f\n\t"
+
+#define MEMORY_POOL_RSEQ_END                        \
+    "2:\n\t"                                        \
+    ".pushsection __rseq_failure, \"ax\"\n\t"       \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                    \
+    ".long 0x53053053\n\t"                          \
+    "4:\n\t"                                        \
+    "jmp %l[abort]\n\t"                             \
+    ".popsection\n\t"
+
+// *word = desired if *word == expected and we still run on cpu;
+// 0 committed, 1 the word changed, -1 aborted
+__attribute__((always_inline)) inline int rseqCompareStore(std::atomic<std::uint64_t>& word, std::uint64_t expected,
+                                                           std::uint64_t desired, int cpu)
+{
+    __asm__ __volatile__ goto(
+        MEMORY_POOL_RSEQ_BEGIN
+        "cmpq %[word], %[expected]\n\t"
+        "jnz %l[changed]\n\t"
+        "movq %[desired], %[word]\n\t"
+        MEMORY_POOL_RSEQ_END
+        :
+        : [cpu] "r"(cpu), [offset] "r"(__rseq_offset), [word] "m"(word),
+          [expected] "r"(expected), [desired] "r"(desired)
+        : "memory", "cc", "rax"
+        : abort, changed);
+    return 0;
+abort:
+    return -1;
+changed:
+    return 1;
+}
+
+// pop the head of the slot list in word while we still run on cpu;
+// 0 popped into out, 1 the list is empty, -1 aborted
+__attribute__((always_inline)) inline int rseqPop(std::atomic<std::uint64_t>& word, std::uint64_t& out, int cpu)
+{
+    static_assert(offsetof(Slot, next) == 0, "rseqPop loads Slot::next at offset 0");
+    __asm__ __volatile__ goto(
+        MEMORY_POOL_RSEQ_BEGIN
+        "movq %[word], %%rbx\n\t"
+        "testq %%rbx, %%rbx\n\t"
+        "jz %l[empty]\n\t"
+        "movq %%rbx, %[out]\n\t"
+        "movq (%%rbx), %%rbx\n\t"
+        "movq %%rbx, %[word]\n\t"
+        MEMORY_POOL_RSEQ_END
+        :
+        : [cpu] "r"(cpu), [offset] "r"(__rseq_offset), [word] "m"(word), [out] "m"(out)
+        : "memory", "cc", "rax", "rbx"
+        : abort, empty);
+    return 0;
+abort:
+    return -1;
+empty:
+    return 1;
+}
+#endif  // MEMORY_POOL_RSEQ
+}  // namespace
+
+void PerCpuCache::init(LockFreeMemoryPool* pools)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    const int cpuCount = cpus > 0 ? static_cast<int>(cpus) : 1;
+#if MEMORY_POOL_RSEQ
+    rseq_ = rseqRegistered();
+#else
+    rseq_ = false;
+#endif
+
+    std::size_t count = static_cast<std::size_t>(cpuCount) * MEMORY_POOL_NUM;
+    lists_ = static_cast<CpuList*>(PageHeap::instance().allocateLarge(count * sizeof(CpuList)));
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        new (&lists_[i]) CpuList();
+    }
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        batchSize_[i] = static_cast<std::uint32_t>(cacheBatchSize(pools[i].slotSize()));
+    }
+    pools_ = pools;
+    cpuCount_.store(cpuCount, std::memory_order_release);
+}
+
+int PerCpuCache::currentCpu() const
+{
+#if MEMORY_POOL_RSEQ
+    if (rseq_)
+    {
+        return rseqCpu();
+    }
+#endif
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu % cpuCount_.load(std::memory_order_relaxed);
+}
+
+void* PerCpuCache::allocate(int index)
+{
+    if (Slot* slot = pop(index))
+    {
+        return slot;
+    }
+    return refill(index);
+}
+
+void PerCpuCache::deallocate(int index, void* p)
+{
+    Slot* slot = static_cast<Slot*>(p);
+    CpuList* list = push(index, slot, slot);
+    if (list == nullptr)
+    {
+        PerCpuHashBucket::ensureInitialized();
+        pools_[index].deallocate(p);
+        return;
+    }
+
+    // racy read-modify-write on purpose: a lost update only shifts the next flush
+    std::uint32_t length = list->length.load(std::memory_order_relaxed) + 1;
+    list->length.store(length, std::memory_order_relaxed);
+    if (length > 2 * batchSize_[index])
+    {
+        overflow(index);
+    }
+}
+
+Slot* PerCpuCache::pop(int index)
+{
+    const int cpuCount = cpuCount_.load(std::memory_order_acquire);
+    if (cpuCount == 0)
+    {
+        return nullptr;  // not initialized yet, refill() does that
+    }
+    for (;;)
+    {
+        int cpu = currentCpu();
+        if (cpu >= cpuCount)
+        {
+            return nullptr;
+        }
+        CpuList& list = listFor(cpu, index);
+
+        std::uint64_t head = 0;
+        int result = 1;
+#if MEMORY_POOL_RSEQ
+        if (rseq_)
+        {
+            result = rseqPop(list.head, head, cpu);
+        }
+        else
+#endif
+        {
+            head = list.head.load(std::memory_order_acquire);
+            while (Slot* slot = headSlot(head))
+            {
+                // same tagged pop as LockFreeMemoryPool::popFreeList
+                if (list.head.compare_exchange_weak(head, nextHead(head, slot->next),
+                                                    std::memory_order_acquire,
+                                                    std::memory_order_acquire))
+                {
+                    result = 0;
+                    break;
+                }
+            }
+        }
+
+        if (result == 0)
+        {
+            std::uint32_t length = list.length.load(std::memory_order_relaxed);
+            list.length.store(length == 0 ? 0 : length - 1, std::memory_order_relaxed);
+            return headSlot(head);
+        }
+        if (result == 1)
+        {
+            list.length.store(0, std::memory_order_relaxed);  // resync the estimate
+            return nullptr;
+        }
+        // aborted by preemption, migration or a signal, retry on the CPU we run on now
+    }
+}
+
+PerCpuCache::CpuList* PerCpuCache::push(int index, Slot* first, Slot* last)
+{
+    const int cpuCount = cpuCount_.load(std::memory_order_acquire);
+    if (cpuCount == 0)
+    {
+        return nullptr;
+    }
+    for (;;)
+    {
+        int cpu = currentCpu();
+        if (cpu >= cpuCount)
+        {
+            return nullptr;
+        }
+        CpuList& list = listFor(cpu, index);
+
+        std::uint64_t head = list.head.load(std::memory_order_relaxed);
+#if MEMORY_POOL_RSEQ
+        if (rseq_)
+        {
+            last->next = headSlot(head);
+            if (rseqCompareStore(list.head, head, reinterpret_cast<std::uintptr_t>(first), cpu) == 0)
+            {
+                return &list;
+            }
+            continue;
+        }
+#endif
+        do
+        {
+            last->next = headSlot(head);
+        }
+        while (!list.head.compare_exchange_weak(head, nextHead(head, first),
+                                                std::memory_order_release,
+                                                std::memory_order_relaxed));
+        return &list;
+    }
+}
+
+void* PerCpuCache::refill(int index)
+{
+    if (cpuCount_.load(std::memory_order_acquire) == 0)
+    {
+        PerCpuHashBucket::ensureInitialized();  // useMemory() leaves that to the first refill
+    }
+    void* batch[THREAD_CACHE_MAX_BATCH];
+    std::size_t count = pools_[index].allocateBatch(batchSize_[index], batch);
+    if (count > 1)
+    {
+        // chain the rest and publish it with a single commit
+        for (std::size_t i = 1; i + 1 < count; ++i)
+        {
+            static_cast<Slot*>(batch[i])->next = static_cast<Slot*>(batch[i + 1]);
+        }
+        CpuList* list = push(index, static_cast<Slot*>(batch[1]), static_cast<Slot*>(batch[count - 1]));
+        if (list == nullptr)
+        {
+            pools_[index].deallocateBatch(count - 1, batch + 1);
+        }
+        else
+        {
+            std::uint32_t length = list->length.load(std::memory_order_relaxed);
+            list->length.store(length + static_cast<std::uint32_t>(count - 1), std::memory_order_relaxed);
+        }
+    }
+    return batch[0];
+}
+
+void PerCpuCache::overflow(int index)
+{
+    void* batch[THREAD_CACHE_MAX_BATCH];
+    std::size_t count = 0;
+    while (count < batchSize_[index])
+    {
+        Slot* slot = pop(index);
+        if (slot == nullptr)
+        {
+            break;
+        }
+        batch[count++] = slot;
+    }
+    pools_[index].deallocateBatch(count, batch);
+}
+
+void PerCpuCache::flush()
+{
+    if (pools_ == nullptr)
+    {
+        return;
+    }
+
+    void* batch[THREAD_CACHE_MAX_BATCH];
+    for (int index = 0; index < MEMORY_POOL_NUM; ++index)
+    {
+        if (rseq_)
+        {
+            std::size_t count = 0;
+            while (Slot* slot = pop(index))
+            {
+                batch[count++] = slot;
+                if (count == THREAD_CACHE_MAX_BATCH)
+                {
+                    pools_[index].deallocateBatch(count, batch);
+                    count = 0;
+                }
+            }
+            pools_[index].deallocateBatch(count, batch);
+            continue;
+        }
+
+        for (int cpu = 0; cpu < cpuCount_.load(std::memory_order_relaxed); ++cpu)
+        {
+            // detach the whole list, a concurrent pop that read one of its slots fails on the tag
+            CpuList& list = listFor(cpu, index);
+            std::uint64_t head = list.head.load(std::memory_order_acquire);
+            while (headSlot(head) != nullptr
+                   && !list.head.compare_exchange_weak(head, nextHead(head, nullptr),
+                                                       std::memory_order_acquire,
+                                                       std::memory_order_acquire))
+            {
+            }
+            list.length.store(0, std::memory_order_relaxed);
+
+            Slot* slot = headSlot(head);
+            while (slot != nullptr)
+            {
+                std::size_t count = 0;
+                while (count < THREAD_CACHE_MAX_BATCH && slot != nullptr)
+                {
+                    batch[count++] = slot;
+                    slot = slot->next;
+                }
+                pools_[index].deallocateBatch(count, batch);
+            }
+        }
+    }
+}
+
+PerCpuCache PerCpuHashBucket::cache_;
+
+bool PerCpuHashBucket::initMemoryPool(const PoolConfig& config)
+{
+    bool applied = false;
+    std::call_once(g_perCpuPoolInitFlag, [&]() {
+        applyConfig(config);
+        applied = true;
+    });
+    return applied;
+}
+
+bool PerCpuHashBucket::initMemoryPool()
+{
+    return initMemoryPool(PoolConfig());
+}
+
+void PerCpuHashBucket::ensureInitialized()
+{
+    std::call_once(g_perCpuPoolInitFlag, []() {
+        applyConfig(PoolConfig());
+    });
+}
+
+void PerCpuHashBucket::applyConfig(const PoolConfig& config)
+{
+    if (config.hugePages != HugePageMode::None)
+    {
+        PageHeap::instance().setHugePageMode(config.hugePages);
+    }
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        std::size_t blockSize = config.blockSize[i] != 0 ? config.blockSize[i] : PoolConfig::defaultBlockSize(i);
+        getMemoryPool(i).init(SizeClass::size(i), blockSize, config.colorBlocks, config.freeListStripes);
+    }
+    cache_.init(&getMemoryPool(0));
+}
+
+std::size_t PerCpuHashBucket::trim()
+{
+    ensureInitialized();
+    cache_.flush();
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        getMemoryPool(i).trim();
+    }
+    return PageHeap::instance().releaseFreeMemory();
+}
+
+bool PerCpuHashBucket::usesRseq()
+{
+    ensureInitialized();
+    return cache_.usesRseq();
+}
+
+MEMORY_POOL_CONSTINIT PoolArray<LockFreeMemoryPool> PerCpuHashBucket::pools_;
+
+namespace
+{
+// Scavenger periodically trims every bucket from a background thread
+class Scavenger
+{
+public:
+    ~Scavenger()
+    {
+        stop();
+    }
+
+    void start(std::chrono::milliseconds interval)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        interval_ = interval;
+        if (!running_)
+        {
+            running_ = true;
+            thread_ = std::thread([this]() { run(); });
+        }
+        wakeup_.notify_one();
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!running_)
+            {
+                return;
+            }
+            running_ = false;
+        }
+        wakeup_.notify_one();
+        thread_.join();
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (running_)
+        {
+            if (wakeup_.wait_for(lock, interval_) == std::cv_status::timeout && running_)
+            {
+                lock.unlock();
+                HashBucket::trim();
+                LockFreeHashBucket::trim();
+                PerCpuHashBucket::trim();
+                lock.lock();
+            }
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::thread thread_;
+    std::chrono::milliseconds interval_{0};
+    bool running_ = false;
+};
+
+Scavenger& scavenger()
+{
+    // set the buckets up before the scavenger thread can trim them
+    HashBucket::ensureInitialized();
+    LockFreeHashBucket::ensureInitialized();
+    PerCpuHashBucket::ensureInitialized();
+    static Scavenger instance;
+    return instance;
+}
+}  // namespace
+
+void startScavenger(std::chrono::milliseconds interval)
+{
+    scavenger().start(interval);
+}
+
+void stopScavenger()
+{
+    scavenger().stop();
+}
+
+std::size_t PoolConfig::defaultBlockSize(int index)
+{
+    std::size_t blockSize = SizeClass::size(index) * DEFAULT_SLOTS_PER_BLOCK;
+    if (blockSize > MAX_DEFAULT_BLOCK_SIZE)
+    {
+        blockSize = MAX_DEFAULT_BLOCK_SIZE;
+    }
+    if (blockSize < PAGE_HEAP_PAGE_SIZE)
+    {
+        blockSize = PAGE_HEAP_PAGE_SIZE;
+    }
+    return blockSize;
+}
+
+void dumpSizeClasses(std::ostream& os)
+{
+    os << "class  slot_size  max_waste_bytes  max_waste_pct\n";
+    for (int i = 0; i < SizeClass::kNumClasses; ++i)
+    {
+        std::size_t slot = SizeClass::size(i);
+        std::size_t waste = SizeClass::maxWaste(i);
+        os << i << "  " << slot << "  " << waste << "  "
+           << (100.0 * static_cast<double>(waste) / static_cast<double>(slot)) << "\n";
+    }
+}
+
+WarmupProfile WarmupProfile::fromStats(const BucketStats& stats)
+{
+    WarmupProfile profile;
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        const PoolStats& pool = stats.classes[i];
+        profile.slots[i] = pool.slotSize != 0 ? pool.peakBytesOutstanding / pool.slotSize : 0;
+    }
+    return profile;
+}
+
+void dumpStats(std::ostream& os, const BucketStats& stats)
+{
+    std::uint64_t allocations = 0;
+    std::uint64_t frees = 0;
+    std::size_t reserved = 0;
+    std::size_t inUse = 0;
+    os << "class  slot_size  allocations  frees  in_use_bytes  outstanding_bytes  peak_bytes  "
+          "blocks  reserved_bytes\n";
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        const PoolStats& pool = stats.classes[i];
+        allocations += pool.allocations;
+        frees += pool.frees;
+        reserved += pool.bytesReserved;
+        inUse += pool.bytesInUse;
+        if (pool.allocations == 0 && pool.blocksOwned == 0)
+        {
+            continue;
+        }
+        os << i << "  " << pool.slotSize << "  " << pool.allocations << "  " << pool.frees << "  "
+           << pool.bytesInUse << "  " << pool.bytesOutstanding << "  " << pool.peakBytesOutstanding << "  "
+           << pool.blocksOwned << "  " << pool.bytesReserved << "\n";
+    }
+    os << "small: " << allocations << " allocations, " << frees << " frees, " << inUse << " bytes in use, "
+       << reserved << " bytes reserved\n";
+    os << "large: " << stats.largeAllocations << " allocations, " << stats.largeFrees << " frees\n";
+    os << "page heap: " << stats.pageHeapReservedBytes << " bytes reserved, " << stats.pageHeapFreeBytes
+       << " free, " << stats.pageHeapReleasedBytes << " released\n";
+}
+
+void dumpStatsJson(std::ostream& os, const BucketStats& stats)
+{
+    os << "{\"classes\":[";
+    for (int i = 0; i < MEMORY_POOL_NUM; ++i)
+    {
+        const PoolStats& pool = stats.classes[i];
+        os << (i == 0 ? "" : ",") << "{\"class\":" << i << ",\"slot_size\":" << pool.slotSize
+           << ",\"block_size\":" << pool.blockSize << ",\"allocations\":" << pool.allocations
+           << ",\"frees\":" << pool.frees << ",\"block_refills\":" << pool.blockRefills
+           << ",\"blocks_owned\":" << pool.blocksOwned << ",\"bytes_reserved\":" << pool.bytesReserved
+           << ",\"bytes_in_use\":" << pool.bytesInUse << ",\"bytes_outstanding\":" << pool.bytesOutstanding
+           << ",\"peak_bytes_outstanding\":" << pool.peakBytesOutstanding << "}";
+    }
+    os << "],\"large_allocations\":" << stats.largeAllocations << ",\"large_frees\":" << stats.largeFrees
+       << ",\"page_heap\":{\"reserved_bytes\":" << stats.pageHeapReservedBytes
+       << ",\"free_bytes\":" << stats.pageHeapFreeBytes << ",\"released_bytes\":"
+       << stats.pageHeapReleasedBytes << "}}\n";
 }
 
-}  // namespace memorypool
\ No newline at end of file
+template class ThreadCache<HashBucket>;
+template class ThreadCache<LockFreeHashBucket>;
+
+}  // namespace memorypool
@@ -1,38 +1,335 @@
+#pragma once
+
+#include "HeapProfiler.h"
+#include "PageHeap.h"
+
 #include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <iosfwd>
 #include <mutex>
 #include <new>
+#include <type_traits>
 #include <utility>
 
 namespace memorypool 
 {
 
-#define MEMORY_POOL_NUM 64
 #define SLOT_BASE_SIZE 8
-#define MAX_SLOT_SIZE 512
+#define SIZE_CLASS_FINE_LIMIT 128  // classes grow by SLOT_BASE_SIZE up to this size
+#define SIZE_CLASS_STEPS_PER_DOUBLING 4  // and by this many geometric steps per power of two above it
+#define MAX_SLOT_SIZE 32768  // largest pooled size, bigger requests get their own page heap span
+#define MEMORY_POOL_NUM (SizeClass::kNumClasses)
+#define MIN_SLOTS_PER_BLOCK 8  // pools grow BlockSize_ until a block holds at least this many slots
+#define DEFAULT_SLOTS_PER_BLOCK 32  // default block size per class aims for this many slots,
+#define MAX_DEFAULT_BLOCK_SIZE (256 * 1024)  // capped here (MIN_SLOTS_PER_BLOCK still wins)
+#define THREAD_CACHE_BATCH_BYTES 4096  // bytes moved between a thread cache and its pool per refill/flush
+#define THREAD_CACHE_MAX_BATCH 64  // upper bound of slots moved per refill/flush
+#define BLOCK_COLOR_STEP 64  // new blocks shift their first slot by a multiple of this (a cache line)
+#define LOCK_FREE_MAX_STRIPES 16  // free list heads a LockFreeMemoryPool can spread its frees over
+#define LOCK_FREE_COUNTER_SHARDS 64  // cache lines a LockFreeMemoryPool spreads its counters over
+#define LOCK_FREE_MAX_BACKOFF 1024  // longest pause run between two CAS attempts on one free list head
 
 // hierarchy: one HashBucket -> many MemoryPool -> many Block -> many Slot
+// blocks are page heap spans, see PageHeap.h
+// every thread keeps a ThreadCache in front of the bucket, so most calls never reach a pool
 
 struct Slot
 {
     Slot* next;
 };
 
+namespace detail
+{
+constexpr std::size_t nextClassSize(std::size_t size)
+{
+    if (size < SIZE_CLASS_FINE_LIMIT)
+    {
+        return size + SLOT_BASE_SIZE;
+    }
+    std::size_t power = SIZE_CLASS_FINE_LIMIT;
+    while (power * 2 <= size)
+    {
+        power *= 2;
+    }
+    std::size_t step = power / SIZE_CLASS_STEPS_PER_DOUBLING;
+    return size + (step < SLOT_BASE_SIZE ? SLOT_BASE_SIZE : step);
+}
+
+constexpr int countSizeClasses()
+{
+    int count = 0;
+    for (std::size_t size = SLOT_BASE_SIZE; size <= MAX_SLOT_SIZE; size = nextClassSize(size))
+    {
+        ++count;
+    }
+    return count;
+}
+
+constexpr int kNumSizeClasses = countSizeClasses();
+constexpr std::size_t kSizeLookupEntries = MAX_SLOT_SIZE / SLOT_BASE_SIZE + 1;
+
+struct SizeClassTables
+{
+    std::size_t sizes[kNumSizeClasses];
+    std::uint8_t lookup[kSizeLookupEntries];  // (size + 7) / 8 -> class index
+};
+
+constexpr SizeClassTables buildSizeClassTables()
+{
+    SizeClassTables tables{};
+    int index = 0;
+    std::size_t entry = 1;
+    for (std::size_t size = SLOT_BASE_SIZE; size <= MAX_SLOT_SIZE; size = nextClassSize(size), ++index)
+    {
+        tables.sizes[index] = size;
+        for (; entry * SLOT_BASE_SIZE <= size; ++entry)
+        {
+            tables.lookup[entry] = static_cast<std::uint8_t>(index);
+        }
+    }
+    return tables;
+}
+
+inline constexpr SizeClassTables kSizeClassTables = buildSizeClassTables();
+
+static_assert(kNumSizeClasses <= 256, "size class index must fit the byte lookup table");
+static_assert(kSizeClassTables.sizes[kNumSizeClasses - 1] == MAX_SLOT_SIZE,
+              "MAX_SLOT_SIZE must be one of the generated size classes");
+}  // namespace detail
+
+// SizeClass maps a request size to its pool index.
+// Classes are 8, 16, ..., SIZE_CLASS_FINE_LIMIT, then SIZE_CLASS_STEPS_PER_DOUBLING steps per
+// power of two (160, 192, 224, 256, 320, ...) up to MAX_SLOT_SIZE. The table is built at compile
+// time; index() is a single load from a byte table indexed by size / SLOT_BASE_SIZE.
+// Internal fragmentation is at most SLOT_BASE_SIZE - 1 bytes in the fine range and below
+// 1 / (SIZE_CLASS_STEPS_PER_DOUBLING + 1) of the slot above it, see maxWaste().
+class SizeClass
+{
+public:
+    static constexpr int kNumClasses = detail::kNumSizeClasses;
+
+    // size must be in [1, MAX_SLOT_SIZE]
+    static constexpr int index(std::size_t size)
+    {
+        return detail::kSizeClassTables.lookup[(size + SLOT_BASE_SIZE - 1) / SLOT_BASE_SIZE];
+    }
+
+    static constexpr std::size_t size(int index)
+    {
+        return detail::kSizeClassTables.sizes[index];
+    }
+
+    // largest number of bytes a request can waste in this class (request = previous class + 1)
+    static constexpr std::size_t maxWaste(int index)
+    {
+        return index == 0 ? SLOT_BASE_SIZE - 1 : size(index) - size(index - 1) - 1;
+    }
+
+    // alignment every slot of the class is guaranteed: pools lay slots out at multiples of the
+    // slot size from page-aligned blocks, so the largest power of two dividing it, at most a page
+    static constexpr std::size_t alignment(int index)
+    {
+        std::size_t lowestBit = size(index) & (~size(index) + 1);
+        return lowestBit < PAGE_HEAP_PAGE_SIZE ? lowestBit : PAGE_HEAP_PAGE_SIZE;
+    }
+
+    // smallest class that holds size bytes at the given alignment (a power of two),
+    // -1 when there is none: size above MAX_SLOT_SIZE or alignment above a page
+    static constexpr int alignedIndex(std::size_t size, std::size_t alignment)
+    {
+        if (size > MAX_SLOT_SIZE || alignment > PAGE_HEAP_PAGE_SIZE)
+        {
+            return -1;
+        }
+        for (int i = index(size == 0 ? 1 : size); i < kNumClasses; ++i)
+        {
+            if (SizeClass::alignment(i) >= alignment)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // request size that comes back aligned for alignments up to a page: the aligned class, or size
+    // itself above MAX_SLOT_SIZE, where page heap spans are page aligned anyway
+    static constexpr std::size_t alignedSize(std::size_t size, std::size_t alignment)
+    {
+        int aligned = alignedIndex(size, alignment);
+        return aligned >= 0 ? SizeClass::size(aligned) : size;
+    }
+};
+
+static_assert(SizeClass::alignedIndex(1, PAGE_HEAP_PAGE_SIZE) >= 0, "some size class must be page aligned");
+
+namespace detail
+{
+// what newElement and friends request for a T, so alignof(T) costs no lookup at run time;
+// types aligned beyond a page use useMemory(size, alignment) instead
+template<typename T>
+inline constexpr std::size_t kElementRequest = SizeClass::alignedSize(sizeof(T), alignof(T));
+
+template<typename T>
+inline constexpr bool kPoolAligned = alignof(T) <= PAGE_HEAP_PAGE_SIZE;
+}  // namespace detail
+
+// print every size class with its worst-case internal fragmentation
+void dumpSizeClasses(std::ostream& os);
+
+// PoolConfig is how HashBucket/LockFreeHashBucket::initMemoryPool set up their pools
+struct PoolConfig
+{
+    // block size per size class in bytes, 0 picks defaultBlockSize(index)
+    std::size_t blockSize[MEMORY_POOL_NUM] = {};
+    // backing of the page heap regions blocks are carved from; the page heap is shared,
+    // so None leaves whatever mode another bucket already asked for
+    HugePageMode hugePages = HugePageMode::None;
+    // rotate the first slot of each new block through the block's slack, in BLOCK_COLOR_STEP steps,
+    // so same-index slots of different blocks do not all land in the same cache sets
+    bool colorBlocks = true;
+    // HashBucket only: each block keeps its own free list and pools allocate from the fullest
+    // block that still has room, so live slots stay packed into few pages and empty blocks show
+    bool blockLocalFreeLists = false;
+    // LockFreeHashBucket and PerCpuHashBucket: free list heads per pool, rounded down to a power
+    // of two and capped at LOCK_FREE_MAX_STRIPES; more than one spreads the CAS traffic of many
+    // threads freeing into the same class, see LockFreeMemoryPool
+    std::size_t freeListStripes = 1;
+
+    // DEFAULT_SLOTS_PER_BLOCK slots, at least 4 KB and at most MAX_DEFAULT_BLOCK_SIZE
+    static std::size_t defaultBlockSize(int index);
+};
+
+// PoolStats describes one pool. From MemoryPool/LockFreeMemoryPool::stats() allocations and frees
+// count slots the pool handed out and got back; HashBucket::getStats() replaces them with the
+// caller-level counts summed over every thread's cache, so bytesInUse is live objects only while
+// bytesOutstanding also covers slots parked in thread caches.
+struct PoolStats
+{
+    std::size_t slotSize;
+    std::size_t blockSize;
+    std::uint64_t allocations;
+    std::uint64_t frees;
+    std::uint64_t blockRefills;  // blocks taken from the page heap since init
+    std::uint64_t blocksOwned;  // blockRefills minus blocks given back by trim()
+    std::size_t bytesReserved;  // blocksOwned * blockSize
+    std::size_t bytesInUse;  // (allocations - frees) * slotSize
+    std::size_t bytesOutstanding;  // slots out of the pool's hands, in use or cached
+    std::size_t peakBytesOutstanding;  // high-water mark of bytesOutstanding, an upper bound for LockFreeMemoryPool
+};
+
+struct BucketStats
+{
+    PoolStats classes[MEMORY_POOL_NUM];
+    std::uint64_t largeAllocations;  // requests above MAX_SLOT_SIZE served by page heap spans
+    std::uint64_t largeFrees;
+    // the page heap is shared by every bucket
+    std::size_t pageHeapReservedBytes;
+    std::size_t pageHeapFreeBytes;
+    std::size_t pageHeapReleasedBytes;
+};
+
+// WarmupProfile lists how many slots of each size class HashBucket::warmUp() reserves ahead of
+// a latency-critical phase; fromStats() replays the peak a previous run reached
+struct WarmupProfile
+{
+    std::size_t slots[MEMORY_POOL_NUM] = {};
+    bool lockPages = false;  // mlock the reserved blocks, needs RLIMIT_MEMLOCK room
+
+    static WarmupProfile fromStats(const BucketStats& stats);
+};
+
+// one line per size class that saw any traffic, then the totals
+void dumpStats(std::ostream& os, const BucketStats& stats);
+// the same data as a single JSON object, for metrics exporters
+void dumpStatsJson(std::ostream& os, const BucketStats& stats);
+
+// background thread that calls HashBucket::trim() and LockFreeHashBucket::trim() every interval;
+// starting it again only changes the interval
+void startScavenger(std::chrono::milliseconds interval);
+void stopScavenger();
+
 class MemoryPool
 {
 public:
-    MemoryPool(size_t BlockSize = 4096);
+    // constexpr so a bucket's pools are constant-initialized, see PoolArray
+    constexpr MemoryPool(size_t BlockSize = 4096)
+        : BlockSize_(BlockSize), SlotSize_(0), slotAdvance_(0), firstBlock_(nullptr),
+          curSlot_(nullptr), freeList_(nullptr), endSlot_(nullptr), colorStep_(0), nextColor_(0),
+          reservedBlocks_(0), lockedBlocks_(false),
+          blockLocal_(false), current_(nullptr), localLists_{}, partialMask_(0),
+          allocations_(0), frees_(0), peakOutstanding_(0), blockRefills_(0), blocksReleased_(0)
+    {
+    }
     ~MemoryPool();
 
-    void init(size_t);
+    // blockSize 0 keeps the size given to the constructor
+    void init(size_t slotSize, size_t blockSize = 0, bool colorBlocks = true, bool blockLocal = false);
 
     void* allocate();
     void deallocate(void*);
 
+    // move up to n slots in/out of the pool under a single lock acquisition
+    std::size_t allocateBatch(std::size_t n, void** out);
+    void deallocateBatch(std::size_t n, void* const* ptrs);
+
+    std::size_t slotSize() const { return SlotSize_; }
+    std::size_t blockSize() const { return BlockSize_; }
+
+    // take both locks before fork() and drop them in parent and child afterwards
+    void lockForFork();
+    void unlockAfterFork();
+
+    // give every block whose slots are all on the free list back to the page heap,
+    // returns the number of bytes released; the current block is always kept. The free list is
+    // detached under the lock and walked outside it, so allocate/deallocate are only held up
+    // for the detach and the splice back
+    std::size_t trim();
+
+    // carve new blocks holding at least `slots` slots and fault their pages in, so that many
+    // allocations neither take a block from the page heap nor touch fresh memory; trim() keeps
+    // that many blocks from then on. lockPages also mlocks them (std::system_error if the limit
+    // is hit). Returns the number of slots added.
+    std::size_t reserve(std::size_t slots, bool lockPages = false);
+
+    PoolStats stats();
+
 private:
+    // header of a block in block-local mode; the first word is still the block list link
+    struct LocalBlock
+    {
+        Slot* next;
+        Slot* freeList;  // slots of this block freed since it was carved
+        char* carve;  // next never-used slot
+        char* end;
+        std::uint32_t freeSlots;  // freeList length plus the slots still to carve
+        std::uint32_t capacity;
+        int list;  // index into localLists_, -1 while current or full
+        LocalBlock* prevInList;
+        LocalBlock* nextInList;
+    };
+
+    // partial blocks are binned by log2 of their free slots, the last list holds empty blocks
+    static constexpr int kLocalBins = 32;
+    static constexpr int kEmptyList = kLocalBins;
+    static constexpr int kReleasing = kLocalBins + 1;  // marks a block trimLocal() is giving back
+
     void allocateNewBlock();
+    void countAllocations(std::size_t n);
     size_t padPointer(char* p, size_t align);
+    std::size_t slotsInBlock(Slot* block);
+    std::size_t headerSize() const { return blockLocal_ ? sizeof(LocalBlock) : sizeof(Slot*); }
+    void releaseBlock(Slot* block);
+    void carveRestToFreeList();
+
+    void* allocateLocal();
+    void deallocateLocal(Slot* slot);
+    void switchLocalBlock();
+    static int listFor(const LocalBlock* block);
+    void linkLocal(LocalBlock* block, int list);
+    void unlinkLocal(LocalBlock* block);
+    std::size_t trimLocal();
 
     std::size_t BlockSize_;
     std::size_t SlotSize_;
@@ -41,82 +338,493 @@ private:
     Slot* curSlot_;  // ptr to the current slot that has never been used
     Slot* freeList_;
     Slot* endSlot_;  // one-past-the-end slot marker for the current block
+    std::size_t colorStep_;  // 0 with coloring off, guarded by mutexForBlock_ like nextColor_
+    std::size_t nextColor_;
+    std::size_t reservedBlocks_;  // blocks added by reserve(), trim() keeps at least this many
+    std::atomic<bool> lockedBlocks_;  // reserve() mlocked some blocks, munlock before giving any back
+
+    // block-local mode, guarded by mutexForFreeList_
+    bool blockLocal_;
+    LocalBlock* current_;  // block allocations come from, never on a list
+    LocalBlock* localLists_[kLocalBins + 1];
+    std::uint32_t partialMask_;  // bit i set while localLists_[i] is not empty
     std::mutex mutexForFreeList_;  // mutex for free list
     std::mutex mutexForBlock_;  // mutex for block allocation
+    std::mutex mutexForTrim_;  // serializes trim(), taken before the other two
+
+    // counters, all guarded by mutexForFreeList_
+    std::uint64_t allocations_;
+    std::uint64_t frees_;
+    std::uint64_t peakOutstanding_;
+    std::uint64_t blockRefills_;
+    std::uint64_t blocksReleased_;
 };
 
 class LockFreeMemoryPool
 {
 public:
-    LockFreeMemoryPool(size_t BlockSize = 4096);
+    constexpr LockFreeMemoryPool(size_t BlockSize = 4096)
+        : BlockSize_(BlockSize), SlotSize_(0), bodyOffset_(0), slotsPerBlock_(0), colorStep_(0), colorCount_(1),
+          stripeMask_(0), firstBlock_(nullptr),
+          cursor_(0), blockRing_{}, stripes_{}, shards_{}, counters_{}
+    {
+    }
     ~LockFreeMemoryPool();
 
-    void init(size_t);
+    // stripes > 1 splits the free list into that many heads (a power of two, at most
+    // LOCK_FREE_MAX_STRIPES), each on its own cache line. A thread pushes to and pops from its
+    // own stripe, and steals from the others before carving new slots when its stripe is empty
+    void init(size_t slotSize, size_t blockSize = 0, bool colorBlocks = true, std::size_t stripes = 1);
 
     void* allocate();
     void deallocate(void*);
 
+    // the free list is detached or spliced with one CAS, fresh slots are carved with one fetch_add
+    std::size_t allocateBatch(std::size_t n, void** out);
+    void deallocateBatch(std::size_t n, void* const* ptrs);
+
+    std::size_t slotSize() const { return SlotSize_; }
+    std::size_t blockSize() const { return BlockSize_; }
+    std::size_t stripeCount() const { return stripeMask_ + 1; }
+
+    // same as MemoryPool::trim, runs concurrently with allocate/deallocate
+    std::size_t trim();
+
+    // peakBytesOutstanding is an upper bound, the sum of every counter shard's own high-water mark:
+    // exact while each thread frees what it allocated, above the true peak when slots are freed by
+    // other threads
+    PoolStats stats() const;
+
 private:
-    void allocateNewBlock();
-    size_t padPointer(char* p, size_t align);
+    struct BlockHeader
+    {
+        BlockHeader* next;  // block list link, kept as the first word like MemoryPool's blocks
+    };
+
+    // blocks of the last kBlockRing generations, so a carving thread can find the block its
+    // reserved index belongs to without ever dereferencing a block header
+    static constexpr std::size_t kBlockRing = 64;
+
+    // free list head as a tagged pointer: the low 48 bits hold the Slot*, the high 16 bits
+    // a version bumped by every successful CAS, so a head that was popped and pushed back
+    // between our load and our CAS no longer compares equal (ABA)
+    struct alignas(64) Stripe
+    {
+        std::atomic<std::uint64_t> head;
+    };
+
+    // allocation/free counts of the threads numbered i mod LOCK_FREE_COUNTER_SHARDS, on a line of
+    // their own apart from every free list head; stats() sums the shards
+    struct alignas(64) CounterShard
+    {
+        std::atomic<std::uint64_t> allocations;
+        std::atomic<std::uint64_t> frees;
+        std::atomic<std::uint64_t> peakOutstanding;  // highest allocations - frees of this shard
+    };
+
+    std::size_t allocateFromBlock(std::size_t n, void** out);  // carves 1..n slots, returns how many
+    void spliceFreeList(Slot* chain);  // prepend a null-terminated chain with one CAS
+    CounterShard& counterShard();  // the calling thread's counts
+    void countAllocations(std::size_t n);  // bumps the shard and its high-water mark
+    BlockHeader* allocateNewBlock();
+    char* blockBody(BlockHeader* block, std::uint64_t generation) const;
+    Stripe& homeStripe();  // the calling thread's stripe
     bool pushFreeList(Slot* slot);
-    Slot* popFreeList();
+    Slot* popFreeList();  // own stripe first, then the others
+    Slot* detachFreeList();  // a whole stripe's list, own stripe first
 
     std::size_t BlockSize_;
     std::size_t SlotSize_;
-    std::size_t slotAdvance_;
-    Slot* firstBlock_;
-    Slot* curSlot_;
-    std::atomic<Slot*> freeList_;
-    Slot* endSlot_;
-    std::mutex mutexForBlock_;
+    std::size_t bodyOffset_;  // blocks are page aligned, so every block has the same slot layout
+    std::size_t slotsPerBlock_;
+    // the color of a block follows from its generation, so carving never reads the block header
+    std::size_t colorStep_;
+    std::size_t colorCount_;
+    std::size_t stripeMask_;  // stripe count - 1
+    std::atomic<BlockHeader*> firstBlock_;  // head only written by the thread that installs a new block
+    // current block generation (high 32 bits) and next never-used slot index in it (low 32 bits);
+    // a fetch_add reserves a slot, the thread whose index lands on slotsPerBlock_ installs the next block
+    std::atomic<std::uint64_t> cursor_;
+    std::atomic<std::uint64_t> blockRing_[kBlockRing];  // tagged (generation, block) entries
+    Stripe stripes_[LOCK_FREE_MAX_STRIPES];  // only the first stripeMask_ + 1 are used
+    std::mutex mutexForTrim_;  // serializes trim(), never taken by allocate/deallocate
+    CounterShard shards_[LOCK_FREE_COUNTER_SHARDS];
+
+    // counters of the rare paths, on their own line
+    struct alignas(64) Counters
+    {
+        std::atomic<std::uint64_t> blockRefills;
+        std::atomic<std::uint64_t> blocksReleased;
+    };
+    Counters counters_;
+};
+
+// ThreadCache is a per-thread magazine of free slots for every size class of one bucket.
+// The fast path is a plain singly linked list pop/push with no atomics; the shared pool is
+// only touched to refill an empty list or to flush a full one, THREAD_CACHE_BATCH_BYTES at a time.
+// The object is constant-initialized and trivially destructible, so touching it costs no TLS guard;
+// it activates itself on the first slow-path call and is flushed back when the thread exits.
+// A cache claims the blocks it refills from. When another thread's list overflows, slots of
+// claimed blocks go back to the claiming cache through its lock-free remote-free queue instead of
+// the shared pool, and the owner collects the whole queue on its next refill, so producer/consumer
+// pipelines recycle memory without touching the pool lock.
+template<typename Bucket>
+class ThreadCache
+{
+public:
+    static ThreadCache& local() { return local_; }
+
+    void* allocate(int index)
+    {
+        FreeList& list = lists_[index];
+        bump(list.allocations);
+        if (Slot* slot = list.head)
+        {
+            list.head = slot->next;
+            --list.length;
+            return static_cast<void*>(slot);
+        }
+        return refill(index);
+    }
+
+    void deallocate(int index, void* p)
+    {
+        FreeList& list = lists_[index];
+        bump(list.frees);
+        if (list.length < list.maxLength)
+        {
+            Slot* slot = static_cast<Slot*>(p);
+            slot->next = list.head;
+            list.head = slot;
+            ++list.length;
+            return;
+        }
+        overflow(index, p);
+    }
+
+    // count size bytes off this thread's heap profiler countdown, true when it ran out
+    bool sampleDue(std::size_t size)
+    {
+        sampleCountdown_ -= static_cast<std::int64_t>(size);
+        return sampleCountdown_ < 0;
+    }
+
+    std::int64_t& sampleCountdown() { return sampleCountdown_; }
+
+    // serve from the magazine first and move the rest to/from the pool as one batch
+    std::size_t allocateBatch(int index, std::size_t n, void** out);
+    void deallocateBatch(int index, std::size_t n, void* const* ptrs);
+
+    // return every cached slot of this thread to the shared pools
+    void flush();
+
+    // flush and bypass the cache from now on, used when the thread is exiting
+    void retire();
+
+    // add every thread's per-class allocation/free counts, including exited threads
+    static void collectCounts(std::uint64_t* allocations, std::uint64_t* frees);
+
+    // the registry of live caches is locked across fork() with the pools
+    static void lockRegistry();
+    static void unlockRegistry();
+
+    // return slots freed towards exited threads' queues to the pools, called by trim()
+    static void drainOrphans();
+
+private:
+    struct FreeList
+    {
+        Slot* head;
+        std::uint32_t length;
+        std::uint32_t maxLength;  // 0 until activated, so the first free takes the slow path
+        std::uint32_t batchSize;
+        // caller-level counts, only written by the owning thread and read by collectCounts()
+        std::atomic<std::uint64_t> allocations;
+        std::atomic<std::uint64_t> frees;
+    };
+
+    // a plain load/add/store on the thread's own line, never a locked instruction
+    static void bump(std::atomic<std::uint64_t>& counter, std::uint64_t n = 1)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void* refill(int index);
+    void overflow(int index, void* p);
+    // remote-free queues of one cache, one MPSC stack per size class: any thread pushes whole
+    // chains with a CAS, only the owner takes the whole stack with an exchange (so no ABA).
+    // Never freed: an exited thread's queues are drained and handed to the next cache.
+    struct alignas(64) RemoteQueues
+    {
+        std::atomic<Slot*> heads[MEMORY_POOL_NUM];
+        RemoteQueues* nextFree;
+    };
+
+    void activate();
+    void flushList(int index, std::size_t count);
+    void countRetired(int index, bool allocation, std::uint64_t n = 1);
+    bool collectRemote(int index);
+    void claimBlocks(void* const* slots, std::size_t count);
+    void giveBack(int index, void* const* slots, std::size_t count);
+    static void drainQueues(RemoteQueues* queues);
+
+    FreeList lists_[MEMORY_POOL_NUM];
+    ThreadCache* prevCache_;  // registry links, set while the cache is active
+    ThreadCache* nextCache_;
+    RemoteQueues* remote_;
+    std::int64_t sampleCountdown_;  // bytes until the heap profiler looks again, see HeapProfiler.h
+    bool active_;
+    bool retired_;
+
+    static thread_local ThreadCache local_;
+};
+
+template<typename Bucket>
+thread_local ThreadCache<Bucket> ThreadCache<Bucket>::local_;
+
+// PerCpuCache keeps one free list per CPU for every size class of PerCpuHashBucket, so the number
+// of caches is bounded by the core count instead of the thread count. A thread only works on the
+// list of the CPU it runs on: when glibc registered an rseq area for the thread (x86-64) the final
+// store is part of a restartable sequence the kernel aborts on preemption, migration or signal;
+// otherwise the list is a tagged-pointer stack updated with CAS like LockFreeMemoryPool's free list.
+// The object has no constructor, so it is constant-initialized and usable from any static context;
+// until init() publishes cpuCount_ every call takes the slow path, which initializes the bucket.
+class PerCpuCache
+{
+public:
+    void init(LockFreeMemoryPool* pools);
+
+    void* allocate(int index);
+    void deallocate(int index, void* p);
+
+    // return cached slots to the pools: every CPU with the CAS fallback, only the calling
+    // thread's current CPU with rseq, since other CPUs' lists are only ever touched on their CPU
+    void flush();
+
+    bool usesRseq() const { return rseq_; }
+    int cpuCount() const { return cpuCount_.load(std::memory_order_acquire); }
+
+private:
+    struct alignas(64) CpuList  // one cache line each, CPUs never share a line
+    {
+        std::atomic<std::uint64_t> head;  // Slot*, tagged with a version in the CAS mode
+        std::atomic<std::uint32_t> length;  // approximate, only decides when to flush
+    };
+
+    void* refill(int index);
+    void overflow(int index);
+    Slot* pop(int index);
+    CpuList* push(int index, Slot* first, Slot* last);  // nullptr when the CPU has no list
+    int currentCpu() const;
+
+    CpuList& listFor(int cpu, int index)
+    {
+        return lists_[static_cast<std::size_t>(cpu) * MEMORY_POOL_NUM + index];
+    }
+
+    LockFreeMemoryPool* pools_;
+    CpuList* lists_;  // cpuCount_ * MEMORY_POOL_NUM entries carved from the page heap
+    std::uint32_t batchSize_[MEMORY_POOL_NUM];
+    std::atomic<int> cpuCount_;  // 0 until init(), stored last so a non-zero count publishes the rest
+    bool rseq_;
+};
+
+// storage for one bucket's pools: constant-initialized, so reaching a pool needs no init guard,
+// and never destroyed, like the page heap, because thread caches and frees from other static
+// destructors (or a preloaded free()) can still reach the pools during exit
+template<typename Pool>
+union PoolArray
+{
+    constexpr PoolArray() : pools{} {}
+    ~PoolArray() {}
+
+    Pool pools[MEMORY_POOL_NUM];
 };
 
 class HashBucket
 {
 public:
-    static void initMemoryPool();
-    static MemoryPool& getMemoryPool(int index);
+    // set up every pool, only the first call (or the first use) takes effect;
+    // returns false when the bucket was already initialized
+    static bool initMemoryPool(const PoolConfig& config);
+    static bool initMemoryPool();
+    static MemoryPool& getMemoryPool(int index) { return pools_.pools[index]; }
     static void ensureInitialized();
 
+    // n blocks of `size` bytes at once, for bursty callers: slots come from this thread's cache
+    // and the pool is touched once for whatever is missing (one lock or CAS per chain)
+    static std::size_t allocateBatch(size_t size, std::size_t n, void** out);
+    static void deallocateBatch(size_t size, std::size_t n, void* const* ptrs);
+
+    // flush this thread's cache, trim every pool and hand free pages back to the OS,
+    // returns the number of bytes released to the OS
+    static std::size_t trim();
+
+    // pre-fault blocks for `slots` requests of `size` bytes (see MemoryPool::reserve), or for a
+    // whole profile, before a phase that must not hit the block refill or page-fault path.
+    // Returns bytes reserved.
+    static std::size_t reserve(size_t size, std::size_t slots, bool lockPages = false);
+    static std::size_t warmUp(const WarmupProfile& profile);
+
+    // pthread_atfork handlers: every pool lock and the page heap lock are held across fork()
+    // so the child starts from consistent pools; the malloc replacement installs them
+    static void lockForFork();
+    static void unlockAfterFork();
+
+    // snapshot of every size class's counters, taken while other threads keep allocating
+    static BucketStats getStats();
+
     // this function allocates memory from memory pool or global new based on size
     // it will decide which memory pool to use based on size
     // for example, size <= 8 bytes, use memory pool 0; size <= 16 bytes, use memory pool 1; ...
-    // the reason is that each memory pool manages slots of size 8, 16, 24, ..., 512 bytes
+    // the reason is that each memory pool manages slots of one SizeClass (8, 16, ..., 128, 160, ..., 32768 bytes)
+    // no init check here: the thread cache initializes the bucket on its first slow-path call
     static void* useMemory(size_t size)
     {
-        ensureInitialized();
-
         if (size <= 0) 
         {
             return nullptr;
         }
 
-        if (size > MAX_SLOT_SIZE)  // > 512 bytes, use global new
+        ThreadCache<HashBucket>& cache = ThreadCache<HashBucket>::local();
+        void* p;
+        int index = -1;
+        if (size > MAX_SLOT_SIZE)  // > 32 KB, take whole pages from the page heap
+        {
+            largeAllocations_.fetch_add(1, std::memory_order_relaxed);
+            p = PageHeap::instance().allocateLarge(size);
+        }
+        else
         {
-            return operator new(size);
+            // 8 bytes, then index = 0; 9 bytes, then index = 1; ...; 129 bytes, index of the 160-byte class
+            index = SizeClass::index(size);
+            p = cache.allocate(index);
         }
-        
-        // 8 bytes, then index = 0; 9 bytes, then index = 1;  16 bytes, index = 1;  17 bytes, index = 2
-        return getMemoryPool((size + 7) / SLOT_BASE_SIZE - 1).allocate();
+        if (cache.sampleDue(size))
+        {
+            HeapProfiler::sampleAllocation(p, size, index, cache.sampleCountdown());
+        }
+        return p;
     }
 
     static void freeMemory(void* ptr, size_t size)
     {
-        ensureInitialized();
-
         if (!ptr)
         {
             return;
         }
+        HeapProfiler::noteFree(ptr);
 
         if (size > MAX_SLOT_SIZE)
         {
-            operator delete(ptr);
+            largeFrees_.fetch_add(1, std::memory_order_relaxed);
+            PageHeap::instance().deallocate(ptr);
+            return;
+        }
+
+        ThreadCache<HashBucket>::local().deallocate(SizeClass::index(size), ptr);
+    }
+
+    // the same for a size known at compile time, what newElement uses: no size checks and a
+    // constant class index, so a hit is a pop from this thread's list for that class
+    template<std::size_t Size>
+    static void* useMemory()
+    {
+        static_assert(Size > 0, "zero-sized requests have no size class");
+        if constexpr (Size > MAX_SLOT_SIZE)
+        {
+            return useMemory(Size);
+        }
+        else
+        {
+            constexpr int index = SizeClass::index(Size);
+            ThreadCache<HashBucket>& cache = ThreadCache<HashBucket>::local();
+            void* p = cache.allocate(index);
+            if (cache.sampleDue(Size))
+            {
+                HeapProfiler::sampleAllocation(p, Size, index, cache.sampleCountdown());
+            }
+            return p;
+        }
+    }
+
+    template<std::size_t Size>
+    static void freeMemory(void* ptr)
+    {
+        if constexpr (Size > MAX_SLOT_SIZE)
+        {
+            freeMemory(ptr, Size);
+        }
+        else
+        {
+            constexpr int index = SizeClass::index(Size);
+            if (ptr != nullptr)
+            {
+                HeapProfiler::noteFree(ptr);
+                ThreadCache<HashBucket>::local().deallocate(index, ptr);
+            }
+        }
+    }
+
+    // free without the size: the page map gives the block's slot size, hence its class;
+    // ptr must come from this bucket, anything else aborts with a message
+    static void freeMemory(void* ptr)
+    {
+        if (!ptr)
+        {
+            return;
+        }
+        HeapProfiler::noteFree(ptr);
+
+        const Span& span = PageHeap::instance().ownerOf(ptr);
+        if (span.kind == Span::Kind::Large)
+        {
+            largeFrees_.fetch_add(1, std::memory_order_relaxed);
+            PageHeap::instance().deallocate(ptr);
+            return;
+        }
+
+        ThreadCache<HashBucket>::local().deallocate(SizeClass::index(span.slotSize), ptr);
+    }
+
+    // size bytes aligned to alignment (a power of two, anything else gets nullptr): a size class
+    // whose slots all have that alignment, or a page heap span for alignments above a page.
+    // Free with the same size and alignment, or unsized
+    static void* useMemory(size_t size, size_t alignment)
+    {
+        if (size == 0 || (alignment & (alignment - 1)) != 0)
+        {
+            return nullptr;
+        }
+        if (alignment <= PAGE_HEAP_PAGE_SIZE)
+        {
+            return useMemory(SizeClass::alignedSize(size, alignment));
+        }
+        ensureInitialized();
+        largeAllocations_.fetch_add(1, std::memory_order_relaxed);
+        void* p = PageHeap::instance().allocateLarge(size, alignment);
+        ThreadCache<HashBucket>& cache = ThreadCache<HashBucket>::local();
+        if (cache.sampleDue(size))
+        {
+            HeapProfiler::sampleAllocation(p, size, -1, cache.sampleCountdown());
+        }
+        return p;
+    }
+
+    static void freeMemory(void* ptr, size_t size, size_t alignment)
+    {
+        if (alignment <= PAGE_HEAP_PAGE_SIZE)
+        {
+            freeMemory(ptr, SizeClass::alignedSize(size, alignment));
             return;
         }
+        freeMemory(ptr);
+    }
 
-        getMemoryPool((size + 7) / SLOT_BASE_SIZE - 1).deallocate(ptr);
+    // bytes usable at ptr: the slot size of its class, or the page-rounded length of a large allocation
+    static std::size_t usableSize(const void* ptr)
+    {
+        return PageHeap::instance().usableSize(ptr);
     }
 
     // TODO: 不太理解这是做啥的
@@ -125,6 +833,13 @@ public:
 
     template<typename T>
     friend void deleteElement(T* p);
+
+private:
+    static void applyConfig(const PoolConfig& config);
+
+    static PoolArray<MemoryPool> pools_;
+    static std::atomic<std::uint64_t> largeAllocations_;  // page heap spans are slow anyway
+    static std::atomic<std::uint64_t> largeFrees_;
 };
 
 // Note: 对外暴露的接口是这两个模板函数，用于分配和释放特定类型的对象
@@ -132,8 +847,17 @@ template<typename T, typename... Args>
 T* newElement(Args&&... args)
 {
     T* p = nullptr;
-    // select the right memory pool based on size of T
-    if ((p = reinterpret_cast<T*>(HashBucket::useMemory(sizeof(T)))) != nullptr)
+    // select the right memory pool based on size and alignment of T
+    void* memory = nullptr;
+    if constexpr (detail::kPoolAligned<T>)
+    {
+        memory = HashBucket::useMemory<detail::kElementRequest<T>>();
+    }
+    else
+    {
+        memory = HashBucket::useMemory(sizeof(T), alignof(T));
+    }
+    if ((p = reinterpret_cast<T*>(memory)) != nullptr)
     {
         new (p) T(std::forward<Args>(args)...);  // placement new
     }
@@ -143,14 +867,20 @@ T* newElement(Args&&... args)
 class LockFreeHashBucket
 {
 public:
-    static void initMemoryPool();
-    static LockFreeMemoryPool& getMemoryPool(int index);
+    static bool initMemoryPool(const PoolConfig& config);
+    static bool initMemoryPool();
+    static LockFreeMemoryPool& getMemoryPool(int index) { return pools_.pools[index]; }
     static void ensureInitialized();
 
+    static std::size_t allocateBatch(size_t size, std::size_t n, void** out);
+    static void deallocateBatch(size_t size, std::size_t n, void* const* ptrs);
+
+    static std::size_t trim();
+
+    static BucketStats getStats();
+
     static void* useMemory(size_t size)
     {
-        ensureInitialized();
-
         if (size <= 0)
         {
             return nullptr;
@@ -158,16 +888,15 @@ public:
 
         if (size > MAX_SLOT_SIZE)
         {
-            return operator new(size);
+            largeAllocations_.fetch_add(1, std::memory_order_relaxed);
+            return PageHeap::instance().allocateLarge(size);
         }
 
-        return getMemoryPool((size + 7) / SLOT_BASE_SIZE - 1).allocate();
+        return ThreadCache<LockFreeHashBucket>::local().allocate(SizeClass::index(size));
     }
 
     static void freeMemory(void* ptr, size_t size)
     {
-        ensureInitialized();
-
         if (!ptr)
         {
             return;
@@ -175,11 +904,92 @@ public:
 
         if (size > MAX_SLOT_SIZE)
         {
-            operator delete(ptr);
+            largeFrees_.fetch_add(1, std::memory_order_relaxed);
+            PageHeap::instance().deallocate(ptr);
             return;
         }
 
-        getMemoryPool((size + 7) / SLOT_BASE_SIZE - 1).deallocate(ptr);
+        ThreadCache<LockFreeHashBucket>::local().deallocate(SizeClass::index(size), ptr);
+    }
+
+    template<std::size_t Size>
+    static void* useMemory()
+    {
+        static_assert(Size > 0, "zero-sized requests have no size class");
+        if constexpr (Size > MAX_SLOT_SIZE)
+        {
+            return useMemory(Size);
+        }
+        else
+        {
+            constexpr int index = SizeClass::index(Size);
+            return ThreadCache<LockFreeHashBucket>::local().allocate(index);
+        }
+    }
+
+    template<std::size_t Size>
+    static void freeMemory(void* ptr)
+    {
+        if constexpr (Size > MAX_SLOT_SIZE)
+        {
+            freeMemory(ptr, Size);
+        }
+        else
+        {
+            constexpr int index = SizeClass::index(Size);
+            if (ptr != nullptr)
+            {
+                ThreadCache<LockFreeHashBucket>::local().deallocate(index, ptr);
+            }
+        }
+    }
+
+    static void freeMemory(void* ptr)
+    {
+        if (!ptr)
+        {
+            return;
+        }
+
+        const Span& span = PageHeap::instance().ownerOf(ptr);
+        if (span.kind == Span::Kind::Large)
+        {
+            largeFrees_.fetch_add(1, std::memory_order_relaxed);
+            PageHeap::instance().deallocate(ptr);
+            return;
+        }
+
+        ThreadCache<LockFreeHashBucket>::local().deallocate(SizeClass::index(span.slotSize), ptr);
+    }
+
+    static void* useMemory(size_t size, size_t alignment)
+    {
+        if (size == 0 || (alignment & (alignment - 1)) != 0)
+        {
+            return nullptr;
+        }
+        if (alignment <= PAGE_HEAP_PAGE_SIZE)
+        {
+            return useMemory(SizeClass::alignedSize(size, alignment));
+        }
+        ensureInitialized();
+        largeAllocations_.fetch_add(1, std::memory_order_relaxed);
+        return PageHeap::instance().allocateLarge(size, alignment);
+    }
+
+    static void freeMemory(void* ptr, size_t size, size_t alignment)
+    {
+        if (alignment <= PAGE_HEAP_PAGE_SIZE)
+        {
+            freeMemory(ptr, SizeClass::alignedSize(size, alignment));
+            return;
+        }
+        freeMemory(ptr);
+    }
+
+    static std::size_t usableSize(const void* ptr)
+    {
+        return PageHeap::instance().usableSize(ptr);
     }
 
     template<typename T, typename... Args>
@@ -187,6 +997,120 @@ public:
 
     template<typename T>
     friend void deleteElementLockFree(T* p);
+
+private:
+    static void applyConfig(const PoolConfig& config);
+
+    static PoolArray<LockFreeMemoryPool> pools_;
+    static std::atomic<std::uint64_t> largeAllocations_;
+    static std::atomic<std::uint64_t> largeFrees_;
+};
+
+// PerCpuHashBucket serves the same size classes as LockFreeHashBucket from its own lock-free
+// pools, but caches free slots per CPU instead of per thread, which suits programs that start
+// and stop many short-lived threads
+class PerCpuHashBucket
+{
+public:
+    static bool initMemoryPool(const PoolConfig& config);
+    static bool initMemoryPool();
+    static LockFreeMemoryPool& getMemoryPool(int index) { return pools_.pools[index]; }
+    static void ensureInitialized();
+
+    static std::size_t trim();
+
+    // true when the per-CPU lists are committed with rseq, false with the CAS fallback
+    static bool usesRseq();
+
+    // the pools are set up by the first call that finds the per-CPU lists missing, not here
+    static void* useMemory(size_t size)
+    {
+        if (size <= 0)
+        {
+            return nullptr;
+        }
+
+        if (size > MAX_SLOT_SIZE)
+        {
+            return PageHeap::instance().allocateLarge(size);
+        }
+
+        return cache_.allocate(SizeClass::index(size));
+    }
+
+    static void freeMemory(void* ptr, size_t size)
+    {
+        if (!ptr)
+        {
+            return;
+        }
+
+        if (size > MAX_SLOT_SIZE)
+        {
+            PageHeap::instance().deallocate(ptr);
+            return;
+        }
+
+        cache_.deallocate(SizeClass::index(size), ptr);
+    }
+
+    static void freeMemory(void* ptr)
+    {
+        if (!ptr)
+        {
+            return;
+        }
+
+        const Span& span = PageHeap::instance().ownerOf(ptr);
+        if (span.kind == Span::Kind::Large)
+        {
+            PageHeap::instance().deallocate(ptr);
+            return;
+        }
+
+        cache_.deallocate(SizeClass::index(span.slotSize), ptr);
+    }
+
+    static void* useMemory(size_t size, size_t alignment)
+    {
+        if (size == 0 || (alignment & (alignment - 1)) != 0)
+        {
+            return nullptr;
+        }
+        if (alignment <= PAGE_HEAP_PAGE_SIZE)
+        {
+            return useMemory(SizeClass::alignedSize(size, alignment));
+        }
+        ensureInitialized();
+        return PageHeap::instance().allocateLarge(size, alignment);
+    }
+
+    static void freeMemory(void* ptr, size_t size, size_t alignment)
+    {
+        if (alignment <= PAGE_HEAP_PAGE_SIZE)
+        {
+            freeMemory(ptr, SizeClass::alignedSize(size, alignment));
+            return;
+        }
+        freeMemory(ptr);
+    }
+
+    static std::size_t usableSize(const void* ptr)
+    {
+        return PageHeap::instance().usableSize(ptr);
+    }
+
+    template<typename T, typename... Args>
+    friend T* newElementPerCpu(Args&&... args);
+
+    template<typename T>
+    friend void deleteElementPerCpu(T* p);
+
+private:
+    static void applyConfig(const PoolConfig& config);
+
+    static PoolArray<LockFreeMemoryPool> pools_;
+    static PerCpuCache cache_;
 };
 
 template<typename T>
@@ -194,8 +1118,72 @@ void deleteElement(T* p)
 {
     if (p != nullptr)
     {
-        p->~T();  // call destructor
-        HashBucket::freeMemory(reinterpret_cast<void*>(p), sizeof(T));
+        if constexpr (std::has_virtual_destructor<T>::value)
+        {
+            // p may point into a larger derived object, free the whole object by address
+            void* object = dynamic_cast<void*>(p);
+            p->~T();
+            HashBucket::freeMemory(object);
+        }
+        else
+        {
+            p->~T();  // call destructor
+            if constexpr (detail::kPoolAligned<T>)
+            {
+                HashBucket::freeMemory<detail::kElementRequest<T>>(reinterpret_cast<void*>(p));
+            }
+            else
+            {
+                HashBucket::freeMemory(reinterpret_cast<void*>(p));
+            }
+        }
+    }
+}
+
+// construct n objects from the same arguments, returns n; on a throwing constructor every
+// object built so far is destroyed and all n blocks are given back before rethrowing
+template<typename T, typename... Args>
+std::size_t newElements(std::size_t n, T** out, const Args&... args)
+{
+    static_assert(detail::kPoolAligned<T>, "batches come from size classes, aligned to a page at most");
+    std::size_t count = HashBucket::allocateBatch(detail::kElementRequest<T>, n, reinterpret_cast<void**>(out));
+    std::size_t built = 0;
+    try
+    {
+        for (; built < count; ++built)
+        {
+            new (out[built]) T(args...);
+        }
+    }
+    catch (...)
+    {
+        for (std::size_t i = 0; i < built; ++i)
+        {
+            out[i]->~T();
+        }
+        HashBucket::deallocateBatch(detail::kElementRequest<T>, count, reinterpret_cast<void* const*>(out));
+        throw;
+    }
+    return count;
+}
+
+template<typename T>
+void deleteElements(std::size_t n, T* const* ptrs)
+{
+    if constexpr (std::has_virtual_destructor<T>::value)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            deleteElement(ptrs[i]);
+        }
+    }
+    else
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            ptrs[i]->~T();
+        }
+        HashBucket::deallocateBatch(detail::kElementRequest<T>, n, reinterpret_cast<void* const*>(ptrs));
     }
 }
 
@@ -203,7 +1191,16 @@ template<typename T, typename... Args>
 T* newElementLockFree(Args&&... args)
 {
     T* p = nullptr;
-    if ((p = reinterpret_cast<T*>(LockFreeHashBucket::useMemory(sizeof(T)))) != nullptr)
+    void* memory = nullptr;
+    if constexpr (detail::kPoolAligned<T>)
+    {
+        memory = LockFreeHashBucket::useMemory<detail::kElementRequest<T>>();
+    }
+    else
+    {
+        memory = LockFreeHashBucket::useMemory(sizeof(T), alignof(T));
+    }
+    if ((p = reinterpret_cast<T*>(memory)) != nullptr)
     {
         new (p) T(std::forward<Args>(args)...);
     }
@@ -215,8 +1212,110 @@ void deleteElementLockFree(T* p)
 {
     if (p != nullptr)
     {
-        p->~T();
-        LockFreeHashBucket::freeMemory(reinterpret_cast<void*>(p), sizeof(T));
+        if constexpr (std::has_virtual_destructor<T>::value)
+        {
+            // p may point into a larger derived object, free the whole object by address
+            void* object = dynamic_cast<void*>(p);
+            p->~T();
+            LockFreeHashBucket::freeMemory(object);
+        }
+        else
+        {
+            p->~T();
+            if constexpr (detail::kPoolAligned<T>)
+            {
+                LockFreeHashBucket::freeMemory<detail::kElementRequest<T>>(reinterpret_cast<void*>(p));
+            }
+            else
+            {
+                LockFreeHashBucket::freeMemory(reinterpret_cast<void*>(p));
+            }
+        }
+    }
+}
+
+template<typename T, typename... Args>
+std::size_t newElementsLockFree(std::size_t n, T** out, const Args&... args)
+{
+    static_assert(detail::kPoolAligned<T>, "batches come from size classes, aligned to a page at most");
+    std::size_t count = LockFreeHashBucket::allocateBatch(detail::kElementRequest<T>, n, reinterpret_cast<void**>(out));
+    std::size_t built = 0;
+    try
+    {
+        for (; built < count; ++built)
+        {
+            new (out[built]) T(args...);
+        }
+    }
+    catch (...)
+    {
+        for (std::size_t i = 0; i < built; ++i)
+        {
+            out[i]->~T();
+        }
+        LockFreeHashBucket::deallocateBatch(detail::kElementRequest<T>, count, reinterpret_cast<void* const*>(out));
+        throw;
+    }
+    return count;
+}
+
+template<typename T>
+void deleteElementsLockFree(std::size_t n, T* const* ptrs)
+{
+    if constexpr (std::has_virtual_destructor<T>::value)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            deleteElementLockFree(ptrs[i]);
+        }
+    }
+    else
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            ptrs[i]->~T();
+        }
+        LockFreeHashBucket::deallocateBatch(detail::kElementRequest<T>, n, reinterpret_cast<void* const*>(ptrs));
+    }
+}
+
+template<typename T, typename... Args>
+T* newElementPerCpu(Args&&... args)
+{
+    T* p = nullptr;
+    void* memory = detail::kPoolAligned<T> ? PerCpuHashBucket::useMemory(detail::kElementRequest<T>)
+                                           : PerCpuHashBucket::useMemory(sizeof(T), alignof(T));
+    if ((p = reinterpret_cast<T*>(memory)) != nullptr)
+    {
+        new (p) T(std::forward<Args>(args)...);
+    }
+    return p;
+}
+
+template<typename T>
+void deleteElementPerCpu(T* p)
+{
+    if (p != nullptr)
+    {
+        if constexpr (std::has_virtual_destructor<T>::value)
+        {
+            // p may point into a larger derived object, free the whole object by address
+            void* object = dynamic_cast<void*>(p);
+            p->~T();
+            PerCpuHashBucket::freeMemory(object);
+        }
+        else
+        {
+            p->~T();
+            if constexpr (detail::kPoolAligned<T>)
+            {
+                PerCpuHashBucket::freeMemory(reinterpret_cast<void*>(p), detail::kElementRequest<T>);
+            }
+            else
+            {
+                PerCpuHashBucket::freeMemory(reinterpret_cast<void*>(p));
+            }
+        }
     }
 }
 
@@ -0,0 +1,186 @@
+#pragma once
+
+#include "MemoryPool.h"
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace memorypool
+{
+
+namespace detail
+{
+template<typename T, typename = void>
+struct HasReset : std::false_type
+{
+};
+
+template<typename T>
+struct HasReset<T, std::void_t<decltype(std::declval<T&>().reset())>> : std::true_type
+{
+};
+}  // namespace detail
+
+// ObjectPool keeps released objects constructed and hands them out again, for types that are
+// expensive to build (own a buffer, a reserved vector, a registered handle). A released object
+// has its reset() member called, if it has one, and goes on a free list of live objects; acquire()
+// pops that list and only constructs a new object in a raw slot from Bucket when it is empty.
+// Up to maxIdle objects are kept, beyond that released objects are destroyed and their slot freed.
+// A reset() that throws is not fatal: release() swallows the exception and destroys the object
+// instead of recycling it, so a handle's deleter never terminates the program.
+//
+// A pool is not thread-safe: keep one per thread or guard it. Every object must be released (or
+// its handle dropped) before the pool is destroyed.
+template<typename T, typename Bucket = HashBucket>
+class ObjectPool
+{
+public:
+    // unique_ptr deleter that gives the object back to its pool
+    class Deleter
+    {
+    public:
+        Deleter() noexcept = default;
+        explicit Deleter(ObjectPool* pool) noexcept : pool_(pool) {}
+
+        void operator()(T* object) const noexcept { pool_->release(object); }
+
+    private:
+        ObjectPool* pool_ = nullptr;
+    };
+
+    using Handle = std::unique_ptr<T, Deleter>;
+
+    explicit ObjectPool(std::size_t maxIdle = 1024) : maxIdle_(maxIdle) {}
+
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    ~ObjectPool() { clear(); }
+
+    // an idle object as it was left by reset(), or a new one built from args when none is idle;
+    // args are not applied to a recycled object
+    template<typename... Args>
+    T* acquire(Args&&... args)
+    {
+        if (idle_ != nullptr)
+        {
+            Node* node = idle_;
+            idle_ = node->next;
+            --idleCount_;
+            return node->object();
+        }
+        return construct(std::forward<Args>(args)...);
+    }
+
+    template<typename... Args>
+    Handle make(Args&&... args)
+    {
+        return Handle(acquire(std::forward<Args>(args)...), Deleter(this));
+    }
+
+    void release(T* object) noexcept
+    {
+        if (object == nullptr)
+        {
+            return;
+        }
+        Node* node = Node::of(object);
+        if (idleCount_ >= maxIdle_)
+        {
+            destroy(node);
+            return;
+        }
+        if constexpr (detail::HasReset<T>::value)
+        {
+            try
+            {
+                object->reset();
+            }
+            catch (...)
+            {
+                destroy(node);  // left in an unknown state, not worth handing out again
+                return;
+            }
+        }
+        node->next = idle_;
+        idle_ = node;
+        ++idleCount_;
+    }
+
+    // construct objects up front so the first count acquires are pops; stops at maxIdle
+    template<typename... Args>
+    void reserve(std::size_t count, const Args&... args)
+    {
+        while (idleCount_ < count && idleCount_ < maxIdle_)
+        {
+            Node* node = Node::of(construct(args...));
+            node->next = idle_;
+            idle_ = node;
+            ++idleCount_;
+        }
+    }
+
+    // destroy every idle object and give its slot back to the bucket
+    void clear() noexcept
+    {
+        while (idle_ != nullptr)
+        {
+            Node* node = idle_;
+            idle_ = node->next;
+            destroy(node);
+        }
+        idleCount_ = 0;
+    }
+
+    std::size_t idleCount() const noexcept { return idleCount_; }
+    std::size_t maxIdle() const noexcept { return maxIdle_; }
+
+private:
+    // the object sits at the start of its slot, the free list link after it
+    struct Node
+    {
+        alignas(T) unsigned char storage[sizeof(T)];
+        Node* next;
+
+        T* object() noexcept { return std::launder(reinterpret_cast<T*>(storage)); }
+        static Node* of(T* object) noexcept { return reinterpret_cast<Node*>(object); }
+    };
+
+    template<typename... Args>
+    T* construct(Args&&... args)
+    {
+        void* memory = Bucket::useMemory(sizeof(Node), alignof(Node));
+        if (memory == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        Node* node = static_cast<Node*>(memory);
+        try
+        {
+            return new (node->storage) T(std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            Bucket::freeMemory(memory, sizeof(Node), alignof(Node));
+            throw;
+        }
+    }
+
+    static void destroy(Node* node) noexcept
+    {
+        node->object()->~T();
+        Bucket::freeMemory(static_cast<void*>(node), sizeof(Node), alignof(Node));
+    }
+
+    Node* idle_ = nullptr;
+    std::size_t idleCount_ = 0;
+    std::size_t maxIdle_;
+};
+
+template<typename T>
+using LockFreeObjectPool = ObjectPool<T, LockFreeHashBucket>;
+
+}  // namespace memorypool
@@ -0,0 +1,572 @@
+#include "PageHeap.h"
+
+#include <sys/mman.h>
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace memorypool
+{
+namespace
+{
+constexpr std::size_t kSpanChunkSize = 64 * 1024;  // Span records are carved from chunks of this size
+
+void* mapMemory(std::size_t bytes)
+{
+    void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? nullptr : p;
+}
+
+std::uintptr_t pageOf(const void* p)
+{
+    return reinterpret_cast<std::uintptr_t>(p) >> PAGE_HEAP_PAGE_SHIFT;
+}
+
+// pages for a request of `bytes`, std::bad_alloc when the page arithmetic would wrap
+std::size_t pagesFor(std::size_t bytes)
+{
+    if (bytes > SIZE_MAX - PAGE_HEAP_PAGE_SIZE)
+    {
+        throw std::bad_alloc();
+    }
+    return (bytes + PAGE_HEAP_PAGE_SIZE - 1) >> PAGE_HEAP_PAGE_SHIFT;
+}
+}  // namespace
+
+PageHeap& PageHeap::instance()
+{
+    // constructed in static storage and never destroyed: blocks handed out to pools
+    // (and large allocations) may still be freed by other static destructors
+    alignas(PageHeap) static unsigned char storage[sizeof(PageHeap)];
+    static PageHeap* heap = new (storage) PageHeap();
+    return *heap;
+}
+
+PageHeap::PageHeap()
+    : root_(nullptr), spanFreeList_(nullptr), spanArena_(nullptr), spanArenaLeft_(0),
+      hugePageMode_(HugePageMode::None), reservedBytes_(0), hugePageBytes_(0), freePages_(0), releasedPages_(0)
+{
+    // the root is only touched where addresses are in use, so mapping it costs no RSS up front
+    root_ = static_cast<std::atomic<Leaf*>*>(mapMemory(kRootLength * sizeof(std::atomic<Leaf*>)));
+    if (root_ == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+
+    for (Span& list : freeLists_)
+    {
+        list.prev = &list;
+        list.next = &list;
+    }
+    largeFreeList_.prev = &largeFreeList_;
+    largeFreeList_.next = &largeFreeList_;
+}
+
+void* PageHeap::allocatePages(std::size_t pages, std::size_t slotSize)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Span* span = allocateSpan(pages, Span::Kind::Block);
+    span->slotSize = static_cast<std::uint32_t>(slotSize);
+    span->owner.store(nullptr, std::memory_order_relaxed);  // a recycled span may still name its old owner
+    return span->start();
+}
+
+void* PageHeap::allocateLarge(std::size_t bytes)
+{
+    std::size_t pages = pagesFor(bytes);
+    std::lock_guard<std::mutex> lock(mutex_);
+    return allocateSpan(pages, Span::Kind::Large)->start();
+}
+
+void* PageHeap::allocateLarge(std::size_t bytes, std::size_t alignment)
+{
+    std::size_t alignPages = alignment >> PAGE_HEAP_PAGE_SHIFT;
+    if (alignPages <= 1)
+    {
+        return allocateLarge(bytes);
+    }
+
+    std::size_t pages = pagesFor(bytes);
+    if (pages == 0)
+    {
+        pages = 1;
+    }
+    if (pages > SIZE_MAX - (alignPages - 1))
+    {
+        throw std::bad_alloc();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // over-allocate by alignment - 1 pages, then hand the unaligned head and the tail back
+    Span* span = allocateSpan(pages + alignPages - 1, Span::Kind::Large);
+    std::uintptr_t alignedPage = (span->startPage + alignPages - 1) & ~static_cast<std::uintptr_t>(alignPages - 1);
+    if (alignedPage != span->startPage)
+    {
+        releaseSpan(splitOff(span, span->startPage, alignedPage - span->startPage));
+    }
+    if (span->pageCount > pages)
+    {
+        releaseSpan(splitOff(span, span->startPage + pages, span->pageCount - pages));
+    }
+    return span->start();
+}
+
+void PageHeap::deallocate(void* p)
+{
+    if (p == nullptr)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Span* span = lookup(pageOf(p));
+    assert(span != nullptr && span->start() == p && span->kind != Span::Kind::Free);
+    releaseSpan(span);
+}
+
+Span* PageHeap::spanOf(const void* p) const
+{
+    return lookup(pageOf(p));
+}
+
+const Span& PageHeap::ownerOf(const void* p) const
+{
+    const Span* span = lookup(pageOf(p));
+    if (span == nullptr || span->kind == Span::Kind::Free ||
+        (span->kind == Span::Kind::Large && span->start() != p))
+    {
+        std::fprintf(stderr, "memorypool: free of %p, which was not allocated by this heap\n", p);
+        std::abort();
+    }
+    return *span;
+}
+
+std::size_t PageHeap::usableSize(const void* p) const
+{
+    Span* span = spanOf(p);
+    if (span == nullptr)
+    {
+        return 0;
+    }
+    if (span->kind == Span::Kind::Block)
+    {
+        return span->slotSize;
+    }
+    if (span->kind == Span::Kind::Large)
+    {
+        return span->pageCount << PAGE_HEAP_PAGE_SHIFT;
+    }
+    return 0;
+}
+
+std::size_t PageHeap::releaseFreeMemory()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::size_t releasedPages = 0;
+    auto releaseList = [&](Span* list) {
+        for (Span* span = list->next; span != list; span = span->next)
+        {
+            std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(span->start());
+            std::size_t bytes = span->pageCount << PAGE_HEAP_PAGE_SHIFT;
+            if (span->hugeTlb && (begin % PAGE_HEAP_HUGE_PAGE_SIZE != 0 || bytes % PAGE_HEAP_HUGE_PAGE_SIZE != 0))
+            {
+                continue;  // hugetlbfs pages can only be dropped whole
+            }
+            if (!span->released)
+            {
+                ::madvise(span->start(), bytes, MADV_DONTNEED);
+                span->released = true;
+                releasedPages += span->pageCount;
+            }
+        }
+    };
+    for (Span& list : freeLists_)
+    {
+        releaseList(&list);
+    }
+    releaseList(&largeFreeList_);
+
+    releasedPages_ += releasedPages;
+    return releasedPages << PAGE_HEAP_PAGE_SHIFT;
+}
+
+std::size_t PageHeap::releasedBytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return releasedPages_ << PAGE_HEAP_PAGE_SHIFT;
+}
+
+void PageHeap::setHugePageMode(HugePageMode mode)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    hugePageMode_ = mode;
+}
+
+void PageHeap::lockForFork()
+{
+    mutex_.lock();
+}
+
+void PageHeap::unlockAfterFork()
+{
+    mutex_.unlock();
+}
+
+std::size_t PageHeap::reservedBytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return reservedBytes_;
+}
+
+std::size_t PageHeap::hugePageBytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hugePageBytes_;
+}
+
+std::size_t PageHeap::freeBytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return freePages_ << PAGE_HEAP_PAGE_SHIFT;
+}
+
+Span* PageHeap::allocateSpan(std::size_t pages, Span::Kind kind)
+{
+    if (pages == 0)
+    {
+        pages = 1;
+    }
+    if (pages > (SIZE_MAX >> PAGE_HEAP_PAGE_SHIFT) - PAGE_HEAP_HUGE_PAGE_SIZE / PAGE_HEAP_PAGE_SIZE)
+    {
+        throw std::bad_alloc();  // growHeap could not express the region size in bytes
+    }
+
+    Span* span = searchFreeLists(pages);
+    if (span == nullptr)
+    {
+        growHeap(pages);
+        span = searchFreeLists(pages);
+        if (span == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+    }
+
+    span = carve(span, pages);
+    span->kind = kind;
+    if (kind == Span::Kind::Block)
+    {
+        mapAllPages(span);
+    }
+    return span;
+}
+
+Span* PageHeap::searchFreeLists(std::size_t pages)
+{
+    // exact length first, then the next longer cached length
+    for (std::size_t n = pages; n <= PAGE_HEAP_MAX_CACHED_PAGES; ++n)
+    {
+        Span* list = &freeLists_[n];
+        if (list->next != list)
+        {
+            return list->next;
+        }
+    }
+
+    // best fit among the long spans, lowest address on ties to keep the heap compact
+    Span* best = nullptr;
+    for (Span* span = largeFreeList_.next; span != &largeFreeList_; span = span->next)
+    {
+        if (span->pageCount >= pages &&
+            (best == nullptr || span->pageCount < best->pageCount ||
+             (span->pageCount == best->pageCount && span->startPage < best->startPage)))
+        {
+            best = span;
+        }
+    }
+    return best;
+}
+
+Span* PageHeap::carve(Span* span, std::size_t pages)
+{
+    removeFree(span);
+    if (span->pageCount > pages)
+    {
+        // keep the head, the tail goes back to the free lists
+        Span* rest = newSpan(span->startPage + pages, span->pageCount - pages);
+        rest->kind = Span::Kind::Free;
+        rest->hugeTlb = span->hugeTlb;
+        rest->released = span->released;
+        mapEnds(rest);
+        insertFree(rest);
+        span->pageCount = pages;
+    }
+    span->released = false;  // released pages fault back in as zero pages on first touch
+    mapEnds(span);
+    return span;
+}
+
+// cut [startPage, startPage + pageCount) off the head or the tail of an allocated span
+Span* PageHeap::splitOff(Span* span, std::uintptr_t startPage, std::size_t pageCount)
+{
+    Span* piece = newSpan(startPage, pageCount);
+    piece->kind = span->kind;
+    piece->hugeTlb = span->hugeTlb;
+    if (startPage == span->startPage)
+    {
+        span->startPage += pageCount;
+    }
+    span->pageCount -= pageCount;
+    mapEnds(span);  // before the piece is released so its coalescing sees an allocated neighbour
+    mapEnds(piece);
+    return piece;
+}
+
+void PageHeap::releaseSpan(Span* span)
+{
+    // a free span only maps its ends, so lookups of the old interior of a block find nothing
+    if (span->kind == Span::Kind::Block)
+    {
+        for (std::size_t i = 1; i + 1 < span->pageCount; ++i)
+        {
+            clearMapping(span->startPage + i);
+        }
+    }
+    span->kind = Span::Kind::Free;
+
+    // coalesce with the free neighbours on both sides,
+    // the merged span counts as released only if every part was
+    Span* left = lookup(span->startPage - 1);
+    if (left != nullptr && left->kind == Span::Kind::Free && left->hugeTlb == span->hugeTlb &&
+        left->startPage + left->pageCount == span->startPage)
+    {
+        removeFree(left);
+        // the pages where the two spans meet become interior pages of the merged span
+        clearMapping(left->startPage + left->pageCount - 1);
+        clearMapping(span->startPage);
+        span->released = span->released && left->released;
+        span->startPage = left->startPage;
+        span->pageCount += left->pageCount;
+        deleteSpan(left);
+    }
+
+    Span* right = lookup(span->startPage + span->pageCount);
+    if (right != nullptr && right->kind == Span::Kind::Free && right->hugeTlb == span->hugeTlb &&
+        right->startPage == span->startPage + span->pageCount)
+    {
+        removeFree(right);
+        clearMapping(span->startPage + span->pageCount - 1);
+        clearMapping(right->startPage);
+        span->released = span->released && right->released;
+        span->pageCount += right->pageCount;
+        deleteSpan(right);
+    }
+
+    mapEnds(span);
+    insertFree(span);
+}
+
+void PageHeap::growHeap(std::size_t pages)
+{
+    std::size_t bytes = pages << PAGE_HEAP_PAGE_SHIFT;
+    if (bytes < PAGE_HEAP_REGION_SIZE)
+    {
+        bytes = PAGE_HEAP_REGION_SIZE;
+    }
+    if (hugePageMode_ != HugePageMode::None)
+    {
+        bytes = (bytes + PAGE_HEAP_HUGE_PAGE_SIZE - 1) / PAGE_HEAP_HUGE_PAGE_SIZE * PAGE_HEAP_HUGE_PAGE_SIZE;
+    }
+
+    bool hugeTlb = false;
+    void* region = mapRegion(bytes, hugeTlb);
+    if (region == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    reservedBytes_ += bytes;
+
+    Span* span = newSpan(pageOf(region), bytes >> PAGE_HEAP_PAGE_SHIFT);
+    span->hugeTlb = hugeTlb;
+    span->released = true;  // fresh mappings hold no resident pages yet
+    releaseSpan(span);  // regions that happen to be adjacent merge into one span
+}
+
+void* PageHeap::mapRegion(std::size_t bytes, bool& hugeTlb)
+{
+    hugeTlb = false;
+    if (hugePageMode_ == HugePageMode::None)
+    {
+        return mapMemory(bytes);
+    }
+
+    if (hugePageMode_ == HugePageMode::Explicit)
+    {
+        void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+        {
+            hugeTlb = true;
+            hugePageBytes_ += bytes;
+            return p;
+        }
+        // no reserved hugetlbfs pages, fall back to transparent huge pages
+    }
+
+    // over-map by one huge page and trim both ends so the region is 2 MB aligned
+    char* raw = static_cast<char*>(mapMemory(bytes + PAGE_HEAP_HUGE_PAGE_SIZE));
+    if (raw == nullptr)
+    {
+        return nullptr;
+    }
+    std::uintptr_t rawAddr = reinterpret_cast<std::uintptr_t>(raw);
+    std::uintptr_t alignedAddr = (rawAddr + PAGE_HEAP_HUGE_PAGE_SIZE - 1) / PAGE_HEAP_HUGE_PAGE_SIZE * PAGE_HEAP_HUGE_PAGE_SIZE;
+    char* aligned = reinterpret_cast<char*>(alignedAddr);
+    std::size_t head = alignedAddr - rawAddr;
+    std::size_t tail = PAGE_HEAP_HUGE_PAGE_SIZE - head;
+    if (head > 0)
+    {
+        ::munmap(raw, head);
+    }
+    if (tail > 0)
+    {
+        ::munmap(aligned + bytes, tail);
+    }
+
+    // fails when THP is disabled, the region then simply keeps 4 KB pages
+    if (::madvise(aligned, bytes, MADV_HUGEPAGE) == 0)
+    {
+        hugePageBytes_ += bytes;
+    }
+    return aligned;
+}
+
+Span* PageHeap::freeListFor(std::size_t pages)
+{
+    return pages <= PAGE_HEAP_MAX_CACHED_PAGES ? &freeLists_[pages] : &largeFreeList_;
+}
+
+void PageHeap::insertFree(Span* span)
+{
+    Span* list = freeListFor(span->pageCount);
+    span->prev = list;
+    span->next = list->next;
+    list->next->prev = span;
+    list->next = span;
+    freePages_ += span->pageCount;
+    if (span->released)
+    {
+        releasedPages_ += span->pageCount;
+    }
+}
+
+void PageHeap::removeFree(Span* span)
+{
+    span->prev->next = span->next;
+    span->next->prev = span->prev;
+    span->prev = nullptr;
+    span->next = nullptr;
+    freePages_ -= span->pageCount;
+    if (span->released)
+    {
+        releasedPages_ -= span->pageCount;
+    }
+}
+
+Span* PageHeap::newSpan(std::uintptr_t startPage, std::size_t pageCount)
+{
+    Span* span = spanFreeList_;
+    if (span != nullptr)
+    {
+        spanFreeList_ = span->next;
+    }
+    else
+    {
+        // Span records come from mmap directly so the heap never calls back into operator new
+        if (spanArenaLeft_ < sizeof(Span))
+        {
+            spanArena_ = static_cast<char*>(mapMemory(kSpanChunkSize));
+            if (spanArena_ == nullptr)
+            {
+                throw std::bad_alloc();
+            }
+            spanArenaLeft_ = kSpanChunkSize;
+        }
+        span = reinterpret_cast<Span*>(spanArena_);
+        spanArena_ += sizeof(Span);
+        spanArenaLeft_ -= sizeof(Span);
+    }
+
+    new (span) Span{startPage, pageCount, nullptr, nullptr, Span::Kind::Free, false, false, 0, 0, nullptr};
+    return span;
+}
+
+void PageHeap::deleteSpan(Span* span)
+{
+    span->next = spanFreeList_;
+    spanFreeList_ = span;
+}
+
+Span* PageHeap::lookup(std::uintptr_t page) const
+{
+    std::uintptr_t rootIndex = page >> kLeafBits;
+    if (rootIndex >= kRootLength)
+    {
+        return nullptr;
+    }
+    Leaf* leaf = root_[rootIndex].load(std::memory_order_acquire);
+    return leaf != nullptr ? leaf->spans[page & (kLeafLength - 1)] : nullptr;
+}
+
+void PageHeap::setMapping(std::uintptr_t page, Span* span)
+{
+    std::uintptr_t rootIndex = page >> kLeafBits;
+    if (rootIndex >= kRootLength)
+    {
+        throw std::bad_alloc();  // outside the 48-bit address space the page map covers
+    }
+
+    Leaf* leaf = root_[rootIndex].load(std::memory_order_relaxed);
+    if (leaf == nullptr)
+    {
+        leaf = static_cast<Leaf*>(mapMemory(sizeof(Leaf)));
+        if (leaf == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        root_[rootIndex].store(leaf, std::memory_order_release);
+    }
+    leaf->spans[page & (kLeafLength - 1)] = span;
+}
+
+void PageHeap::clearMapping(std::uintptr_t page)
+{
+    std::uintptr_t rootIndex = page >> kLeafBits;
+    Leaf* leaf = rootIndex < kRootLength ? root_[rootIndex].load(std::memory_order_relaxed) : nullptr;
+    if (leaf != nullptr)
+    {
+        leaf->spans[page & (kLeafLength - 1)] = nullptr;
+    }
+}
+
+void PageHeap::mapEnds(Span* span)
+{
+    setMapping(span->startPage, span);
+    if (span->pageCount > 1)
+    {
+        setMapping(span->startPage + span->pageCount - 1, span);
+    }
+}
+
+void PageHeap::mapAllPages(Span* span)
+{
+    for (std::size_t i = 0; i < span->pageCount; ++i)
+    {
+        setMapping(span->startPage + i, span);
+    }
+}
+
+}  // namespace memorypool
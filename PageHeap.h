@@ -0,0 +1,159 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace memorypool
+{
+
+#define PAGE_HEAP_PAGE_SHIFT 12
+#define PAGE_HEAP_PAGE_SIZE (std::size_t(1) << PAGE_HEAP_PAGE_SHIFT)
+#define PAGE_HEAP_REGION_SIZE (std::size_t(16) << 20)  // minimum size of one mmap'd region
+#define PAGE_HEAP_MAX_CACHED_PAGES 128  // spans up to this length are cached in exact-length lists
+#define PAGE_HEAP_HUGE_PAGE_SIZE (std::size_t(2) << 20)
+
+// how new regions are backed, each mode falls back to the next one when the kernel refuses it
+enum class HugePageMode
+{
+    None,  // plain 4 KB pages
+    Transparent,  // 2 MB aligned regions advised with MADV_HUGEPAGE
+    Explicit,  // MAP_HUGETLB from the reserved hugetlbfs pool, then Transparent
+};
+
+// hierarchy: PageHeap -> many Region (mmap) -> many Span -> many Page
+// MemoryPool blocks and every allocation above MAX_SLOT_SIZE are spans of this heap
+
+// Span is a run of contiguous pages, either handed out or sitting in a free list
+struct Span
+{
+    enum class Kind : std::uint8_t
+    {
+        Free,
+        Block,  // backs a pool block, every page is in the page map
+        Large,  // one big allocation, only the first and last page are in the page map
+    };
+
+    std::uintptr_t startPage;
+    std::size_t pageCount;
+    Span* prev;  // free list links
+    Span* next;
+    Kind kind;
+    bool hugeTlb;  // lives in a MAP_HUGETLB region, only whole huge pages can be released
+    bool released;  // free span whose pages were handed back to the OS with madvise
+    std::uint32_t slotSize;  // Block spans: slot size of the owning pool, so a pointer alone finds its class
+    std::size_t freeSlots;  // scratch counter for the owning pool's trim()
+    // Block spans: remote-free queue of the thread cache that claimed the block, null while unclaimed
+    std::atomic<void*> owner;
+
+    void* start() const
+    {
+        return reinterpret_cast<void*>(startPage << PAGE_HEAP_PAGE_SHIFT);
+    }
+};
+
+class PageHeap
+{
+public:
+    // process-wide heap, never destroyed so late frees during exit stay valid
+    static PageHeap& instance();
+
+    // a span of `pages` pages for a pool block carved into `slotSize` slots,
+    // every page maps back to the span
+    void* allocatePages(std::size_t pages, std::size_t slotSize);
+
+    // a span large enough for `bytes`, used for requests above MAX_SLOT_SIZE;
+    // throws std::bad_alloc when no span that long can exist
+    void* allocateLarge(std::size_t bytes);
+
+    // same, starting at a multiple of `alignment` (a power of two), for aligned requests
+    // that no size class can serve
+    void* allocateLarge(std::size_t bytes, std::size_t alignment);
+
+    // return a span obtained from allocatePages/allocateLarge
+    void deallocate(void* p);
+
+    // span containing p for block spans, span starting at p for large spans;
+    // null for interior pages of large and free spans and for memory the heap does not know
+    Span* spanOf(const void* p) const;
+
+    // span p was handed out from: the block span containing it or the large span starting at it.
+    // Anything else (a foreign pointer, a freed span, the inside of a large allocation) is a
+    // fatal error: reported on stderr, then abort()
+    const Span& ownerOf(const void* p) const;
+
+    // slot size for a pointer into a pool block, span length for the start of a large
+    // allocation, 0 for memory the heap does not know
+    std::size_t usableSize(const void* p) const;
+
+    // madvise(MADV_DONTNEED) every free span that still holds resident pages,
+    // returns the number of bytes handed back to the OS
+    std::size_t releaseFreeMemory();
+
+    // applies to regions mapped from now on
+    void setHugePageMode(HugePageMode mode);
+
+    // held across fork() so the child never inherits the heap mid-update
+    void lockForFork();
+    void unlockAfterFork();
+
+    std::size_t reservedBytes() const;  // bytes mmap'd from the OS
+    std::size_t hugePageBytes() const;  // part of reservedBytes() backed by (or advised for) huge pages
+    std::size_t freeBytes() const;  // bytes sitting in free spans
+    std::size_t releasedBytes() const;  // part of freeBytes() already returned to the OS
+
+private:
+    PageHeap();
+
+    Span* allocateSpan(std::size_t pages, Span::Kind kind);
+    Span* searchFreeLists(std::size_t pages);
+    Span* carve(Span* span, std::size_t pages);
+    Span* splitOff(Span* span, std::uintptr_t startPage, std::size_t pageCount);
+    void releaseSpan(Span* span);
+    void growHeap(std::size_t pages);
+    void* mapRegion(std::size_t bytes, bool& hugeTlb);
+
+    void insertFree(Span* span);
+    void removeFree(Span* span);
+    Span* freeListFor(std::size_t pages);
+
+    Span* newSpan(std::uintptr_t startPage, std::size_t pageCount);
+    void deleteSpan(Span* span);
+
+    Span* lookup(std::uintptr_t page) const;
+    void setMapping(std::uintptr_t page, Span* span);
+    void clearMapping(std::uintptr_t page);
+    void mapEnds(Span* span);
+    void mapAllPages(Span* span);
+
+    // two level page map over 48-bit addresses: root -> leaf -> Span*
+    static constexpr int kLeafBits = 18;
+    static constexpr int kRootBits = 48 - PAGE_HEAP_PAGE_SHIFT - kLeafBits;
+    static constexpr std::size_t kLeafLength = std::size_t(1) << kLeafBits;
+    static constexpr std::size_t kRootLength = std::size_t(1) << kRootBits;
+
+    struct Leaf
+    {
+        Span* spans[kLeafLength];
+    };
+
+    std::atomic<Leaf*>* root_;  // mmap'd, leaves are created on first use
+
+    // free spans cached by exact length; longer spans share one best-fit list
+    Span freeLists_[PAGE_HEAP_MAX_CACHED_PAGES + 1];
+    Span largeFreeList_;
+
+    Span* spanFreeList_;  // recycled Span records
+    char* spanArena_;  // current chunk Span records are carved from
+    std::size_t spanArenaLeft_;
+
+    HugePageMode hugePageMode_;
+    std::size_t reservedBytes_;
+    std::size_t hugePageBytes_;
+    std::size_t freePages_;
+    std::size_t releasedPages_;
+    mutable std::mutex mutex_;
+};
+
+}  // namespace memorypool
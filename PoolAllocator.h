@@ -0,0 +1,107 @@
+#pragma once
+
+#include "MemoryPool.h"
+
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <type_traits>
+
+namespace memorypool
+{
+
+// PoolAllocator is a standard Allocator that takes memory from one bucket's pools, so node-based
+// containers (std::map, std::unordered_map, std::list, ...) get their nodes from the size classes.
+// A single node allocate(1) lands in the class of sizeof(T); arrays such as hash-table bucket
+// vectors use the class of their byte size, or page heap spans above MAX_SLOT_SIZE. Over-aligned
+// types get a class whose slots honour alignof(T). allocate(0) returns a distinct one-element slot,
+// like operator new[](0). The allocator is stateless: every instance for the same bucket is
+// interchangeable.
+template<typename T, typename Bucket = HashBucket>
+class PoolAllocator
+{
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::true_type;
+
+    template<typename U>
+    struct rebind
+    {
+        using other = PoolAllocator<U, Bucket>;
+    };
+
+    PoolAllocator() noexcept = default;
+
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U, Bucket>&) noexcept
+    {
+    }
+
+    T* allocate(std::size_t n)
+    {
+        if (n > max_size())
+        {
+            throw std::bad_array_new_length();
+        }
+        void* p = nullptr;
+        if constexpr (alignof(T) > SLOT_BASE_SIZE)
+        {
+            p = Bucket::useMemory(bytesFor(n), alignof(T));  // a class whose slots are aligned for T
+        }
+        else
+        {
+            p = Bucket::useMemory(bytesFor(n));
+        }
+        if (p == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept
+    {
+        if constexpr (alignof(T) > SLOT_BASE_SIZE)
+        {
+            Bucket::freeMemory(static_cast<void*>(p), bytesFor(n), alignof(T));
+        }
+        else
+        {
+            Bucket::freeMemory(static_cast<void*>(p), bytesFor(n));
+        }
+    }
+
+    std::size_t max_size() const noexcept
+    {
+        return std::numeric_limits<std::size_t>::max() / sizeof(T);
+    }
+
+private:
+    // the buckets return nullptr for 0 bytes, so an empty request takes one element
+    static std::size_t bytesFor(std::size_t n) noexcept
+    {
+        return (n == 0 ? 1 : n) * sizeof(T);
+    }
+};
+
+template<typename T, typename U, typename Bucket>
+bool operator==(const PoolAllocator<T, Bucket>&, const PoolAllocator<U, Bucket>&) noexcept
+{
+    return true;
+}
+
+template<typename T, typename U, typename Bucket>
+bool operator!=(const PoolAllocator<T, Bucket>&, const PoolAllocator<U, Bucket>&) noexcept
+{
+    return false;
+}
+
+template<typename T>
+using LockFreePoolAllocator = PoolAllocator<T, LockFreeHashBucket>;
+
+}  // namespace memorypool
@@ -0,0 +1,27 @@
+#include "PoolResource.h"
+
+namespace memorypool
+{
+namespace
+{
+// constructed in static storage on first use and never destroyed, like the page heap
+template<typename Bucket>
+std::pmr::memory_resource* resourceFor()
+{
+    alignas(PoolResource<Bucket>) static unsigned char storage[sizeof(PoolResource<Bucket>)];
+    static PoolResource<Bucket>* resource = new (storage) PoolResource<Bucket>();
+    return resource;
+}
+}  // namespace
+
+std::pmr::memory_resource* poolResource()
+{
+    return resourceFor<HashBucket>();
+}
+
+std::pmr::memory_resource* lockFreePoolResource()
+{
+    return resourceFor<LockFreeHashBucket>();
+}
+
+}  // namespace memorypool
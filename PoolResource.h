@@ -0,0 +1,92 @@
+#pragma once
+
+#include "Arena.h"
+#include "MemoryPool.h"
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+namespace memorypool
+{
+
+// PoolResource is a std::pmr::memory_resource that takes memory from one bucket's pools, so pmr
+// containers get their nodes and arrays from the size classes (page heap spans above
+// MAX_SLOT_SIZE). Both calls use the size and alignment pmr hands over, so a deallocation goes
+// straight to its class without a page map lookup. Stateless: every PoolResource of the same
+// bucket compares equal, and memory allocated through one may be freed through another.
+//
+// It also works as the upstream of std::pmr::monotonic_buffer_resource or unsynchronized_pool_resource.
+template<typename Bucket = HashBucket>
+class PoolResource : public std::pmr::memory_resource
+{
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        if (bytes == 0)
+        {
+            bytes = 1;
+        }
+        void* p = alignment > SLOT_BASE_SIZE ? Bucket::useMemory(bytes, alignment) : Bucket::useMemory(bytes);
+        if (p == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override
+    {
+        if (bytes == 0)
+        {
+            bytes = 1;
+        }
+        if (alignment > SLOT_BASE_SIZE)
+        {
+            Bucket::freeMemory(p, bytes, alignment);
+        }
+        else
+        {
+            Bucket::freeMemory(p, bytes);
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other || dynamic_cast<const PoolResource*>(&other) != nullptr;
+    }
+};
+
+// ArenaResource hands out memory from an Arena: deallocate is a no-op and everything comes back
+// when the arena is reset, like std::pmr::monotonic_buffer_resource but over the arena's blocks.
+// The arena must outlive every container using the resource.
+class ArenaResource : public std::pmr::memory_resource
+{
+public:
+    explicit ArenaResource(Arena& arena) noexcept : arena_(arena) {}
+
+    Arena& arena() const noexcept { return arena_; }
+
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        return arena_.allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void*, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+private:
+    Arena& arena_;
+};
+
+// process-wide resources for the two buckets, never destroyed so pmr containers in static
+// storage can still free into them during exit
+std::pmr::memory_resource* poolResource();
+std::pmr::memory_resource* lockFreePoolResource();
+
+}  // namespace memorypool
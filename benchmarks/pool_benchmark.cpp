@@ -1,12 +1,30 @@
+#include "Arena.h"
+#include "HeapProfiler.h"
 #include "MemoryPool.h"
+#include "ObjectPool.h"
+#include "PoolAllocator.h"
+#include "PoolResource.h"
 
+#include <algorithm>
 #include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <iostream>
+#include <list>
+#include <map>
+#include <memory_resource>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 using namespace memorypool;
 
 namespace
@@ -17,6 +35,15 @@ struct BenchPayload
     unsigned char data[32];
 };
 
+// ExpensiveObject 构造时预留缓冲区，ObjectPool 复用时只需 reset()
+struct ExpensiveObject
+{
+    ExpensiveObject() { buffer.reserve(1024); }
+    void reset() { buffer.clear(); }
+
+    std::vector<unsigned char> buffer;
+};
+
 using Clock = std::chrono::steady_clock;
 
 // runBenchmark 记录 func 的执行耗时并输出结果
@@ -29,6 +56,373 @@ void runBenchmark(const std::string& name, Func&& func)
     const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
     std::cout << name << ": " << elapsed.count() / 1000.0 << " ms" << std::endl;
 }
+
+// HardwareCounter 用 perf_event_open 统计本线程用户态的一个硬件事件（默认指令数）；内核或容器不允许时 valid() 为 false
+class HardwareCounter
+{
+public:
+    explicit HardwareCounter(std::uint32_t type = PERF_TYPE_HARDWARE, std::uint64_t config = PERF_COUNT_HW_INSTRUCTIONS)
+    {
+        perf_event_attr attr{};
+        attr.type = type;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    ~HardwareCounter()
+    {
+        if (fd_ >= 0)
+        {
+            close(fd_);
+        }
+    }
+
+    HardwareCounter(const HardwareCounter&) = delete;
+    HardwareCounter& operator=(const HardwareCounter&) = delete;
+
+    bool valid() const { return fd_ >= 0; }
+
+    template<typename Func>
+    std::uint64_t measure(Func&& func)
+    {
+        ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        func();
+        ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+        std::uint64_t count = 0;
+        if (read(fd_, &count, sizeof(count)) != static_cast<ssize_t>(sizeof(count)))
+        {
+            return 0;
+        }
+        return count;
+    }
+
+private:
+    int fd_;
+};
+
+// 单次分配+释放的开销：优先报告指令数，计数器不可用时退回到纳秒
+template<typename Func>
+void runPerPair(HardwareCounter& counter, const std::string& name, std::size_t pairs, Func&& func)
+{
+    func();  // 预热线程缓存
+    if (counter.valid())
+    {
+        const std::uint64_t instructions = counter.measure(func);
+        std::cout << name << ": " << static_cast<double>(instructions) / pairs << " instructions/pair" << std::endl;
+        return;
+    }
+    const auto start = Clock::now();
+    func();
+    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+    std::cout << name << ": " << static_cast<double>(elapsed.count()) / pairs << " ns/pair" << std::endl;
+}
+
+// L1 数据缓存读缺失
+HardwareCounter l1dReadMisses()
+{
+    return HardwareCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+}
+
+// ColoredNode 是 320 字节的 slot：4 KB block 放 12 个，剩下 192 字节可以轮转出 4 种颜色
+struct ColoredNode
+{
+    std::size_t value;
+    unsigned char padding[320 - sizeof(std::size_t)];
+};
+
+// 在 blockCount 个 block 里各取同一下标的 slot 反复遍历，模拟哈希表节点按下标访问；
+// 不着色时这些 slot 相对页的偏移相同，落在同一组 L1 cache set 里
+void walkAcrossBlocks(HardwareCounter& misses, const std::string& name, bool colorBlocks)
+{
+    constexpr std::size_t blockCount = 32;
+    constexpr std::size_t rounds = 20'000;
+    MemoryPool pool;
+    pool.init(sizeof(ColoredNode), 4096, colorBlocks);
+
+    std::vector<std::vector<ColoredNode*>> blocks(blockCount);
+    const std::size_t perBlock = (4096 - 64) / sizeof(ColoredNode);  // slots start 64-aligned after the link
+    for (auto& block : blocks)
+    {
+        for (std::size_t i = 0; i < perBlock; ++i)
+        {
+            block.push_back(new (pool.allocate()) ColoredNode{i, {}});
+        }
+    }
+
+    std::size_t sum = 0;
+    auto walk = [&]() {
+        for (std::size_t index = 0; index < perBlock; ++index)
+        {
+            for (std::size_t round = 0; round < rounds; ++round)
+            {
+                for (auto& block : blocks)
+                {
+                    sum += block[index]->value;
+                }
+            }
+        }
+    };
+
+    walk();  // 预热
+    const std::uint64_t missCount = misses.valid() ? misses.measure(walk) : 0;
+    const auto start = Clock::now();
+    walk();
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+    const double loads = static_cast<double>(perBlock * rounds * blockCount);
+    std::cout << name << ": " << elapsed.count() / 1000.0 << " ms, " << loads / elapsed.count() << " loads/us";
+    if (misses.valid())
+    {
+        std::cout << ", L1D miss rate " << 100.0 * static_cast<double>(missCount) / loads << "%";
+    }
+    std::cout << " (checksum " << sum << ")" << std::endl;
+
+    for (auto& block : blocks)
+    {
+        for (ColoredNode* node : block)
+        {
+            pool.deallocate(node);
+        }
+    }
+}
+
+// 先分配一大批对象再随机释放 3/4 制造碎片，然后分配一批新对象并反复遍历：
+// 全局空闲链表把新对象散布到所有 block，block-local 模式把它们集中在最满的几个 block 里
+void iterateAfterChurn(const std::string& name, bool blockLocal)
+{
+    constexpr std::size_t initial = 1 << 18;
+    constexpr std::size_t fresh = 1 << 14;
+    constexpr std::size_t passes = 200;
+    MemoryPool pool;
+    pool.init(sizeof(BenchPayload), 64 * 1024, true, blockLocal);
+
+    std::vector<void*> live(initial);
+    for (void*& p : live)
+    {
+        p = pool.allocate();
+    }
+    std::uint64_t state = 88172645463325252ull;
+    for (std::size_t i = initial; i > 1; --i)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        std::swap(live[i - 1], live[state % i]);
+    }
+    for (std::size_t i = 0; i < initial / 4 * 3; ++i)
+    {
+        pool.deallocate(live[i]);
+    }
+    live.erase(live.begin(), live.begin() + initial / 4 * 3);
+
+    std::vector<BenchPayload*> objects;
+    std::unordered_set<std::uintptr_t> pages;
+    for (std::size_t i = 0; i < fresh; ++i)
+    {
+        auto* object = new (pool.allocate()) BenchPayload{};
+        object->data[0] = static_cast<unsigned char>(i);
+        objects.push_back(object);
+        pages.insert(reinterpret_cast<std::uintptr_t>(object) / 4096);
+    }
+    std::sort(objects.begin(), objects.end());  // 遍历按地址顺序，只看对象有多分散
+
+    std::size_t sum = 0;
+    const auto start = Clock::now();
+    for (std::size_t pass = 0; pass < passes; ++pass)
+    {
+        for (BenchPayload* object : objects)
+        {
+            sum += object->data[0];
+        }
+    }
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+    std::cout << name << ": " << fresh << " new objects on " << pages.size() << " pages, " << passes
+              << " passes in " << elapsed.count() / 1000.0 << " ms (checksum " << sum << ")" << std::endl;
+
+    for (BenchPayload* object : objects)
+    {
+        pool.deallocate(object);
+    }
+    for (void* p : live)
+    {
+        pool.deallocate(p);
+    }
+}
+
+// 新 pool 上第一波分配的单次延迟：冷启动要切新 block 并触发缺页，reserve() 之后两者都提前完成
+void firstBurstLatency(const std::string& name, bool reserveFirst)
+{
+    constexpr std::size_t burst = 50'000;
+    MemoryPool pool;
+    pool.init(256, 4096);
+    if (reserveFirst)
+    {
+        pool.reserve(burst);
+    }
+
+    std::vector<void*> slots(burst);
+    std::vector<std::uint32_t> latencies(burst);
+    for (std::size_t i = 0; i < burst; ++i)
+    {
+        const auto start = Clock::now();
+        slots[i] = pool.allocate();
+        static_cast<volatile unsigned char*>(slots[i])[0] = 1;  // 使用者写入新对象，缺页算在这里
+        latencies[i] = static_cast<std::uint32_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << name << ": p50 " << latencies[burst / 2] << " ns, p99 " << latencies[burst * 99 / 100]
+              << " ns, p99.9 " << latencies[burst * 999 / 1000] << " ns, max " << latencies.back() << " ns"
+              << std::endl;
+    for (void* p : slots)
+    {
+        pool.deallocate(p);
+    }
+}
+
+// 容器节点分配：插入 count 个 key 再全部删除，allocator 决定节点从哪里来
+template<typename Alloc>
+void mapInsertErase(std::size_t count)
+{
+    using Map = std::map<std::size_t, std::size_t, std::less<std::size_t>,
+                         typename std::allocator_traits<Alloc>::template rebind_alloc<std::pair<const std::size_t, std::size_t>>>;
+    Map map;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        map.emplace((i * 2654435761u) % count, i);  // scrambled keys so the tree rebalances
+    }
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        map.erase(i);
+    }
+}
+
+template<typename Alloc>
+void unorderedMapInsertErase(std::size_t count)
+{
+    using Map = std::unordered_map<std::size_t, std::size_t, std::hash<std::size_t>, std::equal_to<std::size_t>,
+                                   typename std::allocator_traits<Alloc>::template rebind_alloc<std::pair<const std::size_t, std::size_t>>>;
+    Map map;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        map.emplace(i, i);
+    }
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        map.erase(i);
+    }
+}
+
+template<typename Alloc>
+void listPushPop(std::size_t count)
+{
+    std::list<std::size_t, typename std::allocator_traits<Alloc>::template rebind_alloc<std::size_t>> list;
+    for (std::size_t round = 0; round < 4; ++round)
+    {
+        for (std::size_t i = 0; i < count / 4; ++i)
+        {
+            list.push_back(i);
+        }
+        while (!list.empty())
+        {
+            list.pop_front();
+        }
+    }
+}
+
+// pmr 工作负载：许多小 vector 逐个 push_back 增长，以及 unordered_map 插入后删除
+void pmrVectorGrow(std::pmr::memory_resource* resource, std::size_t count)
+{
+    std::pmr::vector<std::pmr::vector<int>> vectors(resource);
+    vectors.reserve(count / 64);
+    for (std::size_t v = 0; v < count / 64; ++v)
+    {
+        std::pmr::vector<int>& vector = vectors.emplace_back();
+        for (std::size_t i = 0; i < 64; ++i)
+        {
+            vector.push_back(static_cast<int>(i));
+        }
+    }
+}
+
+void pmrUnorderedMap(std::pmr::memory_resource* resource, std::size_t count)
+{
+    std::pmr::unordered_map<std::size_t, std::size_t> map(resource);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        map.emplace(i, i);
+    }
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        map.erase(i);
+    }
+}
+
+void pmrWorkloads(std::pmr::memory_resource* resource, std::size_t count)
+{
+    pmrVectorGrow(resource, count);
+    pmrUnorderedMap(resource, count);
+}
+
+// threads 个线程共享同一个 resource 运行 pmr 工作负载
+void pmrConcurrent(std::pmr::memory_resource* resource, std::size_t threadCount, std::size_t count)
+{
+    std::vector<std::thread> threads;
+    threads.reserve(threadCount);
+    for (std::size_t t = 0; t < threadCount; ++t)
+    {
+        threads.emplace_back([resource, count]() { pmrWorkloads(resource, count); });
+    }
+    for (auto& th : threads)
+    {
+        th.join();
+    }
+}
+
+// threads 个线程直接在同一个 LockFreeMemoryPool 上分配/释放（不经过线程缓存），每轮持有 4 个 slot；
+// 返回每秒完成的分配+释放对数（百万）
+double stripedPoolThroughput(std::size_t stripes, std::size_t threadCount, std::size_t pairsPerThread)
+{
+    LockFreeMemoryPool pool;
+    pool.init(64, 0, true, stripes);
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    threads.reserve(threadCount);
+    for (std::size_t t = 0; t < threadCount; ++t)
+    {
+        threads.emplace_back([&]() {
+            void* held[4];
+            while (!go.load(std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+            }
+            for (std::size_t i = 0; i < pairsPerThread; i += 4)
+            {
+                for (void*& p : held)
+                {
+                    p = pool.allocate();
+                }
+                for (void* p : held)
+                {
+                    pool.deallocate(p);
+                }
+            }
+        });
+    }
+    const auto start = Clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto& th : threads)
+    {
+        th.join();
+    }
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+    return static_cast<double>(threadCount * pairsPerThread) / static_cast<double>(elapsed.count());
+}
 }  // namespace
 
 int main()
@@ -40,7 +434,12 @@ int main()
     constexpr std::size_t threadCount = 8;
     constexpr std::size_t iterationsPerThread = 200'000;
 
-    std::cout << "Sequential benchmarks (" << sequentialIterations << " operations)" << std::endl;
+    // 最先运行，页堆里还没有回收来的、已经缺页过的内存
+    std::cout << "First burst on a new pool (50000 x 256 B)" << std::endl;
+    firstBurstLatency("cold", false);
+    firstBurstLatency("after reserve()", true);
+
+    std::cout << "\nSequential benchmarks (" << sequentialIterations << " operations)" << std::endl;
 
     runBenchmark("memory pool (sequential)", [&]() {
         std::vector<BenchPayload*> cache;
@@ -81,6 +480,214 @@ int main()
         }
     });
 
+    // 突发分配：每次 64 个对象，逐个调用 vs 批量接口
+    constexpr std::size_t burstSize = 64;
+    runBenchmark("lock-free memory pool (bursts of 64, one by one)", [&]() {
+        BenchPayload* burst[burstSize];
+        for (std::size_t i = 0; i < sequentialIterations; i += burstSize)
+        {
+            for (std::size_t j = 0; j < burstSize; ++j)
+            {
+                burst[j] = newElementLockFree<BenchPayload>();
+            }
+            for (std::size_t j = 0; j < burstSize; ++j)
+            {
+                deleteElementLockFree(burst[j]);
+            }
+        }
+    });
+
+    runBenchmark("lock-free memory pool (bursts of 64, batched)", [&]() {
+        BenchPayload* burst[burstSize];
+        for (std::size_t i = 0; i < sequentialIterations; i += burstSize)
+        {
+            newElementsLockFree<BenchPayload>(burstSize, burst);
+            deleteElementsLockFree(burstSize, burst);
+        }
+    });
+
+    // 运行时尺寸经过 size class 查表，newElement<T> 在编译期确定 size class 并直接弹出线程缓存
+    constexpr std::size_t dispatchPairs = 1'000'000;
+    HardwareCounter counter;
+    std::cout << "\nSize-class dispatch (" << dispatchPairs << " allocate + free pairs"
+              << (counter.valid() ? "" : ", perf counters unavailable") << ")" << std::endl;
+
+    runPerPair(counter, "useMemory(size), runtime size", dispatchPairs, [&]() {
+        volatile std::size_t size = sizeof(BenchPayload);  // 阻止编译器把尺寸常量折叠进来
+        for (std::size_t i = 0; i < dispatchPairs; ++i)
+        {
+            void* p = HashBucket::useMemory(size);
+            HashBucket::freeMemory(p, size);
+        }
+    });
+
+    runPerPair(counter, "newElement<T>, compile-time size class", dispatchPairs, [&]() {
+        for (std::size_t i = 0; i < dispatchPairs; ++i)
+        {
+            deleteElement(newElement<BenchPayload>());
+        }
+    });
+
+    // 同样的调用打开堆采样：未采样的调用只多一次倒计数，采样的调用要抓调用栈
+    HeapProfiler::start();
+    runPerPair(counter, "newElement<T>, heap profiler sampling every 512 KB", dispatchPairs, [&]() {
+        for (std::size_t i = 0; i < dispatchPairs; ++i)
+        {
+            deleteElement(newElement<BenchPayload>());
+        }
+    });
+    HeapProfiler::start(4096);
+    runPerPair(counter, "newElement<T>, heap profiler sampling every 4 KB", dispatchPairs, [&]() {
+        for (std::size_t i = 0; i < dispatchPairs; ++i)
+        {
+            deleteElement(newElement<BenchPayload>());
+        }
+    });
+    HeapProfiler::stop();
+    HeapProfiler::reset();
+
+    HardwareCounter misses = l1dReadMisses();
+    std::cout << "\nBlock coloring (same-index slots of 32 blocks"
+              << (misses.valid() ? "" : ", perf counters unavailable") << ")" << std::endl;
+    walkAcrossBlocks(misses, "uncolored blocks", false);
+    walkAcrossBlocks(misses, "colored blocks", true);
+
+    std::cout << "\nIteration after churn (3/4 of 262144 objects freed at random)" << std::endl;
+    iterateAfterChurn("pool-wide free list", false);
+    iterateAfterChurn("block-local free lists", true);
+
+    std::cout << "\nExpensive objects (" << dispatchPairs << " acquire + release pairs)" << std::endl;
+
+    runBenchmark("newElement/deleteElement, rebuilt each time", [&]() {
+        for (std::size_t i = 0; i < dispatchPairs; ++i)
+        {
+            ExpensiveObject* object = newElement<ExpensiveObject>();
+            object->buffer.push_back(1);
+            deleteElement(object);
+        }
+    });
+
+    runBenchmark("ObjectPool, recycled", [&]() {
+        ObjectPool<ExpensiveObject> pool;
+        for (std::size_t i = 0; i < dispatchPairs; ++i)
+        {
+            ObjectPool<ExpensiveObject>::Handle object = pool.make();
+            object->buffer.push_back(1);
+        }
+    });
+
+    // 每个请求创建几百个短命对象然后一起销毁：逐个 deleteElement vs arena 整体 reset
+    constexpr std::size_t requests = 10'000;
+    constexpr std::size_t objectsPerRequest = 300;
+    std::cout << "\nPer-request objects (" << requests << " requests x " << objectsPerRequest << " objects)"
+              << std::endl;
+
+    runBenchmark("newElement/deleteElement per object", [&]() {
+        std::vector<BenchPayload*> live;
+        live.reserve(objectsPerRequest);
+        for (std::size_t r = 0; r < requests; ++r)
+        {
+            for (std::size_t i = 0; i < objectsPerRequest; ++i)
+            {
+                live.push_back(newElement<BenchPayload>());
+            }
+            for (BenchPayload* ptr : live)
+            {
+                deleteElement(ptr);
+            }
+            live.clear();
+        }
+    });
+
+    runBenchmark("Arena, reset per request", [&]() {
+        Arena arena;
+        for (std::size_t r = 0; r < requests; ++r)
+        {
+            for (std::size_t i = 0; i < objectsPerRequest; ++i)
+            {
+                arena.create<BenchPayload>();
+            }
+            arena.reset();
+        }
+    });
+
+    runBenchmark("Arena, blocks kept across requests", [&]() {
+        Arena arena(ARENA_DEFAULT_BLOCK_SIZE, true);
+        for (std::size_t r = 0; r < requests; ++r)
+        {
+            for (std::size_t i = 0; i < objectsPerRequest; ++i)
+            {
+                arena.create<BenchPayload>();
+            }
+            arena.reset();
+        }
+    });
+
+    constexpr std::size_t containerOperations = 200'000;
+    std::cout << "\nContainer benchmarks (" << containerOperations << " inserts + erases)" << std::endl;
+
+    runBenchmark("std::map, std::allocator", [&]() { mapInsertErase<std::allocator<int>>(containerOperations); });
+    runBenchmark("std::map, PoolAllocator", [&]() { mapInsertErase<PoolAllocator<int>>(containerOperations); });
+    runBenchmark("std::map, LockFreePoolAllocator", [&]() {
+        mapInsertErase<LockFreePoolAllocator<int>>(containerOperations);
+    });
+
+    runBenchmark("std::unordered_map, std::allocator", [&]() {
+        unorderedMapInsertErase<std::allocator<int>>(containerOperations);
+    });
+    runBenchmark("std::unordered_map, PoolAllocator", [&]() {
+        unorderedMapInsertErase<PoolAllocator<int>>(containerOperations);
+    });
+    runBenchmark("std::unordered_map, LockFreePoolAllocator", [&]() {
+        unorderedMapInsertErase<LockFreePoolAllocator<int>>(containerOperations);
+    });
+
+    runBenchmark("std::list, std::allocator", [&]() { listPushPop<std::allocator<int>>(containerOperations); });
+    runBenchmark("std::list, PoolAllocator", [&]() { listPushPop<PoolAllocator<int>>(containerOperations); });
+    runBenchmark("std::list, LockFreePoolAllocator", [&]() {
+        listPushPop<LockFreePoolAllocator<int>>(containerOperations);
+    });
+
+    std::cout << "\nstd::pmr benchmarks (vector growth + unordered_map, " << containerOperations << " elements)"
+              << std::endl;
+
+    {
+        std::pmr::synchronized_pool_resource synchronizedPool;
+        std::pmr::unsynchronized_pool_resource unsynchronizedPool;
+        runBenchmark("pmr, new_delete_resource", [&]() {
+            pmrWorkloads(std::pmr::new_delete_resource(), containerOperations);
+        });
+        runBenchmark("pmr, synchronized_pool_resource", [&]() {
+            pmrWorkloads(&synchronizedPool, containerOperations);
+        });
+        runBenchmark("pmr, unsynchronized_pool_resource", [&]() {
+            pmrWorkloads(&unsynchronizedPool, containerOperations);
+        });
+        runBenchmark("pmr, poolResource", [&]() { pmrWorkloads(poolResource(), containerOperations); });
+        runBenchmark("pmr, lockFreePoolResource", [&]() {
+            pmrWorkloads(lockFreePoolResource(), containerOperations);
+        });
+        runBenchmark("pmr, monotonic_buffer_resource over poolResource", [&]() {
+            std::pmr::monotonic_buffer_resource monotonic(poolResource());
+            pmrWorkloads(&monotonic, containerOperations);
+        });
+        runBenchmark("pmr, ArenaResource", [&]() {
+            Arena arena;
+            ArenaResource resource(arena);
+            pmrWorkloads(&resource, containerOperations);
+        });
+
+        runBenchmark("pmr, synchronized_pool_resource (concurrent)", [&]() {
+            pmrConcurrent(&synchronizedPool, threadCount, containerOperations / 4);
+        });
+        runBenchmark("pmr, poolResource (concurrent)", [&]() {
+            pmrConcurrent(poolResource(), threadCount, containerOperations / 4);
+        });
+        runBenchmark("pmr, lockFreePoolResource (concurrent)", [&]() {
+            pmrConcurrent(lockFreePoolResource(), threadCount, containerOperations / 4);
+        });
+    }
+
     std::cout << "\nConcurrent benchmarks (" << threadCount << " threads x "
               << iterationsPerThread << " operations)" << std::endl;
 
@@ -156,5 +763,17 @@ int main()
         }
     });
 
+    // 所有线程挤在同一个空闲链表头上 vs 分到多个 stripe；单核机器上只能看到退避和偷取的开销
+    constexpr std::size_t stripedPairs = 200'000;
+    std::cout << "\nLockFreeMemoryPool free list stripes (" << stripedPairs
+              << " allocate + free pairs per thread, M pairs/s, " << std::thread::hardware_concurrency()
+              << " hardware threads)" << std::endl;
+    std::cout << "threads  1 stripe  " << LOCK_FREE_MAX_STRIPES << " stripes" << std::endl;
+    for (std::size_t threads = 1; threads <= 64; threads *= 2)
+    {
+        std::cout << threads << "  " << stripedPoolThroughput(1, threads, stripedPairs) << "  "
+                  << stripedPoolThroughput(LOCK_FREE_MAX_STRIPES, threads, stripedPairs) << std::endl;
+    }
+
     return 0;
 }
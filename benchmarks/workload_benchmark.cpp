@@ -0,0 +1,563 @@
+#include "MemoryPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <malloc.h>
+
+using namespace memorypool;
+
+// 工作负载基准：随机尺寸、有界存活集、跨线程释放、Larson 服务器模拟和线程数扩展。
+// 每个结果输出 ops/s、单次操作延迟的 p50/p99/p999 以及峰值 RSS；--json 输出每行一个 JSON 对象，
+// 方便在不同版本之间对比。
+//
+//   memorypool_workload_benchmark [--json] [--ops=N] [--threads=N] [--workloads=a,b] [--allocators=a,b]
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+
+constexpr std::uint64_t kSampleMask = 15;  // 每 16 次操作计时一次，计时本身不主导吞吐
+constexpr std::size_t kMaxRequest = 64 * 1024;
+constexpr std::size_t kChannelCapacity = 1024;  // producer/consumer 环形队列长度
+
+struct Options
+{
+    std::size_t opsPerThread = 200'000;
+    std::size_t maxThreads = 16;
+    bool json = false;
+    std::vector<std::string> workloads{"random-mix", "bounded-live", "producer-consumer", "larson", "scaling"};
+    std::vector<std::string> allocators{"pool", "lockfree", "percpu", "malloc"};
+};
+
+// 每个被测分配器提供同样的静态接口，release() 在两次运行之间把空闲内存还给 OS
+struct PoolTarget
+{
+    static constexpr const char* name = "pool";
+    static void* allocate(std::size_t size) { return HashBucket::useMemory(size); }
+    static void deallocate(void* p, std::size_t size) { HashBucket::freeMemory(p, size); }
+    static void release() { HashBucket::trim(); }
+};
+
+struct LockFreeTarget
+{
+    static constexpr const char* name = "lockfree";
+    static void* allocate(std::size_t size) { return LockFreeHashBucket::useMemory(size); }
+    static void deallocate(void* p, std::size_t size) { LockFreeHashBucket::freeMemory(p, size); }
+    static void release() { LockFreeHashBucket::trim(); }
+};
+
+struct PerCpuTarget
+{
+    static constexpr const char* name = "percpu";
+    static void* allocate(std::size_t size) { return PerCpuHashBucket::useMemory(size); }
+    static void deallocate(void* p, std::size_t size) { PerCpuHashBucket::freeMemory(p, size); }
+    static void release() { PerCpuHashBucket::trim(); }
+};
+
+struct MallocTarget
+{
+    static constexpr const char* name = "malloc";
+    static void* allocate(std::size_t size) { return std::malloc(size); }
+    static void deallocate(void* p, std::size_t) { std::free(p); }
+    static void release() { malloc_trim(0); }
+};
+
+// xorshift64*，每个线程一个，避免 <random> 的开销混进延迟
+struct Rng
+{
+    std::uint64_t state;
+
+    explicit Rng(std::uint64_t seed) : state(seed * 0x9E3779B97F4A7C15ull + 1) {}
+
+    std::uint64_t next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1Dull;
+    }
+
+    std::size_t below(std::size_t bound) { return static_cast<std::size_t>(next() % bound); }
+};
+
+// 偏向小对象的尺寸分布：60% <= 128B，30% <= 1KB，9% <= 16KB，1% 直到 64KB（越过 MAX_SLOT_SIZE）
+std::size_t randomSize(Rng& rng)
+{
+    std::size_t bucket = rng.below(100);
+    if (bucket < 60)
+    {
+        return 8 + rng.below(121);
+    }
+    if (bucket < 90)
+    {
+        return 129 + rng.below(896);
+    }
+    if (bucket < 99)
+    {
+        return 1025 + rng.below(15360);
+    }
+    return 16385 + rng.below(kMaxRequest - 16384);
+}
+
+// Recorder 统计一个线程的操作数，并抽样记录单次操作耗时（纳秒）
+struct Recorder
+{
+    std::uint64_t ops = 0;
+    std::vector<std::uint32_t> samples;
+
+    template<typename Allocator>
+    void* allocate(std::size_t size)
+    {
+        if ((ops++ & kSampleMask) != 0)
+        {
+            return Allocator::allocate(size);
+        }
+        const auto start = Clock::now();
+        void* p = Allocator::allocate(size);
+        record(start);
+        return p;
+    }
+
+    template<typename Allocator>
+    void deallocate(void* p, std::size_t size)
+    {
+        if ((ops++ & kSampleMask) != 0)
+        {
+            Allocator::deallocate(p, size);
+            return;
+        }
+        const auto start = Clock::now();
+        Allocator::deallocate(p, size);
+        record(start);
+    }
+
+    void record(Clock::time_point start)
+    {
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+        samples.push_back(static_cast<std::uint32_t>(std::min<long long>(ns, UINT32_MAX)));
+    }
+};
+
+struct Block
+{
+    void* p;
+    std::size_t size;
+};
+
+struct Result
+{
+    std::uint64_t ops = 0;
+    double seconds = 0;
+    std::vector<std::uint32_t> samples;
+
+    void merge(Recorder& recorder)
+    {
+        ops += recorder.ops;
+        samples.insert(samples.end(), recorder.samples.begin(), recorder.samples.end());
+    }
+};
+
+// 启动 threads 个线程执行 body(threadIndex, recorder)，所有线程就绪后才开始计时
+template<typename Body>
+Result runThreads(std::size_t threads, Body&& body)
+{
+    std::vector<Recorder> recorders(threads);
+    std::atomic<std::size_t> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> workers;
+    workers.reserve(threads);
+    for (std::size_t t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&, t]() {
+            ready.fetch_add(1, std::memory_order_acq_rel);
+            while (!go.load(std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+            }
+            body(t, recorders[t]);
+        });
+    }
+    while (ready.load(std::memory_order_acquire) != threads)
+    {
+        std::this_thread::yield();
+    }
+    const auto start = Clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+
+    Result result;
+    result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    for (Recorder& recorder : recorders)
+    {
+        result.merge(recorder);
+    }
+    return result;
+}
+
+// 随机尺寸：分配一批随机尺寸的对象，再按打乱后的顺序全部释放
+template<typename Allocator>
+Result randomMix(const Options& options, std::size_t threads)
+{
+    return runThreads(threads, [&](std::size_t t, Recorder& recorder) {
+        Rng rng(t + 1);
+        constexpr std::size_t kBatch = 1000;
+        std::vector<Block> live(kBatch);
+        for (std::size_t done = 0; done < options.opsPerThread; done += 2 * kBatch)
+        {
+            for (Block& block : live)
+            {
+                block.size = randomSize(rng);
+                block.p = recorder.allocate<Allocator>(block.size);
+            }
+            for (std::size_t i = kBatch; i > 1; --i)
+            {
+                std::swap(live[i - 1], live[rng.below(i)]);
+            }
+            for (Block& block : live)
+            {
+                recorder.deallocate<Allocator>(block.p, block.size);
+            }
+        }
+    });
+}
+
+// 有界存活集：每次随机替换存活集中的一个对象，分配和释放交错进行
+template<typename Allocator>
+Result boundedLive(const Options& options, std::size_t threads)
+{
+    return runThreads(threads, [&](std::size_t t, Recorder& recorder) {
+        Rng rng(t + 101);
+        std::vector<Block> live(4096, Block{nullptr, 0});
+        for (std::size_t done = 0; done < options.opsPerThread; ++done)
+        {
+            Block& block = live[rng.below(live.size())];
+            if (block.p != nullptr)
+            {
+                recorder.deallocate<Allocator>(block.p, block.size);
+                block.p = nullptr;
+            }
+            else
+            {
+                block.size = randomSize(rng);
+                block.p = recorder.allocate<Allocator>(block.size);
+            }
+        }
+        for (Block& block : live)
+        {
+            if (block.p != nullptr)
+            {
+                Allocator::deallocate(block.p, block.size);
+            }
+        }
+    });
+}
+
+// 生产者/消费者：偶数线程分配并通过单生产者单消费者环形队列交给奇数线程释放
+template<typename Allocator>
+Result producerConsumer(const Options& options, std::size_t threads)
+{
+    struct Channel
+    {
+        Block slots[kChannelCapacity];
+        alignas(64) std::atomic<std::size_t> head{0};
+        alignas(64) std::atomic<std::size_t> tail{0};
+    };
+
+    const std::size_t pairs = std::max<std::size_t>(1, threads / 2);
+    std::vector<Channel> channels(pairs);
+    return runThreads(pairs * 2, [&](std::size_t t, Recorder& recorder) {
+        Channel& channel = channels[t / 2];
+        const std::size_t count = options.opsPerThread;
+        if (t % 2 == 0)
+        {
+            Rng rng(t + 201);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                std::size_t size = randomSize(rng);
+                void* p = recorder.allocate<Allocator>(size);
+                const std::size_t tail = channel.tail.load(std::memory_order_relaxed);
+                while (tail - channel.head.load(std::memory_order_acquire) == kChannelCapacity)
+                {
+                    std::this_thread::yield();
+                }
+                channel.slots[tail % kChannelCapacity] = Block{p, size};
+                channel.tail.store(tail + 1, std::memory_order_release);
+            }
+        }
+        else
+        {
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                const std::size_t head = channel.head.load(std::memory_order_relaxed);
+                while (channel.tail.load(std::memory_order_acquire) == head)
+                {
+                    std::this_thread::yield();
+                }
+                Block block = channel.slots[head % kChannelCapacity];
+                channel.head.store(head + 1, std::memory_order_release);
+                recorder.deallocate<Allocator>(block.p, block.size);
+            }
+        }
+    });
+}
+
+// Larson：每个线程替换自己存活集里的随机对象，一轮结束后由新线程接手存活集，
+// 所以大部分对象由另一个线程释放，模拟服务器里请求在线程间流转
+template<typename Allocator>
+Result larson(const Options& options, std::size_t threads)
+{
+    constexpr std::size_t kLiveSet = 1000;
+    constexpr std::size_t kRounds = 4;
+    std::vector<std::vector<Block>> liveSets(threads, std::vector<Block>(kLiveSet));
+    for (std::size_t t = 0; t < threads; ++t)
+    {
+        Rng rng(t + 301);
+        for (Block& block : liveSets[t])
+        {
+            block.size = 8 + rng.below(249);  // Larson 原始设置：小对象
+            block.p = Allocator::allocate(block.size);
+        }
+    }
+
+    Result total;
+    for (std::size_t round = 0; round < kRounds; ++round)
+    {
+        Result result = runThreads(threads, [&](std::size_t t, Recorder& recorder) {
+            Rng rng(round * threads + t + 401);
+            std::vector<Block>& live = liveSets[(t + round) % threads];  // 接手另一个线程的存活集
+            for (std::size_t i = 0; i < options.opsPerThread / (2 * kRounds); ++i)
+            {
+                Block& block = live[rng.below(kLiveSet)];
+                recorder.deallocate<Allocator>(block.p, block.size);
+                block.size = 8 + rng.below(249);
+                block.p = recorder.allocate<Allocator>(block.size);
+            }
+        });
+        total.ops += result.ops;
+        total.seconds += result.seconds;
+        total.samples.insert(total.samples.end(), result.samples.begin(), result.samples.end());
+    }
+
+    for (auto& live : liveSets)
+    {
+        for (Block& block : live)
+        {
+            Allocator::deallocate(block.p, block.size);
+        }
+    }
+    return total;
+}
+
+// VmHWM 从 /proc/self/clear_refs 写入 5 时清零（Linux 4.0+），每个结果只统计自己的峰值
+void resetPeakRss()
+{
+    std::ofstream clearRefs("/proc/self/clear_refs");
+    clearRefs << "5";
+}
+
+std::size_t peakRssKb()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+        {
+            return static_cast<std::size_t>(std::strtoull(line.c_str() + 6, nullptr, 10));
+        }
+    }
+    return 0;
+}
+
+std::uint32_t percentile(std::vector<std::uint32_t>& samples, double fraction)
+{
+    if (samples.empty())
+    {
+        return 0;
+    }
+    auto nth = samples.begin() + static_cast<std::ptrdiff_t>(fraction * static_cast<double>(samples.size() - 1));
+    std::nth_element(samples.begin(), nth, samples.end());
+    return *nth;
+}
+
+void report(const Options& options, const std::string& workload, const char* allocator, std::size_t threads,
+            Result& result, std::size_t rssKb)
+{
+    const double opsPerSecond = result.seconds > 0 ? static_cast<double>(result.ops) / result.seconds : 0;
+    const std::uint32_t p50 = percentile(result.samples, 0.50);
+    const std::uint32_t p99 = percentile(result.samples, 0.99);
+    const std::uint32_t p999 = percentile(result.samples, 0.999);
+    char line[256];
+    if (options.json)
+    {
+        std::snprintf(line, sizeof(line),
+                      "{\"workload\":\"%s\",\"allocator\":\"%s\",\"threads\":%zu,\"ops\":%llu,"
+                      "\"seconds\":%.6f,\"ops_per_sec\":%.0f,\"p50_ns\":%u,\"p99_ns\":%u,\"p999_ns\":%u,"
+                      "\"peak_rss_kb\":%zu}",
+                      workload.c_str(), allocator, threads, static_cast<unsigned long long>(result.ops),
+                      result.seconds, opsPerSecond, p50, p99, p999, rssKb);
+    }
+    else
+    {
+        std::snprintf(line, sizeof(line), "%-18s %-9s %7zu %14.0f %8u %8u %8u %12zu", workload.c_str(),
+                      allocator, threads, opsPerSecond, p50, p99, p999, rssKb);
+    }
+    std::cout << line << std::endl;
+}
+
+template<typename Allocator>
+void runWorkload(const Options& options, const std::string& workload)
+{
+    auto measure = [&](std::size_t threads, auto&& run) {
+        Allocator::release();
+        resetPeakRss();
+        Result result = run(options, threads);
+        report(options, workload, Allocator::name, threads, result, peakRssKb());
+    };
+
+    const std::size_t threads = std::min<std::size_t>(options.maxThreads, 8);
+    if (workload == "random-mix")
+    {
+        measure(threads, randomMix<Allocator>);
+    }
+    else if (workload == "bounded-live")
+    {
+        measure(threads, boundedLive<Allocator>);
+    }
+    else if (workload == "producer-consumer")
+    {
+        measure(threads, producerConsumer<Allocator>);
+    }
+    else if (workload == "larson")
+    {
+        measure(threads, larson<Allocator>);
+    }
+    else if (workload == "scaling")
+    {
+        for (std::size_t n = 1; n <= options.maxThreads; n *= 2)
+        {
+            measure(n, boundedLive<Allocator>);
+        }
+    }
+    else
+    {
+        std::cerr << "unknown workload: " << workload << "\n";
+    }
+}
+
+std::vector<std::string> splitList(const std::string& value)
+{
+    std::vector<std::string> items;
+    std::size_t start = 0;
+    while (start <= value.size())
+    {
+        std::size_t comma = value.find(',', start);
+        if (comma == std::string::npos)
+        {
+            comma = value.size();
+        }
+        if (comma > start)
+        {
+            items.push_back(value.substr(start, comma - start));
+        }
+        start = comma + 1;
+    }
+    return items;
+}
+
+bool parseOptions(int argc, char** argv, Options& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--json")
+        {
+            options.json = true;
+        }
+        else if (arg.compare(0, 6, "--ops=") == 0)
+        {
+            options.opsPerThread = std::strtoull(arg.c_str() + 6, nullptr, 10);
+        }
+        else if (arg.compare(0, 10, "--threads=") == 0)
+        {
+            options.maxThreads = std::max<std::size_t>(1, std::strtoull(arg.c_str() + 10, nullptr, 10));
+        }
+        else if (arg.compare(0, 12, "--workloads=") == 0)
+        {
+            options.workloads = splitList(arg.substr(12));
+        }
+        else if (arg.compare(0, 13, "--allocators=") == 0)
+        {
+            options.allocators = splitList(arg.substr(13));
+        }
+        else
+        {
+            std::cerr << "usage: " << argv[0]
+                      << " [--json] [--ops=N] [--threads=N] [--workloads=a,b] [--allocators=a,b]\n";
+            return false;
+        }
+    }
+    return true;
+}
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options))
+    {
+        return 1;
+    }
+
+    HashBucket::ensureInitialized();
+    LockFreeHashBucket::ensureInitialized();
+    PerCpuHashBucket::ensureInitialized();
+
+    if (!options.json)
+    {
+        std::cout << "workload           allocator threads          ops/s  p50(ns)  p99(ns) p999(ns) peak_rss(kB)"
+                  << std::endl;
+    }
+    for (const std::string& workload : options.workloads)
+    {
+        for (const std::string& allocator : options.allocators)
+        {
+            if (allocator == PoolTarget::name)
+            {
+                runWorkload<PoolTarget>(options, workload);
+            }
+            else if (allocator == LockFreeTarget::name)
+            {
+                runWorkload<LockFreeTarget>(options, workload);
+            }
+            else if (allocator == PerCpuTarget::name)
+            {
+                runWorkload<PerCpuTarget>(options, workload);
+            }
+            else if (allocator == MallocTarget::name)
+            {
+                runWorkload<MallocTarget>(options, workload);
+            }
+            else
+            {
+                std::cerr << "unknown allocator: " << allocator << "\n";
+            }
+        }
+    }
+    return 0;
+}
@@ -5,6 +5,7 @@
 #include <cstddef>
 #include <iostream>
 #include <thread>
+#include <unordered_set>
 #include <vector>
 
 using namespace memorypool;
@@ -80,5 +81,110 @@ int main()
     std::cout << "Allocated and freed " << totalAllocated.load(std::memory_order_relaxed)
               << " payloads via lock-free pool across " << threadCount << " threads\n";
 
+    // warm-up 阶段：全新的池只走 bump 分配，并发切块时不能把同一个 slot 发给两个线程
+    LockFreeMemoryPool freshPool;
+    freshPool.init(sizeof(PayloadLF));
+    std::vector<std::vector<void*>> carved(threadCount);
+    std::vector<std::thread> carvers;
+    carvers.reserve(threadCount);
+    for (std::size_t i = 0; i < threadCount; ++i)
+    {
+        carvers.emplace_back([&freshPool, &carved, i]() {
+            carved[i].reserve(iterationsPerThread);
+            if (i % 2 == 0)
+            {
+                for (std::size_t k = 0; k < iterationsPerThread; ++k)
+                {
+                    carved[i].push_back(freshPool.allocate());
+                }
+                return;
+            }
+            // 奇数线程按批切块，批次跨 block 边界时也要唯一
+            void* batch[37];
+            std::size_t want = 1;
+            while (carved[i].size() < iterationsPerThread)
+            {
+                std::size_t got = freshPool.allocateBatch(want, batch);
+                assert(got == want);
+                carved[i].insert(carved[i].end(), batch, batch + got);
+                want = want % 37 + 1;
+            }
+        });
+    }
+    for (auto& t : carvers)
+    {
+        t.join();
+    }
+
+    std::unordered_set<void*> unique;
+    for (const auto& slots : carved)
+    {
+        for (void* p : slots)
+        {
+            const bool fresh = unique.insert(p).second;
+            assert(fresh && "bump allocation handed out a slot twice");
+        }
+    }
+    std::cout << "Carved " << unique.size() << " distinct slots from a fresh lock-free pool\n";
+
+    // trim 与分配/释放并发：被释放的 block 不能再被任何线程写到
+    LockFreeMemoryPool churnPool;
+    churnPool.init(sizeof(PayloadLF));
+    std::atomic<bool> churning{true};
+    std::thread trimmer([&]() {
+        while (churning.load(std::memory_order_relaxed))
+        {
+            churnPool.trim();
+            std::this_thread::yield();
+        }
+    });
+
+    std::vector<std::thread> churners;
+    churners.reserve(threadCount);
+    for (std::size_t t = 0; t < threadCount; ++t)
+    {
+        churners.emplace_back([&churnPool, t]() {
+            std::vector<PayloadLF*> live;
+            live.reserve(512);
+            void* batch[64];
+            for (std::size_t round = 0; round < 50; ++round)
+            {
+                for (std::size_t k = 0; k < 512; k += 64)
+                {
+                    // 奇数线程走批量接口：整串摘下/挂回空闲链表
+                    std::size_t got = t % 2 == 1 ? churnPool.allocateBatch(64, batch) : 0;
+                    for (std::size_t j = 0; j < 64; ++j)
+                    {
+                        void* slot = j < got ? batch[j] : churnPool.allocate();
+                        const int value = static_cast<int>(t * 100000 + round * 512 + k + j);
+                        live.push_back(new (slot) PayloadLF(value));
+                    }
+                }
+                for (std::size_t k = 0; k < live.size(); k += 64)
+                {
+                    for (std::size_t j = 0; j < 64; ++j)
+                    {
+                        live[k + j]->~PayloadLF();
+                        batch[j] = live[k + j];
+                    }
+                    churnPool.deallocateBatch(64, batch);
+                }
+                live.clear();
+            }
+        });
+    }
+    for (auto& t : churners)
+    {
+        t.join();
+    }
+    churning.store(false, std::memory_order_relaxed);
+    trimmer.join();
+    // 计数按线程分片，stats() 汇总后不能丢失任何一次分配/释放
+    const PoolStats churnStats = churnPool.stats();
+    assert(churnStats.allocations == threadCount * 50 * 512);
+    assert(churnStats.frees == churnStats.allocations);
+    assert(churnStats.bytesOutstanding == 0);
+    std::cout << "Trimmed concurrently with " << threadCount << " churning threads\n";
+
     return 0;
 }
@@ -0,0 +1,112 @@
+#include "MemoryPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+using namespace memorypool;
+
+namespace
+{
+// Cell 是被反复弹出/压回的 slot，owner 字段用来发现同一 slot 被两个线程同时持有
+struct Cell
+{
+    Slot* next;  // overwritten by the free list while the cell is free
+    std::uintptr_t owner;
+};
+
+void stress(std::size_t stripes, std::size_t threadCount, std::size_t iterationsPerThread)
+{
+    // drive LockFreeMemoryPool directly: the thread caches in front of LockFreeHashBucket
+    // would absorb most of the churn and hide free list races
+    LockFreeMemoryPool pool;
+    pool.init(sizeof(Cell), 0, true, stripes);
+    assert(pool.stripeCount() == stripes);
+
+    constexpr std::size_t heldPerThread = 3;
+
+    std::atomic<std::size_t> duplicates{0};
+    std::atomic<bool> start{false};
+
+    // each round pops a few cells and pushes them back in a different order: this is the
+    // pop(A) pop(B) push(A) pattern that lets a stale CAS install an in-use `next`
+    auto worker = [&](std::size_t threadIndex) {
+        const std::uintptr_t id = threadIndex + 1;
+        Cell* held[heldPerThread];
+        while (!start.load(std::memory_order_acquire))
+        {
+            std::this_thread::yield();
+        }
+
+        for (std::size_t i = 0; i < iterationsPerThread; ++i)
+        {
+            for (std::size_t k = 0; k < heldPerThread; ++k)
+            {
+                held[k] = static_cast<Cell*>(pool.allocate());
+                held[k]->owner = id;
+            }
+            for (std::size_t k = 0; k < heldPerThread; ++k)
+            {
+                if (held[k]->owner != id)
+                {
+                    duplicates.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            for (std::size_t k = heldPerThread; k > 0; --k)
+            {
+                pool.deallocate(held[(k + i) % heldPerThread]);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(threadCount);
+    for (std::size_t i = 0; i < threadCount; ++i)
+    {
+        threads.emplace_back(worker, i);
+    }
+    start.store(true, std::memory_order_release);
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    assert(duplicates.load() == 0 && "a slot was handed to two threads at once");
+
+    // the free list must still be a proper list: every cell ever carved comes back exactly once
+    const std::size_t carvedUpperBound = threadCount * heldPerThread;
+    std::unordered_set<void*> seen;
+    std::vector<void*> drained;
+    for (std::size_t i = 0; i < carvedUpperBound; ++i)
+    {
+        void* p = pool.allocate();
+        const bool fresh = seen.insert(p).second;
+        assert(fresh && "free list contains a duplicate or a cycle");
+        drained.push_back(p);
+    }
+    for (void* p : drained)
+    {
+        pool.deallocate(p);
+    }
+}
+}  // namespace
+
+int main()
+{
+    const std::size_t threadCount = std::max<std::size_t>(8, std::thread::hardware_concurrency());
+    constexpr std::size_t iterationsPerThread = 200000;
+
+    // one free list head, then striped heads where pops also steal whole lists from other stripes
+    stress(1, threadCount, iterationsPerThread);
+    stress(8, threadCount, iterationsPerThread);
+
+    std::cout << "ABA stress: " << threadCount << " threads x " << iterationsPerThread
+              << " rounds, 1 and 8 stripes, no duplicate slots\n";
+    return 0;
+}
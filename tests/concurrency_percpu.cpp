@@ -0,0 +1,88 @@
+#include "MemoryPool.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace memorypool;
+
+namespace
+{
+// Record 带自校验字段，跨线程释放时能发现被其他线程覆盖的 slot
+struct Record
+{
+    explicit Record(std::size_t id) : id(id), check(~id) {}
+
+    ~Record()
+    {
+        assert(check == ~id);
+    }
+
+    std::size_t id;
+    std::size_t check;
+    unsigned char padding[48];
+};
+}  // namespace
+
+int main()
+{
+    // thread-per-connection 场景：大量短命线程，每个只做少量分配
+    constexpr std::size_t waves = 100;
+    constexpr std::size_t threadsPerWave = 32;
+    constexpr std::size_t objectsPerThread = 200;
+
+    std::atomic<std::size_t> totalAllocated{0};
+    std::vector<Record*> handoff(threadsPerWave * objectsPerThread, nullptr);
+
+    for (std::size_t wave = 0; wave < waves; ++wave)
+    {
+        std::vector<std::thread> threads;
+        threads.reserve(threadsPerWave);
+        for (std::size_t t = 0; t < threadsPerWave; ++t)
+        {
+            threads.emplace_back([&, wave, t]() {
+                Record** mine = &handoff[t * objectsPerThread];
+                for (std::size_t i = 0; i < objectsPerThread; ++i)
+                {
+                    // 释放上一波线程留下的对象，模拟跨线程释放
+                    if (mine[i] != nullptr)
+                    {
+                        deleteElementPerCpu(mine[i]);
+                    }
+                    mine[i] = newElementPerCpu<Record>((wave << 32) | (t * objectsPerThread + i));
+                    assert(mine[i] != nullptr);
+                }
+                totalAllocated.fetch_add(objectsPerThread, std::memory_order_relaxed);
+            });
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    for (Record* record : handoff)
+    {
+        deleteElementPerCpu(record);
+    }
+
+    // 所有对象归还后，再分配一轮不应拿到重复地址
+    std::vector<Record*> survivors;
+    for (std::size_t i = 0; i < handoff.size(); ++i)
+    {
+        survivors.push_back(newElementPerCpu<Record>(i));
+    }
+    for (std::size_t i = 0; i < survivors.size(); ++i)
+    {
+        assert(survivors[i]->id == i);
+        deleteElementPerCpu(survivors[i]);
+    }
+
+    std::cout << "Per-CPU threads: " << waves * threadsPerWave
+              << ", objects: " << totalAllocated.load(std::memory_order_relaxed)
+              << ", commit: " << (PerCpuHashBucket::usesRseq() ? "rseq" : "CAS") << "\n";
+    return 0;
+}
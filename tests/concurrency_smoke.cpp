@@ -3,7 +3,9 @@
 #include <atomic>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
 #include <iostream>
+#include <new>
 #include <thread>
 #include <vector>
 
@@ -81,5 +83,106 @@ int main()
     std::cout << "Allocated and freed " << totalAllocated.load(std::memory_order_relaxed)
               << " payloads across " << threadCount << " threads\n";
 
+    // 生产者/消费者：对象在生产者线程分配、在消费者线程释放，
+    // 释放的 slot 经远程释放队列回到生产者，而不是每次都走共享池
+    constexpr std::size_t pairCount = threadCount / 2;
+    constexpr std::size_t handoffsPerPair = 100000;
+    constexpr std::size_t ringCapacity = 256;
+    struct Ring
+    {
+        Payload* slots[ringCapacity];
+        alignas(64) std::atomic<std::size_t> head{0};
+        alignas(64) std::atomic<std::size_t> tail{0};
+    };
+    std::vector<Ring> rings(pairCount);
+    MemoryPool& payloadPool = HashBucket::getMemoryPool(SizeClass::index(sizeof(Payload)));
+    const std::uint64_t poolAllocationsBefore = payloadPool.stats().allocations;
+
+    std::vector<std::thread> pipeline;
+    for (std::size_t pair = 0; pair < pairCount; ++pair)
+    {
+        pipeline.emplace_back([&rings, pair]() {
+            Ring& ring = rings[pair];
+            for (std::size_t i = 0; i < handoffsPerPair; ++i)
+            {
+                Payload* node = newElement<Payload>(static_cast<int>(i));
+                const std::size_t tail = ring.tail.load(std::memory_order_relaxed);
+                while (tail - ring.head.load(std::memory_order_acquire) == ringCapacity)
+                {
+                    std::this_thread::yield();
+                }
+                ring.slots[tail % ringCapacity] = node;
+                ring.tail.store(tail + 1, std::memory_order_release);
+            }
+        });
+        pipeline.emplace_back([&rings, pair]() {
+            Ring& ring = rings[pair];
+            for (std::size_t i = 0; i < handoffsPerPair; ++i)
+            {
+                const std::size_t head = ring.head.load(std::memory_order_relaxed);
+                while (ring.tail.load(std::memory_order_acquire) == head)
+                {
+                    std::this_thread::yield();
+                }
+                Payload* node = ring.slots[head % ringCapacity];
+                ring.head.store(head + 1, std::memory_order_release);
+                assert(node->value == static_cast<int>(i));
+                deleteElement(node);
+            }
+        });
+    }
+    for (auto& t : pipeline)
+    {
+        t.join();
+    }
+
+    // 绝大多数分配由远程释放队列满足，共享池只在开头和队列为空时被访问
+    const std::uint64_t poolAllocations = payloadPool.stats().allocations - poolAllocationsBefore;
+    assert(poolAllocations < pairCount * handoffsPerPair / 4);
+    std::cout << "Handed off " << pairCount * handoffsPerPair << " payloads across " << pairCount
+              << " producer/consumer pairs, " << poolAllocations << " served by the shared pool\n";
+
+    // trim 与分配/释放并发：空闲链表在锁外遍历，被释放的 block 不能再被任何线程写到
+    MemoryPool churnPool;
+    churnPool.init(sizeof(Payload));
+    std::atomic<bool> churning{true};
+    std::thread trimmer([&]() {
+        while (churning.load(std::memory_order_relaxed))
+        {
+            churnPool.trim();
+            std::this_thread::yield();
+        }
+    });
+
+    std::vector<std::thread> churners;
+    churners.reserve(threadCount);
+    for (std::size_t t = 0; t < threadCount; ++t)
+    {
+        churners.emplace_back([&churnPool, t]() {
+            std::vector<Payload*> live;
+            live.reserve(512);
+            for (std::size_t round = 0; round < 50; ++round)
+            {
+                for (std::size_t k = 0; k < 512; ++k)
+                {
+                    live.push_back(new (churnPool.allocate()) Payload(static_cast<int>(t * 100000 + round * 512 + k)));
+                }
+                for (Payload* node : live)
+                {
+                    node->~Payload();
+                    churnPool.deallocate(node);
+                }
+                live.clear();
+            }
+        });
+    }
+    for (auto& t : churners)
+    {
+        t.join();
+    }
+    churning.store(false, std::memory_order_relaxed);
+    trimmer.join();
+    std::cout << "Trimmed concurrently with " << threadCount << " churning threads\n";
+
     return 0;
 }
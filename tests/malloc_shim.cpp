@@ -0,0 +1,178 @@
+#include "HeapProfiler.h"
+#include "MemoryPool.h"
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <malloc.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace memorypool;
+
+namespace
+{
+// OverAligned 走对齐版本的 operator new/delete
+struct alignas(128) OverAligned
+{
+    unsigned char bytes[200];
+};
+
+bool aligned(const void* p, std::size_t alignment)
+{
+    return reinterpret_cast<std::uintptr_t>(p) % alignment == 0;
+}
+}  // namespace
+
+int main()
+{
+    // malloc/free 经过内存池：usable size 来自页表记录的 size class
+    for (std::size_t size : {std::size_t(0), std::size_t(1), std::size_t(24), std::size_t(100),
+                             std::size_t(5000), std::size_t(MAX_SLOT_SIZE + 1), std::size_t(1) << 20})
+    {
+        void* p = std::malloc(size);
+        assert(p != nullptr && aligned(p, 16));
+        assert(HashBucket::usableSize(p) != 0 && "malloc was not routed through the pool");
+        assert(malloc_usable_size(p) >= size);
+        std::memset(p, 0xAB, malloc_usable_size(p));
+        std::free(p);
+    }
+
+    auto* zeroed = static_cast<unsigned char*>(std::calloc(300, 7));
+    for (std::size_t i = 0; i < 2100; ++i)
+    {
+        assert(zeroed[i] == 0);
+    }
+    std::free(zeroed);
+    volatile std::size_t halfMax = SIZE_MAX / 2;  // volatile so the compiler does not warn about the constant product
+    void* overflowed = std::calloc(halfMax, 4);
+    assert(overflowed == nullptr);
+
+    // 超大请求返回 NULL/ENOMEM，不会在页数换算时回绕成小块
+    for (std::size_t hugeSize : {SIZE_MAX, SIZE_MAX - 100, SIZE_MAX - 10000, SIZE_MAX / 2})
+    {
+        volatile std::size_t requested = hugeSize;
+        errno = 0;
+        void* hugeBlock = std::malloc(requested);
+        assert(hugeBlock == nullptr && errno == ENOMEM);
+        void* hugeAligned = nullptr;
+        const int rc = posix_memalign(&hugeAligned, 8192, requested);
+        assert(rc == ENOMEM && hugeAligned == nullptr);
+        errno = 0;
+        void* hugeAlignedAlloc = aligned_alloc(4096, requested);
+        assert(hugeAlignedAlloc == nullptr && errno == ENOMEM);
+        void* kept = std::malloc(64);
+        errno = 0;
+        void* hugeRealloc = std::realloc(kept, requested);
+        assert(hugeRealloc == nullptr && errno == ENOMEM);
+        std::free(kept);
+        void* hugeNew = operator new(requested, std::nothrow);
+        assert(hugeNew == nullptr);
+    }
+
+    // realloc 跨 size class 和大块时保留内容
+    auto* grown = static_cast<unsigned char*>(std::malloc(16));
+    for (std::size_t size = 16; size <= 256 * 1024; size *= 2)
+    {
+        for (std::size_t i = 0; i < 16; ++i)
+        {
+            grown[i] = static_cast<unsigned char>(i);
+        }
+        grown = static_cast<unsigned char*>(std::realloc(grown, size * 2));
+        for (std::size_t i = 0; i < 16; ++i)
+        {
+            assert(grown[i] == i);
+        }
+    }
+    std::free(grown);
+
+    // posix_memalign/aligned_alloc：小对齐走对齐的 size class，大对齐走页堆对齐 span
+    for (std::size_t alignment : {std::size_t(32), std::size_t(64), std::size_t(256), std::size_t(4096),
+                                  std::size_t(64) << 10, std::size_t(2) << 20})
+    {
+        void* p = nullptr;
+        const int rc = posix_memalign(&p, alignment, 100);
+        assert(rc == 0 && aligned(p, alignment));
+        std::memset(p, 0x11, 100);
+        std::free(p);
+
+        void* q = aligned_alloc(alignment, 3 * alignment);
+        assert(q != nullptr && aligned(q, alignment));
+        std::free(q);
+    }
+    void* bad = nullptr;
+    const int badRc = posix_memalign(&bad, 24, 8);
+    assert(badRc == EINVAL);
+
+    // operator new/delete 的各个重载
+    int* single = new int(7);
+    delete single;
+    int* array = new int[100]();
+    delete[] array;
+    OverAligned* over = new OverAligned();
+    assert(aligned(over, alignof(OverAligned)));
+    delete over;
+    OverAligned* overArray = new OverAligned[5];
+    assert(aligned(overArray, alignof(OverAligned)));
+    delete[] overArray;
+
+    std::map<int, std::string> table;
+    for (int i = 0; i < 10000; ++i)
+    {
+        table.emplace(i, std::string(static_cast<std::size_t>(i % 97), 'x'));
+    }
+    assert(table.size() == 10000 && table[96].size() == 96);
+    table.clear();
+
+    // fork 时另一个线程在持续分配：子进程里分配器必须仍然可用；
+    // 打开 heap profiler 让采样锁也处在竞争中，子进程的采样分配不能死锁
+    HeapProfiler::start(256);
+    std::atomic<bool> running{true};
+    std::thread churner([&running]() {
+        std::vector<void*> live;
+        while (running.load(std::memory_order_relaxed))
+        {
+            for (int i = 0; i < 64; ++i)
+            {
+                live.push_back(std::malloc(static_cast<std::size_t>(16 + i * 40)));
+            }
+            for (void* p : live)
+            {
+                std::free(p);
+            }
+            live.clear();
+        }
+    });
+    for (int round = 0; round < 20; ++round)
+    {
+        pid_t child = fork();
+        assert(child >= 0);
+        if (child == 0)
+        {
+            std::vector<std::string> strings(1000, std::string(100, 'c'));
+            void* big = std::malloc(1 << 20);
+            std::free(big);
+            _exit(strings.size() == 1000 && big != nullptr ? 0 : 1);
+        }
+        int status = 0;
+        waitpid(child, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    running.store(false, std::memory_order_relaxed);
+    churner.join();
+    HeapProfiler::stop();
+    HeapProfiler::reset();
+
+    std::cout << "malloc replacement passed, fork rounds: 20\n";
+    return 0;
+}
@@ -1,9 +1,33 @@
+#include "Arena.h"
+#include "HeapProfiler.h"
 #include "MemoryPool.h"
+#include "ObjectPool.h"
+#include "PoolAllocator.h"
+#include "PoolResource.h"
 
 #include <atomic>
 #include <cassert>
+#include <csignal>
+#include <cstdio>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
 
 using namespace memorypool;
 
@@ -21,15 +45,193 @@ struct Counted
 
 std::atomic<int> Counted::liveCount{0};
 
+// Shape/Circle/Square 通过基类指针删除，派生类大小各不相同
+struct Shape
+{
+    Shape() { ++live; }
+    virtual ~Shape() { --live; }
+    static int live;
+};
+
+int Shape::live = 0;
+
+struct Square : Shape
+{
+    double side[4]{};
+};
+
+struct Circle : Shape
+{
+    double points[64]{};
+};
+
 // AlignedPayload 测试高对齐需求的类型
 struct alignas(32) AlignedPayload
 {
     unsigned char buffer[32];
 };
+
+// 高对齐类型：缓存行计数器、AVX-512 缓冲区、整页对齐的缓冲区，以及超过一页的对齐
+struct alignas(64) CacheLineCounter
+{
+    std::uint64_t value;
+};
+
+struct alignas(64) Avx512Buffer
+{
+    float lanes[48];
+};
+
+struct alignas(4096) PageBuffer
+{
+    unsigned char bytes[100];
+};
+
+struct alignas(16384) HugeAligned
+{
+    unsigned char bytes[64];
+};
+
+// Reusable 构造代价高（预留缓冲区），由 ObjectPool 回收复用，reset() 只清空内容
+struct Reusable
+{
+    explicit Reusable(int tag = 0) : tag(tag)
+    {
+        buffer.reserve(256);
+        ++constructed;
+    }
+    ~Reusable() { ++destroyed; }
+    void reset()
+    {
+        buffer.clear();
+        ++resets;
+    }
+
+    int tag;
+    std::vector<char> buffer;
+
+    static int constructed;
+    static int destroyed;
+    static int resets;
+};
+
+int Reusable::constructed = 0;
+int Reusable::destroyed = 0;
+int Reusable::resets = 0;
+
+// Throwing 的构造函数在第二次调用时抛出
+struct Throwing
+{
+    Throwing()
+    {
+        if (++calls == 2)
+        {
+            throw std::runtime_error("constructor failed");
+        }
+    }
+
+    static int calls;
+};
+
+int Throwing::calls = 0;
+
+// FailingReset 的 reset() 在 fail 置位时抛出，对象应被销毁而不是回收
+struct FailingReset
+{
+    ~FailingReset() { ++destroyed; }
+    void reset()
+    {
+        if (fail)
+        {
+            throw std::runtime_error("reset failed");
+        }
+    }
+
+    bool fail = false;
+    static int destroyed;
+};
+
+int FailingReset::destroyed = 0;
+
+// 每个 block 里最低的 slot 相对 span 起点的偏移，按 block 出现的顺序排列
+template<typename Pool>
+std::vector<std::size_t> firstSlotOffsets(Pool& pool, std::size_t count)
+{
+    std::map<std::uintptr_t, std::uintptr_t> lowest;
+    std::vector<std::uintptr_t> order;
+    std::vector<void*> slots;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        void* p = pool.allocate();
+        slots.push_back(p);
+        auto start = reinterpret_cast<std::uintptr_t>(PageHeap::instance().spanOf(p)->start());
+        auto address = reinterpret_cast<std::uintptr_t>(p);
+        auto found = lowest.find(start);
+        if (found == lowest.end())
+        {
+            lowest.emplace(start, address);
+            order.push_back(start);
+        }
+        else if (address < found->second)
+        {
+            found->second = address;
+        }
+    }
+    for (void* p : slots)
+    {
+        pool.deallocate(p);
+    }
+    std::vector<std::size_t> offsets;
+    for (std::uintptr_t start : order)
+    {
+        offsets.push_back(lowest[start] - start);
+    }
+    return offsets;
+}
+
+bool isAligned(const void* p, std::size_t alignment)
+{
+    return reinterpret_cast<std::uintptr_t>(p) % alignment == 0;
+}
+
+// 每种桶都分配一批 T，覆盖多个 block，逐个检查对齐
+template<typename T>
+void checkAlignedElements()
+{
+    std::vector<T*> objects;
+    for (int i = 0; i < 200; ++i)
+    {
+        objects.push_back(newElement<T>());
+        objects.push_back(newElementLockFree<T>());
+        objects.push_back(newElementPerCpu<T>());
+    }
+    for (T* object : objects)
+    {
+        assert(object != nullptr && isAligned(object, alignof(T)));
+    }
+    for (std::size_t i = 0; i < objects.size(); i += 3)
+    {
+        deleteElement(objects[i]);
+        deleteElementLockFree(objects[i + 1]);
+        deleteElementPerCpu(objects[i + 2]);
+    }
+}
 }  // namespace
 
 int main()
 {
+    // per-class block sizes and huge-page backed regions are set before first use：首次使用前配置
+    PoolConfig config;
+    config.blockSize[SizeClass::index(512)] = 64 * 1024;
+    config.hugePages = HugePageMode::Transparent;
+    const bool applied = HashBucket::initMemoryPool(config);
+    const bool reapplied = HashBucket::initMemoryPool(config);
+    assert(applied);
+    assert(!reapplied && "configuration only applies once");
+    assert(HashBucket::getMemoryPool(SizeClass::index(512)).blockSize() == 64 * 1024);
+    assert(HashBucket::getMemoryPool(SizeClass::index(8)).blockSize() == PoolConfig::defaultBlockSize(SizeClass::index(8)));
+    assert(PoolConfig::defaultBlockSize(SizeClass::index(512)) >= DEFAULT_SLOTS_PER_BLOCK * 512);
+
     HashBucket::ensureInitialized();
     LockFreeHashBucket::ensureInitialized();
 
@@ -45,6 +247,23 @@ int main()
     HashBucket::freeMemory(slotB, 8);
     HashBucket::freeMemory(slotC, 8);
 
+    // thread caches are flushed back to the shared pool when their thread exits：线程退出时缓存归还
+    void* cachedSlot = nullptr;
+    std::thread([&cachedSlot]() {
+        cachedSlot = HashBucket::useMemory(24);
+        HashBucket::freeMemory(cachedSlot, 24);
+    }).join();
+    MemoryPool& pool24 = HashBucket::getMemoryPool(SizeClass::index(24));
+    std::vector<void*> drained;
+    bool returned = false;
+    for (int i = 0; i < 2 * THREAD_CACHE_MAX_BATCH && !returned; ++i)
+    {
+        drained.push_back(pool24.allocate());
+        returned = drained.back() == cachedSlot;
+    }
+    assert(returned && "exited thread should flush its cache");
+    pool24.deallocateBatch(drained.size(), drained.data());
+
     // placement new helper should invoke constructors/destructors：newElement/deleteElement 应维护对象生命周期
     Counted::liveCount.store(0, std::memory_order_relaxed);
     Counted* counted = newElement<Counted>();
@@ -53,7 +272,141 @@ int main()
     deleteElement(counted);
     assert(Counted::liveCount.load(std::memory_order_relaxed) == 0);
 
-    // requests larger than MAX_SLOT_SIZE should fall back to global new/delete：超大尺寸应走全局分配
+    // size classes：每个尺寸映射到能容纳它的最小 class，碎片有上界
+    for (std::size_t size = 1; size <= MAX_SLOT_SIZE; ++size)
+    {
+        int index = SizeClass::index(size);
+        assert(SizeClass::size(index) >= size);
+        assert(index == 0 || SizeClass::size(index - 1) < size);
+        assert(SizeClass::size(index) - size <= SizeClass::maxWaste(index));
+        assert(size <= SIZE_CLASS_FINE_LIMIT || (SizeClass::size(index) - size) * (SIZE_CLASS_STEPS_PER_DOUBLING + 1) < SizeClass::size(index));
+    }
+    assert(SizeClass::size(SizeClass::kNumClasses - 1) == MAX_SLOT_SIZE);
+
+    // message-buffer sized requests are pooled now
+    for (std::size_t size : {600u, 4096u, 8192u, 32768u})
+    {
+        void* buffer = HashBucket::useMemory(size);
+        assert(buffer != nullptr);
+        std::memset(buffer, 0xAB, size);
+        HashBucket::freeMemory(buffer, size);
+        void* reused = HashBucket::useMemory(size);
+        assert(reused == buffer);
+        HashBucket::freeMemory(reused, size);
+    }
+
+    // requests larger than MAX_SLOT_SIZE are page heap spans：超大尺寸走页堆，相邻空闲 span 会合并
+    PageHeap& pageHeap = PageHeap::instance();
+    const std::size_t largeSize = 40 * PAGE_HEAP_PAGE_SIZE;
+    void* largeA = HashBucket::useMemory(largeSize);
+    void* largeB = HashBucket::useMemory(largeSize);
+    assert(reinterpret_cast<std::uintptr_t>(largeA) % PAGE_HEAP_PAGE_SIZE == 0);
+    assert(static_cast<char*>(largeB) == static_cast<char*>(largeA) + largeSize);
+    const std::size_t reservedBefore = pageHeap.reservedBytes();
+    HashBucket::freeMemory(largeA, largeSize);
+    HashBucket::freeMemory(largeB, largeSize);
+    void* merged = HashBucket::useMemory(2 * largeSize);
+    assert(merged == largeA && "adjacent free spans should coalesce");
+    HashBucket::freeMemory(merged, 2 * largeSize);
+    for (int i = 0; i < 1000; ++i)
+    {
+        const std::size_t churnSize = largeSize + static_cast<std::size_t>(i % 7) * PAGE_HEAP_PAGE_SIZE;
+        void* churn = HashBucket::useMemory(churnSize);
+        HashBucket::freeMemory(churn, churnSize);
+    }
+    assert(pageHeap.reservedBytes() == reservedBefore && "span churn should not map new regions");
+
+    // 页数换算溢出的请求抛 bad_alloc，而不是回绕成很小的 span
+    for (std::size_t hugeSize : {SIZE_MAX, SIZE_MAX - 100, SIZE_MAX - PAGE_HEAP_PAGE_SIZE + 1, SIZE_MAX / 2})
+    {
+        bool threw = false;
+        try
+        {
+            pageHeap.allocateLarge(hugeSize);
+        }
+        catch (const std::bad_alloc&)
+        {
+            threw = true;
+        }
+        assert(threw);
+        threw = false;
+        try
+        {
+            pageHeap.allocateLarge(hugeSize, 8 * PAGE_HEAP_PAGE_SIZE);
+        }
+        catch (const std::bad_alloc&)
+        {
+            threw = true;
+        }
+        assert(threw);
+    }
+
+    // 归还的 block span 不再映射内部页，spanOf 不会返回过期的 span
+    void* blockSpan = pageHeap.allocatePages(4, 64);
+    char* blockInterior = static_cast<char*>(blockSpan) + 2 * PAGE_HEAP_PAGE_SIZE;
+    assert(pageHeap.spanOf(blockInterior) == pageHeap.spanOf(blockSpan));
+    pageHeap.deallocate(blockSpan);
+    assert(pageHeap.spanOf(blockInterior) == nullptr);
+
+    // trim：完全空闲的 block 归还页堆，空闲页再 madvise 还给 OS
+    {
+        MemoryPool trimPool;
+        trimPool.init(64);
+        LockFreeMemoryPool trimPoolLF;
+        trimPoolLF.init(64);
+        std::vector<void*> slots(4096);
+        std::vector<void*> slotsLF(4096);
+        for (std::size_t i = 0; i < slots.size(); ++i)
+        {
+            slots[i] = trimPool.allocate();
+            slotsLF[i] = trimPoolLF.allocate();
+        }
+
+        void* pinned = slots[slots.size() / 2];  // one live slot keeps its block
+        slots[slots.size() / 2] = slots.back();
+        slots.pop_back();
+        trimPool.deallocateBatch(slots.size(), slots.data());
+        trimPoolLF.deallocateBatch(slotsLF.size(), slotsLF.data());
+
+        const std::size_t trimmed = trimPool.trim();
+        assert(trimmed >= 60 * PAGE_HEAP_PAGE_SIZE && "empty blocks should be released");
+        const std::size_t trimmedAgain = trimPool.trim();
+        assert(trimmedAgain == 0 && "nothing left to trim");
+        const std::size_t trimmedLF = trimPoolLF.trim();
+        assert(trimmedLF >= 60 * PAGE_HEAP_PAGE_SIZE);
+        std::memset(pinned, 0x5A, 64);
+
+        // the trimmed pools keep working
+        slots.assign(slotsLF.size(), nullptr);
+        for (std::size_t i = 0; i < slotsLF.size(); ++i)
+        {
+            slots[i] = trimPool.allocate();
+            slotsLF[i] = trimPoolLF.allocate();
+            std::memset(slots[i], 0x11, 64);
+            std::memset(slotsLF[i], 0x22, 64);
+        }
+        assert(static_cast<unsigned char*>(pinned)[63] == 0x5A);
+        trimPool.deallocate(pinned);
+        trimPool.deallocateBatch(slots.size(), slots.data());
+        trimPoolLF.deallocateBatch(slotsLF.size(), slotsLF.data());
+
+        std::vector<void*> bucketSlots(8192);
+        for (auto& p : bucketSlots)
+        {
+            p = HashBucket::useMemory(256);
+        }
+        for (void* p : bucketSlots)
+        {
+            HashBucket::freeMemory(p, 256);
+        }
+        HashBucket::trim();
+        assert(pageHeap.releasedBytes() > 0);
+
+        startScavenger(std::chrono::milliseconds(5));
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        stopScavenger();
+    }
+
     void* bigBlock = HashBucket::useMemory(MAX_SLOT_SIZE + 128);
     assert(bigBlock != nullptr);
     HashBucket::freeMemory(bigBlock, MAX_SLOT_SIZE + 128);
@@ -64,6 +417,45 @@ int main()
     assert(alignedAddr % alignof(AlignedPayload) == 0);
     deleteElement(aligned);
 
+    // over-aligned types：newElement/useMemory 保证 alignof(T)，直到一页由 size class 满足，更大走页堆
+    {
+        checkAlignedElements<CacheLineCounter>();
+        checkAlignedElements<Avx512Buffer>();
+        checkAlignedElements<PageBuffer>();
+        checkAlignedElements<HugeAligned>();
+
+        for (std::size_t alignment = 16; alignment <= 64 * 1024; alignment *= 2)
+        {
+            for (std::size_t size : {std::size_t(1), std::size_t(100), alignment + 8, std::size_t(20000),
+                                     std::size_t(MAX_SLOT_SIZE), std::size_t(MAX_SLOT_SIZE + 1)})
+            {
+                void* p = HashBucket::useMemory(size, alignment);
+                assert(p != nullptr && isAligned(p, alignment));
+                assert(HashBucket::usableSize(p) >= size);
+                std::memset(p, 0x3C, size);
+                HashBucket::freeMemory(p, size, alignment);
+
+                void* q = LockFreeHashBucket::useMemory(size, alignment);
+                assert(q != nullptr && isAligned(q, alignment));
+                LockFreeHashBucket::freeMemory(q);
+            }
+        }
+        assert(SizeClass::alignedIndex(100, 64) >= 0);
+        assert(SizeClass::size(SizeClass::alignedIndex(100, 64)) % 64 == 0);
+        assert(SizeClass::alignedIndex(100, 2 * PAGE_HEAP_PAGE_SIZE) == -1);
+        void* misaligned = HashBucket::useMemory(64, 48);
+        assert(misaligned == nullptr);  // 非 2 的幂的对齐不会被悄悄满足
+
+        CacheLineCounter* counters[16];
+        const std::size_t constructed = newElements<CacheLineCounter>(16, counters);
+        assert(constructed == 16);
+        for (CacheLineCounter* counter : counters)
+        {
+            assert(isAligned(counter, 64));
+        }
+        deleteElements(16, counters);
+    }
+
     // lock-free pool should mirror the locking variant's semantics
     void* lfSlotA = LockFreeHashBucket::useMemory(8);
     void* lfSlotB = LockFreeHashBucket::useMemory(8);
@@ -90,6 +482,690 @@ int main()
     assert(alignedLFAddr % alignof(AlignedPayload) == 0);
     deleteElementLockFree(alignedLF);
 
+    // batch allocate/free：一次拿一串 slot，跨 block 切分也不能重复
+    {
+        LockFreeMemoryPool batchPool;
+        batchPool.init(64, 4096);
+        std::vector<void*> batch(1000);
+        const std::size_t carved = batchPool.allocateBatch(batch.size(), batch.data());
+        assert(carved == batch.size());
+        std::unordered_set<void*> distinct(batch.begin(), batch.end());
+        assert(distinct.size() == batch.size());
+        batchPool.deallocateBatch(batch.size(), batch.data());
+        // the free list is detached, 10 slots kept, the rest spliced back
+        void* again[10];
+        const std::size_t regot = batchPool.allocateBatch(10, again);
+        assert(regot == 10);
+        for (void* p : again)
+        {
+            assert(distinct.count(p) == 1);
+        }
+        batchPool.deallocateBatch(10, again);
+        // 峰值在分配路径上按分片记录：此前从未调用 stats()，1000 个 slot 的突发也要算进来
+        assert(batchPool.stats().peakBytesOutstanding == 1000 * batchPool.slotSize());
+
+        MemoryPool lockedPool;
+        lockedPool.init(64, 4096);
+        const std::size_t locked = lockedPool.allocateBatch(batch.size(), batch.data());
+        assert(locked == batch.size());
+        assert(std::unordered_set<void*>(batch.begin(), batch.end()).size() == batch.size());
+        lockedPool.deallocateBatch(batch.size(), batch.data());
+
+        void* burst[256];
+        std::size_t got = HashBucket::allocateBatch(96, 256, burst);
+        assert(got == 256);
+        for (void* p : burst)
+        {
+            std::memset(p, 0x3C, 96);
+        }
+        HashBucket::deallocateBatch(96, 256, burst);
+        got = LockFreeHashBucket::allocateBatch(96, 256, burst);
+        assert(got == 256);
+        LockFreeHashBucket::deallocateBatch(96, 256, burst);
+        got = HashBucket::allocateBatch(MAX_SLOT_SIZE + 1, 4, burst);
+        assert(got == 4);
+        HashBucket::deallocateBatch(MAX_SLOT_SIZE + 1, 4, burst);
+
+        // 只走批量接口的线程也要激活并登记自己的 cache，退出时计数才会汇总进来
+        const int burstIndex = SizeClass::index(96);
+        const BucketStats beforeBurst = HashBucket::getStats();
+        void* handed[64];
+        std::size_t handedCount = 0;
+        std::thread([&]() { handedCount = HashBucket::allocateBatch(96, 64, handed); }).join();
+        assert(handedCount == 64);
+        HashBucket::deallocateBatch(96, handedCount, handed);
+        const BucketStats afterBurst = HashBucket::getStats();
+        assert(afterBurst.classes[burstIndex].allocations == beforeBurst.classes[burstIndex].allocations + 64);
+        assert(afterBurst.classes[burstIndex].frees == beforeBurst.classes[burstIndex].frees + 64);
+
+        Counted::liveCount.store(0, std::memory_order_relaxed);
+        Counted* objects[32];
+        got = newElements<Counted>(32, objects);
+        assert(got == 32);
+        assert(Counted::liveCount.load(std::memory_order_relaxed) == 32);
+        deleteElements(32, objects);
+        got = newElementsLockFree<Counted>(32, objects);
+        assert(got == 32);
+        deleteElementsLockFree(32, objects);
+        assert(Counted::liveCount.load(std::memory_order_relaxed) == 0);
+    }
+
+    // unsized free：只凭指针就能找到 size class，基类指针删除派生对象也正确
+    {
+        const std::size_t sizes[] = {1, 8, 24, 100, 129, 600, 4096, MAX_SLOT_SIZE, MAX_SLOT_SIZE + 1, 200000};
+        for (std::size_t size : sizes)
+        {
+            void* p = HashBucket::useMemory(size);
+            assert(HashBucket::usableSize(p) >= size);
+            if (size <= MAX_SLOT_SIZE)
+            {
+                assert(HashBucket::usableSize(p) == SizeClass::size(SizeClass::index(size)));
+            }
+            std::memset(p, 0x7E, HashBucket::usableSize(p));
+            HashBucket::freeMemory(p);
+
+            void* q = LockFreeHashBucket::useMemory(size);
+            assert(LockFreeHashBucket::usableSize(q) >= size);
+            LockFreeHashBucket::freeMemory(q);
+        }
+        // the slot freed without a size goes back to the right class
+        void* first = HashBucket::useMemory(200);
+        HashBucket::freeMemory(first);
+        void* again = HashBucket::useMemory(200);
+        assert(again == first);
+        HashBucket::freeMemory(again, 200);
+        assert(HashBucket::usableSize(&sizes) == 0);
+
+        // a pointer the heap never handed out aborts with a message instead of crashing on a null span
+        const pid_t child = fork();
+        if (child == 0)
+        {
+            std::freopen("/dev/null", "w", stderr);
+            HashBucket::freeMemory(const_cast<std::size_t*>(sizes));
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(child, &status, 0);
+        assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+
+        Shape* shapes[3] = {newElement<Square>(), newElement<Circle>(), newElement<Square>()};
+        assert(Shape::live == 3);
+        for (Shape* shape : shapes)
+        {
+            deleteElement(shape);  // sizeof(Shape) < sizeof(Circle)
+        }
+        assert(Shape::live == 0);
+        void* reused = HashBucket::useMemory(sizeof(Circle));
+        assert(HashBucket::usableSize(reused) >= sizeof(Circle));
+        HashBucket::freeMemory(reused);
+    }
+
+    // STL allocator：容器节点来自内存池，rebind 后仍然相等
+    {
+        std::map<int, std::string, std::less<int>, PoolAllocator<std::pair<const int, std::string>>> map;
+        std::list<int, LockFreePoolAllocator<int>> list;
+        std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, PoolAllocator<std::pair<const int, int>>> hash;
+        for (int i = 0; i < 5000; ++i)
+        {
+            map.emplace(i, std::to_string(i));
+            list.push_back(i);
+            hash.emplace(i, -i);
+        }
+        assert(map.size() == 5000 && map[4999] == "4999");
+        assert(list.size() == 5000 && list.back() == 4999);
+        assert(hash.size() == 5000 && hash[17] == -17);
+        for (int i = 0; i < 5000; i += 2)
+        {
+            map.erase(i);
+            hash.erase(i);
+        }
+        list.clear();
+        assert(map.size() == 2500 && hash.size() == 2500);
+
+        PoolAllocator<int> intAlloc;
+        PoolAllocator<double> doubleAlloc(intAlloc);
+        assert(intAlloc == doubleAlloc);
+        using Traits = std::allocator_traits<PoolAllocator<int>>;
+        static_assert(std::is_same<Traits::rebind_alloc<long>, PoolAllocator<long>>::value, "rebind");
+        static_assert(Traits::is_always_equal::value, "stateless");
+        int* node = Traits::allocate(intAlloc, 1);
+        assert(HashBucket::usableSize(node) == SizeClass::size(SizeClass::index(sizeof(int))));
+        Traits::deallocate(intAlloc, node, 1);
+        int* array = Traits::allocate(intAlloc, 20000);  // above MAX_SLOT_SIZE: a page heap span
+        assert(HashBucket::usableSize(array) >= 20000 * sizeof(int));
+        Traits::deallocate(intAlloc, array, 20000);
+        // 零长度请求是合法的：返回互不相同的非空指针，而不是抛 bad_alloc
+        int* empty = Traits::allocate(intAlloc, 0);
+        int* otherEmpty = Traits::allocate(intAlloc, 0);
+        assert(empty != nullptr && otherEmpty != nullptr && empty != otherEmpty);
+        Traits::deallocate(intAlloc, empty, 0);
+        Traits::deallocate(intAlloc, otherEmpty, 0);
+        AlignedPayload* alignedEmpty = PoolAllocator<AlignedPayload>().allocate(0);
+        assert(reinterpret_cast<std::uintptr_t>(alignedEmpty) % alignof(AlignedPayload) == 0);
+        PoolAllocator<AlignedPayload>().deallocate(alignedEmpty, 0);
+
+        PoolAllocator<AlignedPayload> alignedAlloc;
+        AlignedPayload* alignedArray = alignedAlloc.allocate(3);
+        assert(reinterpret_cast<std::uintptr_t>(alignedArray) % alignof(AlignedPayload) == 0);
+        alignedAlloc.deallocate(alignedArray, 3);
+    }
+
+    // per-CPU bucket：每个 CPU 一条空闲链表，接口与其他 bucket 一致
+    {
+        Counted::liveCount.store(0, std::memory_order_relaxed);
+        Counted* countedPC = newElementPerCpu<Counted>();
+        assert(countedPC != nullptr);
+        assert(Counted::liveCount.load(std::memory_order_relaxed) == 1);
+        deleteElementPerCpu(countedPC);
+        assert(Counted::liveCount.load(std::memory_order_relaxed) == 0);
+
+        // churn well past the per-CPU list limit so refills and flushes both run
+        std::vector<void*> pcSlots;
+        for (int i = 0; i < 1000; ++i)
+        {
+            void* p = PerCpuHashBucket::useMemory(48);
+            assert(p != nullptr);
+            std::memset(p, 0x5A, 48);
+            pcSlots.push_back(p);
+        }
+        for (void* p : pcSlots)
+        {
+            PerCpuHashBucket::freeMemory(p, 48);
+        }
+
+        void* bigBlockPC = PerCpuHashBucket::useMemory(MAX_SLOT_SIZE + 512);
+        assert(bigBlockPC != nullptr);
+        PerCpuHashBucket::freeMemory(bigBlockPC, MAX_SLOT_SIZE + 512);
+
+        PerCpuHashBucket::trim();
+        std::cout << "Per-CPU commit: " << (PerCpuHashBucket::usesRseq() ? "rseq" : "CAS") << "\n";
+    }
+
+    // statistics：每个 size class 的分配/释放计数、峰值与预留字节
+    {
+        const int statIndex = SizeClass::index(200);
+        BucketStats before = HashBucket::getStats();
+        std::vector<void*> statSlots;
+        for (int i = 0; i < 300; ++i)
+        {
+            statSlots.push_back(HashBucket::useMemory(200));
+        }
+        void* bigStat = HashBucket::useMemory(MAX_SLOT_SIZE + 1);
+        BucketStats during = HashBucket::getStats();
+        const PoolStats& pool = during.classes[statIndex];
+        assert(pool.slotSize == SizeClass::size(statIndex));
+        assert(pool.allocations - before.classes[statIndex].allocations == 300);
+        assert(pool.bytesInUse >= 300 * pool.slotSize);
+        assert(pool.bytesOutstanding >= pool.bytesInUse);
+        assert(pool.peakBytesOutstanding >= pool.bytesOutstanding);
+        assert(pool.blocksOwned >= 1 && pool.bytesReserved == pool.blocksOwned * pool.blockSize);
+        assert(during.largeAllocations == before.largeAllocations + 1);
+        assert(during.pageHeapReservedBytes >= pool.bytesReserved);
+
+        for (void* p : statSlots)
+        {
+            HashBucket::freeMemory(p, 200);
+        }
+        HashBucket::freeMemory(bigStat);
+        BucketStats after = HashBucket::getStats();
+        assert(after.classes[statIndex].frees - before.classes[statIndex].frees == 300);
+        assert(after.classes[statIndex].peakBytesOutstanding >= pool.peakBytesOutstanding);
+        assert(after.largeFrees == before.largeFrees + 1);
+
+        // counts of an exited thread are kept
+        const PoolStats lockFreeBefore = LockFreeHashBucket::getStats().classes[SizeClass::index(24)];
+        std::thread statThread([]() {
+            void* p = LockFreeHashBucket::useMemory(24);
+            LockFreeHashBucket::freeMemory(p, 24);
+        });
+        statThread.join();
+        const PoolStats lockFreeAfter = LockFreeHashBucket::getStats().classes[SizeClass::index(24)];
+        assert(lockFreeAfter.allocations == lockFreeBefore.allocations + 1);
+        assert(lockFreeAfter.frees == lockFreeBefore.frees + 1);
+
+        std::ostringstream text;
+        std::ostringstream json;
+        dumpStats(text, after);
+        dumpStatsJson(json, after);
+        assert(text.str().find("page heap:") != std::string::npos);
+        assert(json.str().front() == '{' && json.str().find("\"peak_bytes_outstanding\"") != std::string::npos);
+        std::cout << "Stats dump:\n" << text.str();
+    }
+
+    // object pool：释放的对象保持构造状态，reset() 后再次分配，不重新构造
+    {
+        {
+            ObjectPool<Reusable> pool(4);
+            Reusable* first = pool.acquire(7);
+            assert(first->tag == 7 && first->buffer.capacity() >= 256);
+            first->buffer.assign(100, 'x');
+            pool.release(first);
+            assert(Reusable::resets == 1 && pool.idleCount() == 1);
+
+            Reusable* again = pool.acquire(9);  // recycled: same object, arguments ignored
+            assert(again == first && again->tag == 7);
+            assert(again->buffer.empty() && again->buffer.capacity() >= 256);
+            assert(Reusable::constructed == 1 && Reusable::destroyed == 0);
+
+            {
+                ObjectPool<Reusable>::Handle handle = pool.make(3);
+                assert(handle->tag == 3 && Reusable::constructed == 2);
+            }
+            assert(pool.idleCount() == 1);
+            pool.release(again);
+
+            pool.reserve(10);  // bounded by maxIdle
+            assert(pool.idleCount() == 4 && Reusable::constructed == 4);
+            std::vector<Reusable*> many;
+            for (int i = 0; i < 6; ++i)
+            {
+                many.push_back(pool.acquire());
+            }
+            assert(Reusable::constructed == 6 && pool.idleCount() == 0);
+            for (Reusable* object : many)
+            {
+                pool.release(object);
+            }
+            assert(pool.idleCount() == 4 && Reusable::destroyed == 2);  // the overflow is destroyed
+        }
+        assert(Reusable::destroyed == Reusable::constructed);
+
+        ObjectPool<Throwing> throwingPool;
+        Throwing* okay = throwingPool.acquire();
+        bool threw = false;
+        try
+        {
+            throwingPool.acquire();
+        }
+        catch (const std::runtime_error&)
+        {
+            threw = true;
+        }
+        assert(threw && throwingPool.idleCount() == 0);
+        throwingPool.release(okay);
+
+        ObjectPool<FailingReset> resetPool;
+        FailingReset* kept = resetPool.acquire();
+        resetPool.release(kept);
+        assert(resetPool.idleCount() == 1 && FailingReset::destroyed == 0);
+        {
+            ObjectPool<FailingReset>::Handle broken = resetPool.make();
+            assert(broken.get() == kept);
+            broken->fail = true;
+        }  // the deleter is noexcept: the throwing reset() must not reach it
+        assert(resetPool.idleCount() == 0 && FailingReset::destroyed == 1);
+
+        ObjectPool<AlignedPayload, LockFreeHashBucket> alignedPool;
+        ObjectPool<AlignedPayload, LockFreeHashBucket>::Handle alignedHandle = alignedPool.make();
+        assert(isAligned(alignedHandle.get(), alignof(AlignedPayload)));
+    }
+
+    // cache coloring：新 block 的首个 slot 在 block 剩余空间里按 64 字节轮转，slot 数与对齐不变
+    {
+        // 200 字节 slot、8 KB block：40 个 slot 之后剩 184 字节，3 种颜色
+        MemoryPool colored;
+        colored.init(200, 8192);
+        LockFreeMemoryPool coloredLF;
+        coloredLF.init(200, 8192);
+        MemoryPool plain;
+        plain.init(200, 8192, false);
+        for (auto offsets : {firstSlotOffsets(colored, 40 * 6), firstSlotOffsets(coloredLF, 40 * 6)})
+        {
+            assert(offsets.size() == 6);
+            assert(std::unordered_set<std::size_t>(offsets.begin(), offsets.end()).size() == 3);
+            for (std::size_t offset : offsets)
+            {
+                assert(offset >= 8 && offset <= 8 + 184 && (offset - 8) % BLOCK_COLOR_STEP == 0);
+            }
+        }
+        std::vector<std::size_t> plainOffsets = firstSlotOffsets(plain, 40 * 6);
+        assert(plainOffsets.size() == 6);
+        assert(std::unordered_set<std::size_t>(plainOffsets.begin(), plainOffsets.end()).size() == 1);
+
+        // 步长不小于 slot 的对齐，4 KB 对齐的 class 照样对齐
+        MemoryPool pageSlots;
+        pageSlots.init(4096, 64 * 1024);
+        for (std::size_t offset : firstSlotOffsets(pageSlots, 200))
+        {
+            assert(offset % 4096 == 0);
+        }
+    }
+
+    // block-local free lists：每个 block 自己的空闲链表，优先从最满的 block 分配，整块空闲的 block 可以直接归还
+    {
+        MemoryPool local;
+        local.init(64, 4096, true, true);
+        const std::size_t perBlock = (4096 - 64) / 64;  // 64 字节对齐的 body 放在 block 头之后
+        std::vector<void*> slots(perBlock * 16);
+        for (void*& p : slots)
+        {
+            p = local.allocate();
+            std::memset(p, 0x3C, 64);
+        }
+        auto spanStart = [](void* p) { return PageHeap::instance().spanOf(p)->start(); };
+        std::unordered_set<void*> spans;
+        for (void* p : slots)
+        {
+            spans.insert(spanStart(p));
+        }
+        assert(spans.size() == 16);
+
+        // block 0..7 只留一个存活 slot，block 14 只空出两个：接下来的分配先填满 block 14
+        for (std::size_t b = 0; b < 8; ++b)
+        {
+            for (std::size_t i = 1; i < perBlock; ++i)
+            {
+                local.deallocate(slots[b * perBlock + i]);
+                slots[b * perBlock + i] = nullptr;
+            }
+        }
+        void* nearlyFull = spanStart(slots[14 * perBlock]);
+        local.deallocate(slots[14 * perBlock + 3]);
+        local.deallocate(slots[14 * perBlock + 9]);
+        slots[14 * perBlock + 3] = local.allocate();
+        slots[14 * perBlock + 9] = local.allocate();
+        assert(spanStart(slots[14 * perBlock + 3]) == nearlyFull && spanStart(slots[14 * perBlock + 9]) == nearlyFull);
+        void* next = local.allocate();
+        assert(spanStart(next) != nearlyFull);
+        local.deallocate(next);
+
+        for (void* p : slots)
+        {
+            local.deallocate(p);
+        }
+        const std::size_t trimmedLocal = local.trim();
+        assert(trimmedLocal == 15 * local.blockSize());  // every block but the current one
+        PoolStats localStats = local.stats();
+        assert(localStats.blocksOwned == 1 && localStats.allocations == localStats.frees);
+
+        std::vector<void*> batch(200);
+        const std::size_t carvedLocal = local.allocateBatch(batch.size(), batch.data());
+        assert(carvedLocal == batch.size());
+        std::unordered_set<void*> unique(batch.begin(), batch.end());
+        assert(unique.size() == batch.size());
+        local.deallocateBatch(batch.size(), batch.data());
+    }
+
+    // reserve/warm-up：提前切好 block 并预先触发缺页，之后的分配不再向页堆要 block，trim 也保留它们
+    {
+        for (bool blockLocal : {false, true})
+        {
+            MemoryPool warm;
+            warm.init(96, 4096, true, blockLocal);
+            const std::size_t added = warm.reserve(500);
+            assert(added >= 500);
+            const std::uint64_t refills = warm.stats().blockRefills;
+            std::vector<void*> slots;
+            for (std::size_t i = 0; i < added; ++i)
+            {
+                slots.push_back(warm.allocate());
+            }
+            assert(warm.stats().blockRefills == refills);
+            for (void* p : slots)
+            {
+                warm.deallocate(p);
+            }
+            warm.trim();
+            assert(warm.stats().blocksOwned >= refills - 1);  // the block carved before reserve() may go
+
+            try
+            {
+                warm.reserve(100, true);
+            }
+            catch (const std::system_error&)
+            {
+                std::cout << "mlock not permitted, reserve(lockPages) skipped\n";
+            }
+        }
+
+        const int warmIndex = SizeClass::index(200);
+        const std::size_t reservedBytes = HashBucket::reserve(200, 1000);
+        assert(reservedBytes >= 1000 * SizeClass::size(warmIndex));
+        const std::uint64_t bucketRefills = HashBucket::getStats().classes[warmIndex].blockRefills;
+        std::vector<void*> warmSlots;
+        for (int i = 0; i < 1000; ++i)
+        {
+            warmSlots.push_back(HashBucket::useMemory(200));
+        }
+        assert(HashBucket::getStats().classes[warmIndex].blockRefills == bucketRefills);
+        for (void* p : warmSlots)
+        {
+            HashBucket::freeMemory(p, 200);
+        }
+
+        WarmupProfile profile = WarmupProfile::fromStats(HashBucket::getStats());
+        assert(profile.slots[warmIndex] >= 1000);
+        const std::size_t warmedBytes = HashBucket::warmUp(profile);
+        assert(warmedBytes >= profile.slots[warmIndex] * SizeClass::size(warmIndex));
+        const std::size_t largeReserved = HashBucket::reserve(MAX_SLOT_SIZE + 1, 10);
+        assert(largeReserved == 0);
+    }
+
+    // arena：跨 block 的指针碰撞分配，reset() 批量回收并按逆序调用已登记的析构函数
+    {
+        const std::size_t heapFreeBefore = pageHeap.freeBytes();
+        {
+            Arena arena(PAGE_HEAP_PAGE_SIZE);
+            std::vector<char*> chunks;
+            for (int i = 0; i < 1000; ++i)
+            {
+                auto* chunk = static_cast<char*>(arena.allocate(40 + i % 7));
+                std::memset(chunk, i & 0xFF, 40);
+                chunks.push_back(chunk);
+            }
+            for (int i = 0; i < 1000; ++i)
+            {
+                assert(chunks[i][0] == static_cast<char>(i & 0xFF) && chunks[i][39] == static_cast<char>(i & 0xFF));
+            }
+            assert(arena.blockCount() > 1 && arena.bytesAllocated() >= 40 * 1000);
+
+            void* aligned = arena.allocate(10, 256);
+            assert(isAligned(aligned, 256));
+            auto* payload = arena.create<AlignedPayload>();
+            assert(isAligned(payload, alignof(AlignedPayload)));
+            void* huge = arena.allocate(3 * PAGE_HEAP_PAGE_SIZE);  // larger than a block: a block of its own
+            std::memset(huge, 0, 3 * PAGE_HEAP_PAGE_SIZE);
+
+            std::vector<int> order;
+            struct Logged
+            {
+                Logged(std::vector<int>* order, int id) : order(order), id(id) {}
+                ~Logged() { order->push_back(id); }
+                std::vector<int>* order;
+                int id;
+            };
+            arena.create<Logged>(&order, 1);
+            arena.create<std::string>(200, 's');
+            arena.create<Logged>(&order, 2);
+            arena.reset();
+            assert(arena.blockCount() == 0 && arena.bytesReserved() == 0 && arena.bytesAllocated() == 0);
+            assert((order == std::vector<int>{2, 1}));
+
+            {
+                Arena scoped;
+                scoped.create<Logged>(&order, 3);  // going out of scope runs them too
+            }
+            assert((order == std::vector<int>{2, 1, 3}));
+        }
+        assert(pageHeap.freeBytes() >= heapFreeBefore);
+
+        // keepBlocks：reset() 之后复用同一批 block，不再向页堆申请
+        Arena kept(PAGE_HEAP_PAGE_SIZE, true);
+        void* firstRound = nullptr;
+        for (int round = 0; round < 3; ++round)
+        {
+            void* p = kept.allocate(64);
+            if (round == 0)
+            {
+                firstRound = p;
+            }
+            assert(p == firstRound);
+            for (int i = 0; i < 200; ++i)
+            {
+                kept.create<std::vector<int>>(4, i);
+            }
+            kept.reset();
+        }
+        const std::size_t keptBlocks = kept.blockCount();
+        assert(keptBlocks > 1 && kept.bytesAllocated() == 0);
+        kept.allocate(100);
+        assert(kept.blockCount() == keptBlocks);
+        kept.release();
+        assert(kept.blockCount() == 0);
+    }
+
+    // pmr 适配：pmr 容器从 size class 取内存，可以作为 monotonic_buffer_resource 的上游，也可以接到 arena 上
+    {
+        std::pmr::vector<int> numbers(poolResource());
+        for (int i = 0; i < 10000; ++i)
+        {
+            numbers.push_back(i);
+        }
+        assert(numbers[9999] == 9999 && HashBucket::usableSize(numbers.data()) >= 10000 * sizeof(int));
+
+        PoolResource<LockFreeHashBucket> lockFreeResource;
+        assert(lockFreeResource.is_equal(*lockFreePoolResource()));
+        assert(!lockFreeResource.is_equal(*poolResource()));
+        std::pmr::unordered_map<int, std::pmr::string> names(&lockFreeResource);
+        for (int i = 0; i < 2000; ++i)
+        {
+            names.emplace(i, std::pmr::string(std::string(static_cast<std::size_t>(i % 50), 'n')));
+        }
+        assert(names.size() == 2000 && names[49].size() == 49);
+        assert(names[49].get_allocator().resource() == &lockFreeResource);  // uses-allocator construction
+
+        void* overAligned = poolResource()->allocate(100, 128);
+        assert(isAligned(overAligned, 128) && HashBucket::usableSize(overAligned) >= 100);
+        poolResource()->deallocate(overAligned, 100, 128);
+
+        std::pmr::monotonic_buffer_resource monotonic(1024, poolResource());
+        std::pmr::vector<std::pmr::string> strings(&monotonic);
+        for (int i = 0; i < 500; ++i)
+        {
+            strings.emplace_back(64, 'm');
+        }
+        assert(strings.size() == 500 && strings.back().size() == 64);
+
+        Arena arena(PAGE_HEAP_PAGE_SIZE);
+        {
+            ArenaResource arenaResource(arena);
+            std::pmr::vector<long> fromArena(&arenaResource);
+            fromArena.assign(3000, 7);
+            assert(fromArena[2999] == 7 && arena.bytesAllocated() >= 3000 * sizeof(long));
+            assert(!arenaResource.is_equal(*poolResource()));
+        }
+        arena.reset();
+        assert(arena.blockCount() == 0);
+    }
+
+    // striped free lists：每个线程压回自己的 stripe，自己的为空时先整条偷别的 stripe，再切新 slot
+    {
+        LockFreeMemoryPool rounded;
+        rounded.init(64, 4096, true, 6);
+        assert(rounded.stripeCount() == 4);
+        rounded.init(64, 4096, true, 1000);
+        assert(rounded.stripeCount() == LOCK_FREE_MAX_STRIPES);
+        rounded.init(64, 4096, true, 0);
+        assert(rounded.stripeCount() == 1);
+
+        LockFreeMemoryPool striped;
+        striped.init(64, 4096, true, LOCK_FREE_MAX_STRIPES);
+        std::vector<void*> slots;
+        std::thread([&]() {
+            for (int i = 0; i < 200; ++i)
+            {
+                slots.push_back(striped.allocate());
+            }
+            for (void* p : slots)
+            {
+                striped.deallocate(p);
+            }
+        }).join();
+        const std::uint64_t refills = striped.stats().blockRefills;
+        std::unordered_set<void*> stolen;
+        for (int i = 0; i < 200; ++i)
+        {
+            stolen.insert(striped.allocate());
+        }
+        assert(striped.stats().blockRefills == refills && "empty stripe should steal before carving");
+        assert(stolen == std::unordered_set<void*>(slots.begin(), slots.end()));
+        std::vector<void*> back(stolen.begin(), stolen.end());
+        striped.deallocateBatch(back.size() / 2, back.data());
+        for (std::size_t i = back.size() / 2; i < back.size(); ++i)
+        {
+            striped.deallocate(back[i]);
+        }
+        const std::size_t trimmedStriped = striped.trim();
+        assert(trimmedStriped > 0);
+        assert(striped.stats().blocksOwned == 1);
+        // 计数分在各 stripe 上，汇总后仍然精确
+        const PoolStats stripedStats = striped.stats();
+        assert(stripedStats.allocations == 400 && stripedStats.frees == 400);
+    }
+
+    // heap profiler：按字节采样分配并记录调用栈，释放时移出，按调用点和 size class 估算存活字节
+    {
+        HeapProfiler::reset();
+        assert(HeapProfiler::liveSamples() == 0 && !HeapProfiler::running());
+        HeapProfiler::start(4096);
+        // 停止期间每 HEAP_PROFILER_RECHECK_BYTES 才看一次开关，先分配一轮让本线程进入采样
+        for (int i = 0; i < 3 * HEAP_PROFILER_RECHECK_BYTES / 256; ++i)
+        {
+            HashBucket::freeMemory(HashBucket::useMemory(256), 256);
+        }
+        assert(HeapProfiler::liveSamples() == 0);
+
+        std::vector<void*> live;
+        for (int i = 0; i < 20000; ++i)
+        {
+            live.push_back(HashBucket::useMemory(256));
+        }
+        const std::size_t estimate = HeapProfiler::estimatedLiveBytes();
+        assert(HeapProfiler::liveSamples() > 0);
+        assert(estimate > 20000 * 256 * 8 / 10 && estimate < 20000 * 256 * 12 / 10);
+
+        std::ostringstream text;
+        HeapProfiler::dump(text);
+        assert(text.str().find("class_size") != std::string::npos);
+        assert(text.str().find("  256\n    #0 ") != std::string::npos);
+        std::ostringstream pprof;
+        HeapProfiler::dumpPprof(pprof);
+        assert(pprof.str().rfind("heap profile: ", 0) == 0);
+        assert(pprof.str().find("@ heap_v2/4096\n") != std::string::npos);
+        assert(pprof.str().find("\nMAPPED_LIBRARIES:\n") != std::string::npos);
+
+        for (void* p : live)
+        {
+            HashBucket::freeMemory(p);
+        }
+        assert(HeapProfiler::liveSamples() == 0);
+
+        // 大块分配几乎必然被采样
+        std::vector<void*> large;
+        for (int i = 0; i < 8; ++i)
+        {
+            large.push_back(HashBucket::useMemory(100000));
+        }
+        assert(HeapProfiler::liveSamples() == 8);
+        std::ostringstream largeText;
+        HeapProfiler::dump(largeText);
+        assert(largeText.str().find("large\n") != std::string::npos);
+        HashBucket::deallocateBatch(100000, large.size(), large.data());
+        assert(HeapProfiler::liveSamples() == 0);
+
+        HeapProfiler::stop();
+        for (int i = 0; i < 1000; ++i)
+        {
+            live[i] = HashBucket::useMemory(4096);
+        }
+        assert(HeapProfiler::liveSamples() == 0);
+        for (int i = 0; i < 1000; ++i)
+        {
+            HashBucket::freeMemory(live[i], 4096);
+        }
+    }
+
+    std::cout << "Huge-page backed bytes: " << pageHeap.hugePageBytes() << " of " << pageHeap.reservedBytes() << "\n";
     std::cout << "All unit tests passed\n";
     return 0;
 }